@@ -0,0 +1,236 @@
+/**
+ * Microbenchmarks for the hashing, one-time signature, tree and
+ * signing code.
+ *
+ * Every benchmark prints one JSON object per line, so results can be
+ * collected and compared across builds.
+ */
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "crypto_utils.hh"
+#include "initialize.hh"
+#include "sha256.hh"
+#include "sign.hh"
+#include "treehash.hh"
+#include "verify.hh"
+
+using std::array;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::function;
+using std::string;
+using std::vector;
+
+// Gives the benchmarks access to the WOTS internals.
+template <class Params>
+class BenchWOTS: public FixedWeightWOTS<Params>
+{
+public:
+    explicit BenchWOTS(array<byte, HASH_SIZE> key_material, bool keep_levels = false)
+        : FixedWeightWOTS<Params>(key_material, keep_levels) {};
+    using FixedWeightWOTS<Params>::iter_f;
+    using FixedWeightWOTS<Params>::derive_pk;
+    using FixedWeightWOTS<Params>::transform_message;
+    // lets one key sign over and over
+    void reset() { this->used = false; this->derive_pk(); }
+};
+
+static double min_seconds = 0.5;
+
+/**
+ * Time a benchmark and print its result as a line of JSON.
+ *
+ * The benchmark is run with doubling iteration counts until one run
+ * takes at least min_seconds.
+ *
+ * @param[in]  name                    The benchmark name
+ * @param[in]  lg_messages_per_signer  The tree height it was run at, or 0 if it does not depend on one
+ * @param[in]  run                     Runs the operation being measured n times.
+ * @param[in]  wots                    The WOTS parameter set it was run with, or empty if it does not depend on one
+ */
+static void bench(string name, size_t lg_messages_per_signer, function<void(size_t)> run, string wots = "") {
+    size_t n = 1;
+    double seconds;
+    while (true) {
+        auto start = std::chrono::steady_clock::now();
+        run(n);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds >= min_seconds)
+            break;
+        n *= 2;
+    }
+    cout << "{\"benchmark\": \"" << name << "\"";
+    if (lg_messages_per_signer)
+        cout << ", \"lg_messages_per_signer\": " << lg_messages_per_signer;
+    if (!wots.empty())
+        cout << ", \"wots\": \"" << wots << "\"";
+    cout << ", \"iterations\": " << n
+         << ", \"ns_per_op\": " << static_cast<uint64_t>(seconds * 1e9 / n)
+         << ", \"sha256\": \"" << sha256_compress_impl() << "\""
+         << ", \"sha256_multi\": \"" << sha256_multi_impl() << "\"}" << endl;
+}
+
+/**
+ * Benchmarks that do not depend on the tree height.
+ */
+static void bench_primitives() {
+    array<byte, HASH_SIZE> key {};
+    vector<byte> message(1024, 'm');
+    byte out[64] = {0};
+
+    bench("sha256_32", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            sha256_32(out, out);
+    });
+    bench("sha256_1k", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            sha256(message.data(), message.size(), out);
+    });
+    bench("combine", 0, [&](size_t n) {
+        merkle_node a {}, b {};
+        b.index = 1;
+        for (size_t i = 0; i < n; i++)
+            a.hash = combine(a, b).hash;
+    });
+    bench("prg", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            PRG(key.data(), key.size(), out, HASH_SIZE, i);
+    });
+    bench("iter_f", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            BenchWOTS<wots_w4>::iter_f(key, 3);
+    });
+}
+
+/**
+ * Benchmarks of the one-time signatures of one WOTS parameter set.
+ */
+template <class Params>
+static void bench_wots() {
+    string wots = wots_params_name(Params::id);
+    array<byte, HASH_SIZE> key {};
+    vector<byte> message(1024, 'm');
+    message_digest_t digest = digest_message(message);
+    BenchWOTS<Params> w(key);
+
+    bench("derive_pk", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            w.derive_pk();
+    }, wots);
+    bench("transform_message", 0, [&](size_t n) {
+        typename WOTS<Params>::composition_t P;
+        for (size_t i = 0; i < n; i++) {
+            message[0] = i;
+            w.transform_message(message, &P);
+        }
+    }, wots);
+    // a key made to sign keeps its chain levels, as sign and serve make them
+    BenchWOTS<Params> signer(key, true);
+    ots_signature_t signature;
+    bench("ots_sign", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            signer.reset();
+            signer.sign_digest(digest, &signature);
+        }
+    }, wots);
+    bench("ots_verify", 0, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (!BenchWOTS<Params>::verify_digest(w.get_pk(), digest, signature)) {
+                cerr << "ERROR: benchmark one-time signature did not verify." << endl;
+                exit(1);
+            }
+        }
+    }, wots);
+}
+
+/**
+ * Benchmarks of the tree, signing and verification at one tree height.
+ *
+ * Signing works on in-memory signer states, so that the numbers do not
+ * depend on the disk.
+ *
+ * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
+ */
+static void bench_tree(size_t lg_messages_per_signer) {
+    const byte *randomness = reinterpret_cast<const byte *>("benchmarkrandomness");
+    // keep initialize's progress messages out of the results
+    std::streambuf *out = cout.rdbuf(NULL);
+    keys_t *keys = initialize(2, lg_messages_per_signer, randomness, 19);
+    cout.rdbuf(out);
+    cout.clear();
+    vector<byte> message(1024, 'm');
+
+    bench("treehash_update", lg_messages_per_signer, [&](size_t n) {
+        vector<merkle_node> stack;
+        Treehash t(keys->signer_states[0].secret_key, &stack, 0, lg_messages_per_signer);
+        for (size_t i = 0; i < n; i++) {
+            if (i % (1 << lg_messages_per_signer) == 0) {
+                stack.clear();
+                t.initialize(0);
+            }
+            t.update();
+        }
+    });
+
+    signer_info_t signer_state;
+    auto reset_signer = [&]() {
+        signer_state = keys->signer_states[0];
+        for (auto &t : signer_state.treehash_instances)
+            t.set_stack(&signer_state.treehash_stack);
+    };
+    reset_signer();
+    vector<signature_t> signatures;
+    bench("sign", lg_messages_per_signer, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (signer_state.exhausted)
+                reset_signer();
+            signature_t signature = prepare_signature(&signer_state);
+            complete_signature(&signature, signer_state.secret_key, message);
+            if (signatures.size() < 64)
+                signatures.push_back(signature);
+        }
+    });
+
+    bench("verify", lg_messages_per_signer, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (!verify(keys->public_key, message, signatures[i % signatures.size()])) {
+                cerr << "ERROR: benchmark signature did not verify." << endl;
+                exit(1);
+            }
+        }
+    });
+    delete keys;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && string(argv[1]) == "--help") {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./bench [<min_seconds> [<lg_messages_per_signer> ...]]" << endl
+             << endl
+             << "\tmin_seconds is the least time each benchmark runs for, by default 0.5." << endl
+             << "\tTree benchmarks run at each lg_messages_per_signer, by default 4, 8 and 12." << endl
+             << endl;
+        exit(1);
+    }
+    if (argc > 1)
+        min_seconds = std::stod(argv[1]);
+    vector<size_t> heights {4, 8, 12};
+    if (argc > 2)
+        heights.assign(argc - 2, 0);
+    for (int i = 2; i < argc; i++)
+        heights[i - 2] = std::stoi(argv[i]);
+
+    bench_primitives();
+    bench_wots<wots_w4>();
+    bench_wots<wots_w16>();
+    bench_wots<wots_w256>();
+    for (size_t lg_messages_per_signer : heights)
+        bench_tree(lg_messages_per_signer);
+    return 0;
+}
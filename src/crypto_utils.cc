@@ -1,11 +1,14 @@
 #include <openssl/engine.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
-#include <openssl/kdf.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <fstream>
@@ -16,6 +19,8 @@
 
 
 #include "crypto_utils.hh"
+#include "sha256.hh"
+#include "stats.hh"
 
 using std::cerr;
 using std::cout;
@@ -50,6 +55,7 @@ string print_bytes(const byte *bytes, size_t in_size) {
  * @param      out      The out
  */
 void sha256(byte *in, size_t in_size, byte *out) {
+    count_stat(STAT_SHA256_OPENSSL);
     SHA256(in, in_size, out);
 }
 
@@ -63,6 +69,7 @@ void sha256(byte *in, size_t in_size, byte *out) {
  * @param      out      The hash output.
  */
 void sha512(byte *in, size_t in_size, byte *out) {
+    count_stat(STAT_SHA512);
     SHA512(in, in_size, out);
 }
 
@@ -125,8 +132,137 @@ void get_randomness(byte *buf, size_t n_bytes) {
     /* END OPENSSL CODE */
 }
 
+// HKDF salt. Only the first four bytes ("salt") have ever been used.
+static const byte HKDF_SALT[] = {'s', 'a', 'l', 't'};
+
+/**
+ * Precompute the HMAC-SHA256 states after absorbing the padded key.
+ *
+ * @param[in]  key      The HMAC key, at most one block long.
+ * @param[in]  key_len  The key length
+ * @param      inner    The state after the ipad block.
+ * @param      outer    The state after the opad block.
+ */
+static void hmac_key(const byte *key, size_t key_len, uint32_t inner[8], uint32_t outer[8]) {
+    byte ipad[64], opad[64];
+    for (size_t i = 0; i < sizeof(ipad); i++) {
+        byte k = i < key_len ? key[i] : 0;
+        ipad[i] = k ^ 0x36;
+        opad[i] = k ^ 0x5c;
+    }
+    Sha256 i_hash, o_hash;
+    i_hash.update(ipad, sizeof(ipad));
+    i_hash.get_midstate(inner);
+    o_hash.update(opad, sizeof(opad));
+    o_hash.get_midstate(outer);
+}
+
+/**
+ * Write the decimal representation of n, without allocating.
+ *
+ * @param[in]  n     The number
+ * @param      out   At least 20 bytes of output
+ *
+ * @return     The number of characters written.
+ */
+static size_t format_decimal(size_t n, byte *out) {
+    byte digits[20];
+    size_t n_digits = 0;
+    do {
+        digits[n_digits++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    for (size_t i = 0; i < n_digits; i++)
+        out[i] = digits[n_digits - 1 - i];
+    return n_digits;
+}
+
+/**
+ * Constructs a keyed HKDF-SHA256 context.
+ *
+ * Runs HKDF-Extract once, then keeps the HMAC states keyed with the
+ * pseudorandom key so that every later expansion is two compressions
+ * per output block.
+ *
+ * @param[in]  seed      The random seed. Must be a sufficient source of entropy.
+ * @param[in]  seed_len  The seed length
+ */
+HKDF::HKDF(const byte *seed, size_t seed_len) {
+    uint32_t salt_inner[8], salt_outer[8];
+    hmac_key(HKDF_SALT, sizeof(HKDF_SALT), salt_inner, salt_outer);
+
+    byte prk[HASH_SIZE];
+    Sha256 i_hash(salt_inner, 64);
+    i_hash.update(seed, seed_len);
+    i_hash.final(prk);
+    Sha256 o_hash(salt_outer, 64);
+    o_hash.update(prk, HASH_SIZE);
+    o_hash.final(prk);
+
+    hmac_key(prk, HASH_SIZE, this->inner, this->outer);
+}
+
+/**
+ * HMAC-SHA256 under the pseudorandom key.
+ *
+ * @param[in]  in       The message
+ * @param[in]  in_size  Size of in.
+ * @param      out      32 bytes of output.
+ */
+void HKDF::hmac(const byte *in, size_t in_size, byte *out) const {
+    byte inner_hash[HASH_SIZE];
+    Sha256 i_hash(this->inner, 64);
+    i_hash.update(in, in_size);
+    i_hash.final(inner_hash);
+    Sha256 o_hash(this->outer, 64);
+    o_hash.update(inner_hash, HASH_SIZE);
+    o_hash.final(out);
+}
+
 /**
- * General-use PRG using OpenSSL hkdf.
+ * HKDF-Expand with the decimal representation of info as the info string.
+ *
+ * @param      buf      The output buffer
+ * @param[in]  buf_len  The buffer length
+ * @param[in]  info     The extra information
+ */
+void HKDF::expand(byte *buf, size_t buf_len, size_t info) const {
+    if (buf_len > 255 * HASH_SIZE)
+        throw runtime_error("Error: HKDF output too long.");
+
+    // T(i) = HMAC(PRK, T(i-1) || info || i)
+    byte input[HASH_SIZE + 20 + 1];
+    size_t info_len = format_decimal(info, input + HASH_SIZE);
+    byte block[HASH_SIZE];
+    for (size_t i = 1; buf_len; i++) {
+        input[HASH_SIZE + info_len] = i;
+        if (i == 1)
+            this->hmac(input + HASH_SIZE, info_len + 1, block);
+        else
+            this->hmac(input, sizeof(block) + info_len + 1, block);
+        size_t n = std::min(buf_len, sizeof(block));
+        memcpy(buf, block, n);
+        memcpy(input, block, sizeof(block));
+        buf += n;
+        buf_len -= n;
+    }
+}
+
+/**
+ * Expand several outputs for consecutive info values.
+ *
+ * @param      buf         count * out_len bytes of output
+ * @param[in]  out_len     The length of each output
+ * @param[in]  first_info  The info value of the first output
+ * @param[in]  count       The number of outputs
+ */
+void HKDF::expand_batch(byte *buf, size_t out_len, size_t first_info, size_t count) const {
+    for (size_t i = 0; i < count; i++)
+        this->expand(buf + i * out_len, out_len, first_info + i);
+}
+
+/**
+ * General-use PRG using HKDF.
  *
  * example:
  *  byte *seed = sha256("sha");
@@ -134,6 +270,9 @@ void get_randomness(byte *buf, size_t n_bytes) {
  *  PRG(seed, 32, buf, 32, i);
  *  cout << print_bytes(buf, 32) << endl;
  *
+ * Callers that derive many outputs from one seed should keep an HKDF
+ * object instead.
+ *
  * @param[in]  seed      The random seed. Must be a sufficient source of entropy.
  * @param[in]  seed_len  The seed length
  * @param      buf       The output buffer
@@ -141,24 +280,9 @@ void get_randomness(byte *buf, size_t n_bytes) {
  * @param[in]  info      The extra information
  */
 void PRG(const byte *seed, size_t seed_len, byte *buf, size_t buf_len, size_t info) {
-    const char *info_str = std::to_string(info).c_str();
-
-    EVP_PKEY_CTX *pctx;
-    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
-    // see https://github.com/openssl/openssl/blob/c16ab9dc6303e42519559f6053bf7e4931203a79/doc/man3/EVP_PKEY_CTX_set_hkdf_md.pod
-    if (EVP_PKEY_derive_init(pctx) <= 0)
-        throw runtime_error("Error: initializing HKDF failed..");
-    if (EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0)
-        throw runtime_error("Error: HKDF hash function failed.");
-    if (EVP_PKEY_CTX_set1_hkdf_salt(pctx, "salty salt for hbs", 4) <= 0)
-        cerr << "error!" << endl;
-    if (EVP_PKEY_CTX_set1_hkdf_key(pctx, seed, seed_len) <= 0)
-        throw runtime_error("Error: setting HKDF key failed.");
-    if (EVP_PKEY_CTX_add1_hkdf_info(pctx, info_str, strlen(info_str)) <= 0)
-        throw runtime_error("Error: setting HKDF info failed.");
-    if (EVP_PKEY_derive(pctx, buf, &buf_len) <= 0)
-        throw runtime_error("Error: HKDF failed.");
-    EVP_PKEY_CTX_free(pctx);
+    PhaseTimer timer(PHASE_PRG);
+    count_stat(STAT_PRG);
+    HKDF(seed, seed_len).expand(buf, buf_len, info);
 }
 
 /**
@@ -169,9 +293,6 @@ void PRG(const byte *seed, size_t seed_len, byte *buf, size_t buf_len, size_t in
  * @return     A vector containing the raw bytes in the file.
  */
 vector<byte> read_file(string path) {
-    // TODO move hashing here such that
-    // we never have to read the whole file
-    // into memory.
     std::ifstream is(path, std::ifstream::binary);
     is.seekg(0, is.end);
     size_t n_bytes = is.tellg();
@@ -183,3 +304,52 @@ vector<byte> read_file(string path) {
     }
     return data;
 }
+
+// digest_file reads this many bytes at a time
+#define DIGEST_CHUNK_SIZE (1 << 20)
+
+/**
+ * Compute the digest that a message is signed under.
+ *
+ * @param[in]  message  The message
+ *
+ * @return     The sha256 digest of the message.
+ */
+message_digest_t digest_message(const vector<byte> &message) {
+    message_digest_t digest;
+    Sha256 h;
+    h.update(message.data(), message.size());
+    h.final(digest.data());
+    return digest;
+}
+
+/**
+ * Compute the digest that a message file is signed under, streaming it
+ * through the hash so that memory use does not grow with the file.
+ *
+ * @param[in]  path  The path to the file.
+ *
+ * @return     The sha256 digest of the file's contents.
+ */
+message_digest_t digest_file(string path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Could not open " + path);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    vector<byte> chunk(DIGEST_CHUNK_SIZE);
+    Sha256 h;
+    ssize_t n;
+    while ((n = read(fd, chunk.data(), chunk.size())) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            close(fd);
+            throw runtime_error("Could not read " + path);
+        }
+        h.update(chunk.data(), n);
+    }
+    close(fd);
+    message_digest_t digest;
+    h.final(digest.data());
+    return digest;
+}
@@ -3,12 +3,18 @@
  */
 #include <sys/stat.h>
 
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <array>
 
 #include "initialize.hh"
+#include "serve.hh"
 #include "sign.hh"
+#include "stats.hh"
 #include "verify.hh"
 
 using std::array;
@@ -18,6 +24,67 @@ using std::endl;
 using std::string;
 using std::vector;
 
+/**
+ * Remove an option of the form "--name value" from the arguments.
+ *
+ * @param      argc   The argument count, updated
+ * @param      argv   The arguments, updated
+ * @param[in]  name   The option, including the leading dashes
+ * @param      value  The option's value, if present
+ *
+ * @return     True if the option was present.
+ */
+bool take_option(int *argc, char *argv[], string name, string *value) {
+    for (int i = 2; i + 1 < *argc; i++) {
+        if (argv[i] != name)
+            continue;
+        *value = argv[i + 1];
+        for (int j = i; j + 2 < *argc; j++)
+            argv[j] = argv[j + 2];
+        *argc -= 2;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Remove a flag of the form "--name" from the arguments.
+ *
+ * @param      argc  The argument count, updated
+ * @param      argv  The arguments, updated
+ * @param[in]  name  The flag, including the leading dashes
+ *
+ * @return     True if the flag was present.
+ */
+bool take_flag(int *argc, char *argv[], string name) {
+    for (int i = 2; i < *argc; i++) {
+        if (argv[i] != name)
+            continue;
+        for (int j = i; j + 1 < *argc; j++)
+            argv[j] = argv[j + 1];
+        *argc -= 1;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Load a verifier cache file if it exists, or exit if it is for another key.
+ *
+ * @param      cache       The cache
+ * @param[in]  cache_path  The path to the cache file
+ */
+void load_verifier_cache(VerifierCache *cache, string cache_path) {
+    try {
+        cache->load(cache_path);
+    } catch (std::exception &e) {
+        cerr << endl
+             << "ERROR: " << e.what() << endl
+             << endl;
+        exit(1);
+    }
+}
+
 void do_sign(int argc, char *argv[]) {
     if (argc != 5) {
         cout << endl
@@ -54,21 +121,76 @@ void do_sign(int argc, char *argv[]) {
         exit(1);
     }
 
-    vector<byte> message = read_file(message_path);
-    signature_t signature = sign(state_path, message);
+    signature_t signature = sign(state_path, digest_file(message_path));
 
     write_signature(signature, signature_path);
 }
 
+void do_sign_batch(int argc, char *argv[]) {
+    if (argc < 5) {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./hardyhash sign-batch <state_file> <out_dir> <message_file> [<message_file> ...]" << endl
+             << endl
+             << "\tstate_file must be a path to a valid signer state file." << endl
+             << "\tout_dir must be a path to the desired output directory, which must not exist." << endl
+             << "\tthe signature on the i-th message_file will be written to out_dir/signature_i." << endl
+             << endl;
+        exit(1);
+    }
+    string state_path = argv[2];
+    string out_dir = argv[3];
+    vector<string> message_paths(argv + 4, argv + argc);
+
+    struct stat buf;
+    if (stat(state_path.c_str(), &buf)) {
+        cerr << endl
+             << "ERROR: " << state_path << " does not exist." << endl
+             << endl;
+        exit(1);
+    }
+    for (const string &message_path : message_paths) {
+        if (stat(message_path.c_str(), &buf)) {
+            cerr << endl
+                 << "ERROR: " << message_path << " does not exist." << endl
+                 << endl;
+            exit(1);
+        }
+    }
+    if (stat(out_dir.c_str(), &buf) == 0) {
+        cerr << endl
+             << "ERROR: " << out_dir << " already exists." << endl
+             << endl;
+        exit(1);
+    }
+    if (mkdir(out_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR)) {
+        cerr << endl
+             << "ERROR: output directory could not be created."
+             << endl;
+        exit(1);
+    }
+
+    vector<message_digest_t> digests;
+    for (const string &message_path : message_paths)
+        digests.push_back(digest_file(message_path));
+    vector<signature_t> signatures = sign_batch(state_path, digests);
+
+    for (size_t i = 0; i < signatures.size(); i++)
+        write_signature(signatures[i], out_dir + "/signature_" + std::to_string(i));
+}
+
 void do_verify(int argc, char *argv[]) {
+    string cache_path;
+    bool use_cache = take_option(&argc, argv, "--cache", &cache_path);
     if (argc != 5) {
         cout << endl
              << "Usage:" << endl
-             << "\t./hardyhash verify <public_key> <message_file> <signature_file>" << endl
+             << "\t./hardyhash verify [--cache <cache_file>] <public_key> <message_file> <signature_file>" << endl
              << endl
              << "\tpublic_key must be a path to a public key file generated by 'initialize'." << endl
              << "\tmessage_file is the path to the message that had been signed." << endl
              << "\tsignature_file is a path to the signature on message_file." << endl
+             << "\tcache_file keeps tree nodes already verified against public_key between runs." << endl
              << endl;
         exit(1);
     }
@@ -96,11 +218,20 @@ void do_verify(int argc, char *argv[]) {
         exit(1);
     }
 
-    array<byte, HASH_SIZE> pk = load_public_key(public_key);
-    vector<byte> message = read_file(message_path);
-    signature_t signature = load_signature(signature_path);
+    wots_params_t wots_params;
+    array<byte, HASH_SIZE> pk = load_public_key(public_key, &wots_params);
+    message_digest_t digest = digest_file(message_path);
+    SignatureFile signature_file(signature_path);
+    const signature_view_t *signature = signature_file.view();
 
-    bool success = verify(pk, message, signature);
+    VerifierCache cache(pk);
+    if (use_cache)
+        load_verifier_cache(&cache, cache_path);
+    // the signature must use the parameter set recorded in the key
+    bool success = signature && signature->wots_params == wots_params
+                   && verify(pk, digest, *signature, use_cache ? &cache : NULL);
+    if (use_cache)
+        cache.save(cache_path);
     if (!success) {
         cout << "Verification failed." << endl;
         exit(1);
@@ -108,16 +239,293 @@ void do_verify(int argc, char *argv[]) {
     cout << "Verified successfully." << endl;
 }
 
+// verify-batch reads and checks this many manifest entries at a time
+#define VERIFY_BATCH_CHUNK 4096
+
+void do_verify_batch(int argc, char *argv[]) {
+    string cache_path;
+    bool use_cache = take_option(&argc, argv, "--cache", &cache_path);
+    if (argc != 4) {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./hardyhash verify-batch [--cache <cache_file>] <public_key> <manifest_file>" << endl
+             << endl
+             << "\tpublic_key must be a path to a public key file generated by 'initialize'." << endl
+             << "\tmanifest_file lists one '<message_file> <signature_file>' pair per line." << endl
+             << "\tcache_file keeps tree nodes already verified against public_key between runs." << endl
+             << endl;
+        exit(1);
+    }
+    string public_key = argv[2];
+    string manifest_path = argv[3];
+
+    struct stat buf;
+    if (stat(public_key.c_str(), &buf)) {
+        cerr << endl
+             << "ERROR: " << public_key << " does not exist." << endl
+             << endl;
+        exit(1);
+    }
+    std::ifstream manifest(manifest_path);
+    if (!manifest) {
+        cerr << endl
+             << "ERROR: " << manifest_path << " could not be read." << endl
+             << endl;
+        exit(1);
+    }
+
+    wots_params_t wots_params;
+    array<byte, HASH_SIZE> pk = load_public_key(public_key, &wots_params);
+    VerifierCache cache(pk);
+    if (use_cache)
+        load_verifier_cache(&cache, cache_path);
+    size_t n_checked = 0;
+    size_t n_failed = 0;
+    string line;
+    while (manifest) {
+        vector<std::pair<string, string>> entries;
+        vector<message_digest_t> digests;
+        vector<std::unique_ptr<SignatureFile>> signature_files;
+        vector<signature_view_t> signatures;
+        while (entries.size() < VERIFY_BATCH_CHUNK && std::getline(manifest, line)) {
+            std::istringstream fields(line);
+            string message_path, signature_path;
+            if (!(fields >> message_path))
+                continue;  // blank line
+            fields >> signature_path;
+            if (stat(message_path.c_str(), &buf) || stat(signature_path.c_str(), &buf)) {
+                cout << "FAILED: " << message_path << " " << signature_path << " (missing file)" << endl;
+                n_checked++;
+                n_failed++;
+                continue;
+            }
+            std::unique_ptr<SignatureFile> signature_file(new SignatureFile(signature_path));
+            if (!signature_file->view()) {
+                cout << "FAILED: " << message_path << " " << signature_path << " (malformed signature)" << endl;
+                n_checked++;
+                n_failed++;
+                continue;
+            }
+            entries.push_back(std::make_pair(message_path, signature_path));
+            digests.push_back(digest_file(message_path));
+            signatures.push_back(*signature_file->view());
+            signature_files.push_back(std::move(signature_file));
+        }
+
+        vector<bool> results = verify_batch(pk, digests, signatures, 0, &cache);
+        for (size_t i = 0; i < results.size(); i++) {
+            if (!results[i] || signatures[i].wots_params != wots_params) {
+                cout << "FAILED: " << entries[i].first << " " << entries[i].second << endl;
+                n_failed++;
+            }
+        }
+        n_checked += results.size();
+    }
+    if (use_cache)
+        cache.save(cache_path);
+
+    if (n_failed) {
+        cout << "Verification failed for " << n_failed << " of " << n_checked << " signatures." << endl;
+        exit(1);
+    }
+    cout << "Verified " << n_checked << " signatures successfully." << endl;
+}
+
+void do_serve(int argc, char *argv[]) {
+    if (argc < 4) {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./hardyhash serve <socket_path> <state_file> [<state_file> ...]" << endl
+             << endl
+             << "\tsocket_path is the Unix domain socket to listen on, which must not exist." << endl
+             << "\tstate_file must be a path to a valid signer state file." << endl
+             << "\tSigners are addressed by the position of their state file, starting at 0." << endl
+             << "\tStop the daemon with SIGINT or SIGTERM so it can save its signer states." << endl
+             << endl;
+        exit(1);
+    }
+    string socket_path = argv[2];
+    vector<string> state_paths(argv + 3, argv + argc);
+
+    struct stat buf;
+    if (stat(socket_path.c_str(), &buf) == 0) {
+        cerr << endl
+             << "ERROR: " << socket_path << " already exists." << endl
+             << endl;
+        exit(1);
+    }
+    for (const string &state_path : state_paths) {
+        if (stat(state_path.c_str(), &buf)) {
+            cerr << endl
+                 << "ERROR: " << state_path << " does not exist." << endl
+                 << endl;
+            exit(1);
+        }
+    }
+
+    serve(socket_path, state_paths);
+}
+
+void do_sign_remote(int argc, char *argv[]) {
+    if (argc != 6) {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./hardyhash sign-remote <socket_path> <signer> <message_file> <out_file>" << endl
+             << endl
+             << "\tsocket_path is the socket of a running 'hardyhash serve'." << endl
+             << "\tsigner is the position of the signer's state file on the serve command line." << endl
+             << "\tmessage_file is the path to the message to be signed." << endl
+             << "\tthe signature will be written to out_file." << endl
+             << endl;
+        exit(1);
+    }
+    string socket_path = argv[2];
+    uint32_t signer = std::stoul(argv[3]);
+    string message_path = argv[4];
+    string signature_path = argv[5];
+
+    struct stat buf;
+    if (stat(message_path.c_str(), &buf)) {
+        cerr << endl
+             << "ERROR: " << message_path << " does not exist." << endl
+             << endl;
+        exit(1);
+    }
+    if (stat(signature_path.c_str(), &buf) == 0) {
+        cerr << endl
+             << "ERROR: " << signature_path << " already exists." << endl
+             << endl;
+        exit(1);
+    }
+
+    vector<byte> message = read_file(message_path);
+    signature_t signature;
+    try {
+        signature = request_signature(socket_path, signer, message);
+    } catch (std::exception &e) {
+        cerr << endl
+             << "ERROR: " << e.what() << endl
+             << endl;
+        exit(1);
+    }
+
+    write_signature(signature, signature_path);
+}
+
+/**
+ * Parse the value of --threads, or exit if it is not a positive integer.
+ *
+ * @param[in]  has_threads     Whether --threads was given
+ * @param[in]  threads_option  Its value
+ *
+ * @return     The number of threads, or 0 for one per hardware thread.
+ */
+size_t parse_threads(bool has_threads, string threads_option) {
+    if (!has_threads)
+        return 0;
+    int threads = std::stoi(threads_option);
+    if (threads < 1) {
+        cerr << endl
+             << "ERROR: --threads must be a positive integer." << endl
+             << endl;
+        exit(1);
+    }
+    return threads;
+}
+
+/**
+ * Parse the value of --wots, or exit if it names no parameter set.
+ *
+ * @param[in]  has_wots     Whether --wots was given
+ * @param[in]  wots_option  Its value
+ *
+ * @return     The WOTS parameter set, by default WOTS_DEFAULT_PARAMS.
+ */
+wots_params_t parse_wots(bool has_wots, string wots_option) {
+    wots_params_t wots_params = WOTS_DEFAULT_PARAMS;
+    if (has_wots && !parse_wots_params(wots_option, &wots_params)) {
+        cerr << endl
+             << "ERROR: --wots must be one of w4, w16 or w256." << endl
+             << endl;
+        exit(1);
+    }
+    return wots_params;
+}
+
+/**
+ * Exit unless the tree heights are valid.
+ *
+ * @param[in]  lg_n_signers            lg(number of signers)
+ * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
+ */
+void check_heights(size_t lg_n_signers, size_t lg_messages_per_signer) {
+    if (lg_n_signers % 2 || lg_n_signers > 16 || lg_n_signers < 2) {
+        cerr << endl
+             << "ERROR: lg_n_signers must be an even integer between 2 and 16, inclusive." << endl
+             << endl;
+             exit(1);
+    }
+
+    if (lg_messages_per_signer % 2 || lg_messages_per_signer > 16 || lg_messages_per_signer < 2) {
+        cerr << endl
+             << "ERROR: lg_messages_per_signer must be an even integer between 2 and 16, inclusive." << endl
+             << endl;
+             exit(1);
+    }
+}
+
+/**
+ * Create the output directory, or check that there is a run to resume in it.
+ *
+ * @param[in]  out_dir  The output directory
+ * @param[in]  resume   Whether to resume
+ */
+void prepare_output_dir(string out_dir, bool resume) {
+    struct stat buf;
+    if (resume) {
+        if (stat((out_dir + "/checkpoint").c_str(), &buf)) {
+            cerr << endl
+                 << "ERROR: " << out_dir << " has no checkpoint to resume from."
+                 << endl;
+            exit(1);
+        }
+    } else {
+        if (stat(out_dir.c_str(), &buf) == 0) {
+            cerr << endl
+                 << "ERROR: output directory already exitsts."
+                 << endl;
+            exit(1);
+        }
+
+        int status = mkdir(out_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+        if (status) {
+            cerr << endl
+                 << "ERROR: output directory could not be created."
+                 << endl;
+            exit(1);
+        }
+    }
+}
+
 void do_initialize(int argc, char *argv[]) {
+    string threads_option;
+    string wots_option;
+    bool has_threads = take_option(&argc, argv, "--threads", &threads_option);
+    bool has_wots = take_option(&argc, argv, "--wots", &wots_option);
+    bool resume = take_flag(&argc, argv, "--resume");
     if (argc != 6) {
         cout << endl
              << "Usage:" << endl
-             << "\t./hardyhash initialize <lg_n_signers> <lg_messages_per_signer> <randomness> <output_dir>" << endl
+             << "\t./hardyhash initialize [--threads <n>] [--wots <params>] [--resume] <lg_n_signers> <lg_messages_per_signer> <randomness> <output_dir>" << endl
              << endl
              << "\tlg_n_signers must be an even integer between 2 and 16, inclusive." << endl
              << "\tlg_messages_per_signer must be an even integer between 2 and 16, inclusive." << endl
              << "\trandomness should be a source of entropy, at most 1024 characters long." << endl
              << "\toutput_dir must be a path to the desired output directory, which must not exist." << endl
+             << "\tn is the number of threads to use, by default one per hardware thread." << endl
+             << "\tparams is the WOTS parameter set: w4 (the default), w16 or w256. Larger ones" << endl
+             << "\tmake smaller signatures but slower keys, signing and verification." << endl
+             << "\t--resume continues an interrupted run in output_dir, with the same arguments." << endl
              << endl;
              exit(1);
     }
@@ -125,46 +533,142 @@ void do_initialize(int argc, char *argv[]) {
     size_t lg_messages_per_signer = std::stoi(argv[3]);
     string randomness = argv[4];
     string out_dir = argv[5];
+    size_t n_threads = parse_threads(has_threads, threads_option);
+    wots_params_t wots_params = parse_wots(has_wots, wots_option);
+    check_heights(lg_n_signers, lg_messages_per_signer);
+    prepare_output_dir(out_dir, resume);
 
-    if (lg_n_signers % 2 || lg_n_signers > 16 || lg_n_signers < 2) {
+    cout << "Initializing..." << endl;
+    try {
+        initialize_to_directory(lg_n_signers, lg_messages_per_signer,
+                                reinterpret_cast<const byte *>(randomness.c_str()),
+                                randomness.length(), out_dir, n_threads, resume, wots_params);
+    } catch (std::exception &e) {
         cerr << endl
-             << "ERROR: lg_n_signers must be an even integer between 2 and 16, inclusive." << endl
+             << "ERROR: " << e.what() << endl
              << endl;
-             exit(1);
+        exit(1);
     }
+    cout << "Initialized successfully." << endl;
+}
 
-    if (lg_messages_per_signer % 2 || lg_messages_per_signer > 16 || lg_messages_per_signer < 2) {
-        cerr << endl
-             << "ERROR: lg_messages_per_signer must be an even integer between 2 and 16, inclusive." << endl
+void do_initialize_shard(int argc, char *argv[]) {
+    string threads_option;
+    string range_option;
+    string wots_option;
+    bool has_threads = take_option(&argc, argv, "--threads", &threads_option);
+    bool has_range = take_option(&argc, argv, "--range", &range_option);
+    bool has_wots = take_option(&argc, argv, "--wots", &wots_option);
+    bool resume = take_flag(&argc, argv, "--resume");
+    if (argc != 6 || !has_range) {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./hardyhash initialize-shard --range <first>:<end> [--threads <n>] [--wots <params>] [--resume] <lg_n_signers> <lg_messages_per_signer> <randomness> <output_dir>" << endl
+             << endl
+             << "\tComputes the signer states first, ..., end - 1 of an initialize run with the" << endl
+             << "\tsame lg_n_signers, lg_messages_per_signer, randomness and params, and records their" << endl
+             << "\tsubtree roots in output_dir/checkpoint. Join the shards with 'initialize-merge'." << endl
+             << "\toutput_dir must be a path to the desired output directory, which must not exist." << endl
+             << "\tn is the number of threads to use, by default one per hardware thread." << endl
+             << "\tparams is the WOTS parameter set: w4 (the default), w16 or w256. Larger ones" << endl
+             << "\tmake smaller signatures but slower keys, signing and verification." << endl
+             << "\t--resume continues an interrupted run in output_dir, with the same arguments." << endl
              << endl;
              exit(1);
     }
+    size_t lg_n_signers = std::stoi(argv[2]);
+    size_t lg_messages_per_signer = std::stoi(argv[3]);
+    string randomness = argv[4];
+    string out_dir = argv[5];
+    size_t n_threads = parse_threads(has_threads, threads_option);
+    wots_params_t wots_params = parse_wots(has_wots, wots_option);
+    check_heights(lg_n_signers, lg_messages_per_signer);
 
-    struct stat buf;
-    if (stat(out_dir.c_str(), &buf) == 0) {
+    size_t colon = range_option.find(':');
+    long first = -1;
+    long end = -1;
+    if (colon != string::npos) {
+        first = std::stol(range_option.substr(0, colon));
+        end = std::stol(range_option.substr(colon + 1));
+    }
+    if (first < 0 || end <= first || end > (1L << lg_n_signers)) {
         cerr << endl
-             << "ERROR: output directory already exitsts."
+             << "ERROR: --range must be <first>:<end> with 0 <= first < end <= 2^lg_n_signers." << endl
              << endl;
         exit(1);
     }
+    prepare_output_dir(out_dir, resume);
 
-    int status = mkdir(out_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
-    if (status) {
+    try {
+        initialize_range(lg_n_signers, lg_messages_per_signer,
+                         reinterpret_cast<const byte *>(randomness.c_str()), randomness.length(),
+                         out_dir, first, end, n_threads, resume, wots_params);
+    } catch (std::exception &e) {
         cerr << endl
-             << "ERROR: output directory could not be created."
+             << "ERROR: " << e.what() << endl
              << endl;
         exit(1);
     }
+    cout << "Shard " << first << ":" << end << " written to " << out_dir << "." << endl;
+}
 
-    cout << "Initializing..." << endl;
-    keys_t *k = initialize(lg_n_signers, lg_messages_per_signer,
-                           reinterpret_cast<const byte *>(randomness.c_str()),
-                           randomness.length());
-    cout << "Writing signer states and public key to "
-         << out_dir << " ..." << endl;
-    write_signer_states(k, out_dir);
+void do_initialize_merge(int argc, char *argv[]) {
+    string threads_option;
+    bool has_threads = take_option(&argc, argv, "--threads", &threads_option);
+    if (argc < 4) {
+        cout << endl
+             << "Usage:" << endl
+             << "\t./hardyhash initialize-merge [--threads <n>] <output_dir> <checkpoint_file> [<checkpoint_file> ...]" << endl
+             << endl
+             << "\toutput_dir must hold the signer state files of every shard." << endl
+             << "\tcheckpoint_file is the checkpoint written by one 'initialize-shard' run." << endl
+             << "\tThe public key is written to output_dir, and every signer state is completed." << endl
+             << "\tn is the number of threads to use, by default one per hardware thread." << endl
+             << endl;
+        exit(1);
+    }
+    string out_dir = argv[2];
+    vector<string> checkpoint_paths(argv + 3, argv + argc);
+    size_t n_threads = parse_threads(has_threads, threads_option);
+
+    struct stat buf;
+    for (const string &path : checkpoint_paths) {
+        if (stat(path.c_str(), &buf)) {
+            cerr << endl
+                 << "ERROR: " << path << " does not exist." << endl
+                 << endl;
+            exit(1);
+        }
+    }
+
+    try {
+        initialize_merge(out_dir, checkpoint_paths, n_threads);
+    } catch (std::exception &e) {
+        cerr << endl
+             << "ERROR: " << e.what() << endl
+             << endl;
+        exit(1);
+    }
     cout << "Initialized successfully." << endl;
-    delete k;
+}
+
+/**
+ * Print the gathered statistics to stderr as JSON; registered with atexit
+ * so that failing commands report them too.
+ */
+void print_stats() {
+    cerr << stats_json() << endl;
+}
+
+static std::terminate_handler default_terminate;
+
+/**
+ * Print the statistics before an uncaught exception ends the process,
+ * which skips the atexit handlers.
+ */
+static void print_stats_and_terminate() {
+    print_stats();
+    default_terminate();
 }
 
 int main(int argc, char *argv[]) {
@@ -173,23 +677,48 @@ int main(int argc, char *argv[]) {
         cout << endl;
         cout << "Commands:" << endl;
         cout << "  initialize" << endl;
+        cout << "  initialize-shard" << endl;
+        cout << "  initialize-merge" << endl;
         cout << "  sign" << endl;
+        cout << "  sign-batch" << endl;
         cout << "  verify" << endl;
+        cout << "  verify-batch" << endl;
+        cout << "  serve" << endl;
+        cout << "  sign-remote" << endl;
         cout << endl;
         cout << "Run `hardyhash COMMAND` with no arguments for more information about the command."
+             << endl
+             << "Add --stats to any command to print hashing and I/O statistics as JSON to stderr on exit."
              << endl
              << endl;
         exit(1);
     }
+    if (take_flag(&argc, argv, "--stats")) {
+        enable_stats();
+        atexit(print_stats);
+        default_terminate = std::set_terminate(print_stats_and_terminate);
+    }
     string command = argv[1];
     if (command == "initialize") {
         do_initialize(argc, argv);
+    } else if (command == "initialize-shard") {
+        do_initialize_shard(argc, argv);
+    } else if (command == "initialize-merge") {
+        do_initialize_merge(argc, argv);
     } else if (command == "sign") {
         do_sign(argc, argv);
+    } else if (command == "sign-batch") {
+        do_sign_batch(argc, argv);
     } else if (command == "verify") {
         do_verify(argc, argv);
+    } else if (command == "verify-batch") {
+        do_verify_batch(argc, argv);
+    } else if (command == "serve") {
+        do_serve(argc, argv);
+    } else if (command == "sign-remote") {
+        do_sign_remote(argc, argv);
     } else {
-        cout << "Command must be one of 'initialize', 'sign', or 'verify'." << endl;
+        cout << "Command must be one of 'initialize', 'initialize-shard', 'initialize-merge', 'sign', 'sign-batch', 'verify', 'verify-batch', 'serve', or 'sign-remote'." << endl;
         exit(1);
     }
     return 0;
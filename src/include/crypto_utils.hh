@@ -2,6 +2,8 @@
 
 #include <openssl/sha.h>
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -9,10 +11,29 @@ typedef unsigned char byte;
 
 #define HASH_SIZE SHA256_DIGEST_LENGTH
 
+// The sha256 digest of a message, which is all that signing and
+// verification need of it.
+typedef std::array<byte, HASH_SIZE> message_digest_t;
+
 std::string print_bytes(const byte *, size_t);
 void sha256(byte *in, size_t in_bytes, byte *out);
 void sha512(byte *in, size_t in_bytes, byte *out);
 void get_randomness(byte *, size_t);
+class HKDF
+{
+private:
+    uint32_t inner[8];
+    uint32_t outer[8];
+    void hmac(const byte *in, size_t in_size, byte *out) const;
+
+public:
+    HKDF(const byte *seed, size_t seed_len);
+    void expand(byte *buf, size_t buf_len, size_t info) const;
+    void expand_batch(byte *buf, size_t out_len, size_t first_info, size_t count) const;
+};
+
 void PRG(const byte *seed, size_t seed_len, byte *buf, size_t buf_len, size_t info);
 
-std::vector<byte> read_file(std::string path);
\ No newline at end of file
+std::vector<byte> read_file(std::string path);
+message_digest_t digest_message(const std::vector<byte> &message);
+message_digest_t digest_file(std::string path);
\ No newline at end of file
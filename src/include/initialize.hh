@@ -1,4 +1,29 @@
 #include "treehash.hh"
 
-keys_t *initialize(size_t lg_n_signers, size_t lg_messages_per_signer, const byte *randomness, size_t randomness_size);
-void write_signer_states(keys_t *k, std::string output_dir);
\ No newline at end of file
+class ThreadPool;
+
+// The shared top of the merkle tree, stored level by level: the level at
+// height h starts at offset(h) and holds n_signers >> h nodes.
+struct treetop_t {
+    size_t n_signers;
+    std::vector<merkle_node> nodes;
+    size_t offset(size_t height) const;
+    const merkle_node &at(size_t height, size_t index) const;
+};
+
+treetop_t initialize_treetop(const std::vector<merkle_node> &roots, ThreadPool *pool);
+
+keys_t *initialize(size_t lg_n_signers, size_t lg_messages_per_signer, const byte *randomness, size_t randomness_size,
+                   size_t n_threads = 0, wots_params_t wots_params = WOTS_DEFAULT_PARAMS);
+void write_signer_states(keys_t *k, std::string output_dir);
+void initialize_to_directory(size_t lg_n_signers, size_t lg_messages_per_signer,
+                             const byte *randomness, size_t randomness_size,
+                             std::string output_dir, size_t n_threads = 0, bool resume = false,
+                             wots_params_t wots_params = WOTS_DEFAULT_PARAMS);
+std::vector<merkle_node> initialize_range(size_t lg_n_signers, size_t lg_messages_per_signer,
+                                          const byte *randomness, size_t randomness_size,
+                                          std::string output_dir, size_t first, size_t last,
+                                          size_t n_threads = 0, bool resume = false,
+                                          wots_params_t wots_params = WOTS_DEFAULT_PARAMS);
+void initialize_merge(std::string output_dir, const std::vector<std::string> &checkpoint_paths,
+                      size_t n_threads = 0);
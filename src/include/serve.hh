@@ -0,0 +1,8 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "types.hh"
+
+void serve(std::string socket_path, const std::vector<std::string> &state_paths);
+signature_t request_signature(std::string socket_path, uint32_t signer, const std::vector<byte> &message);
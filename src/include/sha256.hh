@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "crypto_utils.hh"
+
+void sha256_compress(uint32_t state[8], const byte *block);
+void sha256_32(const byte *in, byte *out);
+void sha256_64(const byte *in, byte *out);
+const char *sha256_compress_impl();
+
+class Sha256
+{
+private:
+    uint32_t state[8];
+    byte buffer[64];
+    size_t buffered;
+    uint64_t n_bytes;
+
+public:
+    Sha256();
+    Sha256(const uint32_t midstate[8], uint64_t n_bytes);
+    void update(const byte *in, size_t in_size);
+    void final(byte *out);
+    void get_midstate(uint32_t out[8]);
+};
+
+void sha256_32_multi(const byte *in, byte *out, size_t n);
+size_t sha256_multi_lanes();
+const char *sha256_multi_impl();
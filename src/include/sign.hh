@@ -1,7 +1,31 @@
+#include <iostream>
 #include <vector>
 #include <string>
 
 #include "types.hh"
 
-signature_t sign(std::string state_path, const std::vector<byte> &message);
+signature_t sign(std::string state_path, const std::vector<byte> &message, std::ostream &log = std::cout);
+signature_t sign(std::string state_path, const message_digest_t &digest, std::ostream &log = std::cout);
+std::vector<signature_t> sign_batch(std::string state_path, const std::vector<std::vector<byte>> &messages,
+                                    size_t n_threads = 0, std::ostream &log = std::cout);
+std::vector<signature_t> sign_batch(std::string state_path, const std::vector<message_digest_t> &messages,
+                                    size_t n_threads = 0, std::ostream &log = std::cout);
+signature_t prepare_signature(signer_info_t *signer_info);
+void complete_signature(signature_t *signature, const std::array<byte, HASH_SIZE> &secret_key,
+                        const std::vector<byte> &message);
+void complete_signature(signature_t *signature, const std::array<byte, HASH_SIZE> &secret_key,
+                        const message_digest_t &digest);
+template <class Params>
+void complete_signature(signature_t *signature, FixedWeightWOTS<Params> *ots, const std::vector<byte> &message);
+template <class Params>
+void complete_signature(signature_t *signature, FixedWeightWOTS<Params> *ots, const message_digest_t &digest);
+size_t next_leaf_index(const signer_info_t *signer_info);
+void advance_signer(signer_info_t *signer_info);
+void update_auth_path(signer_info_t *signer_info);
+
+signer_info_t *load_signer_info(std::string path);
+void write_signer_info(std::string path, const signer_info_t &signer_info);
+void journal_leaf(std::string state_path, size_t leaf_index);
+bool read_journal(std::string state_path, size_t *last_used);
+void clear_journal(std::string state_path);
 void write_signature(const signature_t &signature, std::string path);
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "types.hh"
+
+#define SIGNATURE_FILE_MAGIC "hhsig"
+#define SIGNATURE_FILE_VERSION 1
+
+// A signature file is this header followed by fixed-size arrays:
+//   byte ots[wots_width(wots_params)][HASH_SIZE];
+//   byte auth_path[auth_path_length][HASH_SIZE];
+// auth_path[h] is the sibling of the leaf's ancestor at height h, on its
+// right iff bit h of tree_index is 0. The one-time public key is not
+// stored: the verifier recomputes it from ots and the message. Neither is
+// the leaf's index within its signer's subtree, which tree_index already
+// determines.
+struct signature_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t wots_params;
+    uint32_t auth_path_length;
+    uint32_t reserved;  // zero
+    uint64_t tree_index;  // the leaf among the leaves of the whole tree
+};
+
+// A signature in the file layout, read in place: ots and auth_path point
+// into the buffer it was viewed from.
+struct signature_view_t {
+    wots_params_t wots_params;
+    uint64_t tree_index;
+    size_t auth_path_length;
+    const byte *ots;
+    const byte *auth_path;
+};
+
+// A signature file mapped into memory, so that it is verified where it
+// lies. Files from before the layout existed are read with cereal.
+class SignatureFile
+{
+private:
+    void *map;
+    size_t map_size;
+    signature_t legacy;
+    signature_view_t signature_view;
+    bool valid;
+
+public:
+    explicit SignatureFile(std::string path);
+    ~SignatureFile();
+    SignatureFile(const SignatureFile &) = delete;
+    SignatureFile &operator=(const SignatureFile &) = delete;
+    const signature_view_t *view() const;
+};
+
+size_t signature_file_size(wots_params_t wots_params, size_t auth_path_length);
+void encode_signature(const signature_t &signature, std::vector<byte> *image);
+bool view_signature(const byte *image, size_t image_size, signature_view_t *view);
+signature_view_t view_signature(const signature_t &signature);
+void copy_signature(const signature_view_t &view, signature_t *signature);
+void decode_signature(const byte *image, size_t image_size, signature_t *signature);
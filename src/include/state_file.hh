@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "types.hh"
+
+#define STATE_FILE_MAGIC "hhstate"
+#define STATE_FILE_VERSION 2
+
+// On-disk form of a merkle node.
+struct packed_node_t {
+    byte hash[HASH_SIZE];
+    uint32_t index;
+    uint32_t height;
+};
+
+// On-disk form of a treehash instance. Its secret is the signer's.
+struct packed_treehash_t {
+    uint64_t leaf_index;
+    uint64_t nodes_on_stack;
+    uint64_t n_updates;
+    uint64_t h;
+    uint32_t initialized;
+    uint32_t reserved;
+    packed_node_t node;
+};
+
+// A state file is this header followed by fixed-size arrays:
+//   byte auth_path[auth_path_length][HASH_SIZE];
+//   byte keep[height][HASH_SIZE];
+//   packed_treehash_t treehash_instances[height - 1];
+//   packed_node_t treehash_stack[height];    (stack_size of them in use)
+// Every field sits at an offset that depends only on height and
+// auth_path_length, so a file is read without any parsing. The auth path
+// and keep nodes are stored by height; their indices follow from
+// signer_index and leaf_index.
+struct state_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t height;
+    uint32_t auth_path_length;
+    uint32_t stack_size;
+    uint32_t exhausted;
+    uint32_t wots_params;  // a wots_params_t
+    uint32_t signer_index;
+    uint32_t leaf_index;
+    byte checksum[HASH_SIZE];  // sha256 of the file with this field zeroed
+    byte secret_key[HASH_SIZE];
+    byte retain[HASH_SIZE];
+};
+
+// The header of version 1 files, whose auth path and keep nodes are
+// packed_node_t.
+struct state_header_v1_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t height;
+    uint32_t auth_path_length;
+    uint32_t stack_size;
+    uint32_t exhausted;
+    uint32_t wots_params;  // zero, WOTS_W4, in files from before it was recorded
+    byte checksum[HASH_SIZE];
+    byte secret_key[HASH_SIZE];
+    packed_node_t retain;
+};
+
+void encode_signer_state(const signer_info_t &signer_info, std::vector<byte> *image);
+void decode_signer_state(const byte *image, size_t image_size, signer_info_t *signer_info);
+void read_state_file(std::string path, signer_info_t *signer_info);
+void write_state_file(std::string path, const signer_info_t &signer_info);
+void sync_file(std::string path);
+void commit_state_file(std::string path, const signer_info_t &signer_info);
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Event counters.
+enum stat_counter {
+    STAT_SHA256_COMPRESSIONS,  // SHA-256 blocks compressed by sha256.cc
+    STAT_SHA256_OPENSSL,       // arbitrary-length sha256 calls
+    STAT_SHA512,
+    STAT_PRG,
+    STAT_COMBINE,              // merkle nodes combined into their parent
+    N_STAT_COUNTERS
+};
+
+// Timed phases. Phases may nest, e.g. derive_pk includes its prg call,
+// so their times do not add up to the total.
+enum stat_phase {
+    PHASE_PRG,
+    PHASE_DERIVE_PK,
+    PHASE_TRANSFORM_MESSAGE,
+    PHASE_UPDATE_AUTH_PATH,
+    PHASE_TREEHASH,
+    PHASE_STATE_LOAD,
+    PHASE_STATE_SAVE,
+    PHASE_STATE_SYNC,
+    PHASE_SIGNATURE_IO,
+    N_STAT_PHASES
+};
+
+// Statistics are only gathered once enabled, so that they cost a single
+// branch otherwise.
+extern std::atomic<bool> stats_enabled;
+extern std::atomic<uint64_t> stat_counts[N_STAT_COUNTERS];
+extern std::atomic<uint64_t> phase_calls[N_STAT_PHASES];
+extern std::atomic<uint64_t> phase_nanoseconds[N_STAT_PHASES];
+
+/**
+ * Add to an event counter.
+ *
+ * @param[in]  counter  The counter
+ * @param[in]  n        The number of events
+ */
+inline void count_stat(stat_counter counter, uint64_t n = 1) {
+    if (stats_enabled.load(std::memory_order_relaxed))
+        stat_counts[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Times the enclosing scope as one call of a phase.
+class PhaseTimer
+{
+private:
+    stat_phase phase;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit PhaseTimer(stat_phase phase) : phase(phase) {
+        if (stats_enabled.load(std::memory_order_relaxed))
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer() {
+        if (!stats_enabled.load(std::memory_order_relaxed))
+            return;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        phase_calls[phase].fetch_add(1, std::memory_order_relaxed);
+        phase_nanoseconds[phase].fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+    }
+};
+
+void enable_stats();
+void reset_stats();
+std::string stats_json();
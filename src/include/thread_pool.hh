@@ -0,0 +1,40 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable task_ready;
+    std::condition_variable all_done;
+    size_t queued;
+    size_t pending;
+    size_t next_queue;
+    bool stopping;
+    std::exception_ptr error;
+
+    bool take(size_t worker, std::function<void()> *task);
+    void work(size_t worker);
+
+public:
+    explicit ThreadPool(size_t n_threads = 0);
+    ~ThreadPool();
+    void submit(std::function<void()> task);
+    void wait();
+    size_t size() const;
+    size_t worker_index() const;
+};
@@ -4,6 +4,8 @@
 
 #include "types.hh"
 
+struct packed_treehash_t;
+
 // See https://www.cdc.informatik.tu-darmstadt.de/reports/reports/AuthPath.pdf
 
 class Treehash
@@ -11,6 +13,7 @@ class Treehash
 private:
     std::vector<merkle_node> *global_stack;
     std::array<byte, HASH_SIZE> secret;
+    wots_params_t wots_params = WOTS_DEFAULT_PARAMS;  // the legacy format leaves it out
     size_t leaf_index;
     std::vector<merkle_node> *leaves = NULL;
     size_t nodes_on_stack;
@@ -19,6 +22,10 @@ private:
 
     // give cereal access to it can serialize private elements
     friend class cereal::access;
+    // and the fixed-layout state file format, too
+    friend void pack_treehash(const Treehash &t, packed_treehash_t *packed);
+    friend void unpack_treehash(const packed_treehash_t &packed, const std::array<byte, HASH_SIZE> &secret,
+                                wots_params_t wots_params, Treehash *t);
     template<class Archive>
     void serialize(Archive & archive) {
         archive( initialized, n_updates, secret, leaf_index, nodes_on_stack, node, h );
@@ -27,11 +34,12 @@ private:
 
 public:
     merkle_node leafcalc(size_t leaf_index);
-    Treehash(std::array<byte, HASH_SIZE> secret, std::vector<merkle_node>* global_stack, size_t leaf_index = 0, size_t h = -1, std::vector<merkle_node> *leaves = NULL);
+    Treehash(std::array<byte, HASH_SIZE> secret, std::vector<merkle_node>* global_stack, size_t leaf_index = 0, size_t h = -1, std::vector<merkle_node> *leaves = NULL, wots_params_t wots_params = WOTS_DEFAULT_PARAMS);
     merkle_node node {};
     size_t h;
     size_t height();
     std::vector<merkle_node> update(std::vector<merkle_node> *to_save);
+    void update(std::vector<merkle_node> *to_save, std::vector<merkle_node> *saved);
     void update();
     Treehash(){}; // empty default constructor for cereal to call
     void initialize(size_t leaf_index);
@@ -1,5 +1,6 @@
 #pragma once
 #include <array>
+#include <stdexcept>
 #include <vector>
 
 #include <cereal/access.hpp>
@@ -24,30 +25,119 @@ struct merkle_node {
     }
 };
 
+// Signatures written before their nodes lost their tags start with the
+// length of the auth path; these start with this instead.
+#define SIGNATURE_COMPACT_MARK 0xffffffffffffffffULL
+
 struct signature_t {
-    std::vector<merkle_node> auth_path;
-    merkle_node leaf;
-    ots_signature_t ots;
+    // auth_path[h] is the sibling of the leaf's ancestor at height h, so
+    // its index is (tree_index >> h) ^ 1 and only its hash is kept
+    std::vector<std::array<byte, HASH_SIZE>> auth_path;
+    uint64_t tree_index = 0;  // the leaf's index among the leaves of the whole tree
+    merkle_node leaf;  // the one-time public key, indexed within the signer's subtree
+    ots_signature_t ots {};
+    wots_params_t wots_params = WOTS_DEFAULT_PARAMS;
 
+    // ots is written as a size tag and that many hashes, as it was when it
+    // was a vector; the size tells the parameter sets apart
     template<class Archive>
-    void serialize(Archive & archive) {
-        archive(auth_path, leaf, ots);
+    void save(Archive & archive) const {
+        cereal::size_type ots_size = wots_width(wots_params);
+        uint64_t mark = SIGNATURE_COMPACT_MARK;
+        archive(mark, tree_index, leaf.index, auth_path, leaf.hash, cereal::make_size_tag(ots_size));
+        for (size_t i = 0; i < ots_size; i++)
+            archive(ots[i]);
+    }
+
+    template<class Archive>
+    void load(Archive & archive) {
+        uint64_t mark;
+        archive(mark);
+        if (mark == SIGNATURE_COMPACT_MARK) {
+            archive(tree_index, leaf.index, auth_path, leaf.hash);
+        } else {
+            // the tagged form: the auth path's nodes, then the leaf
+            if (mark > 64)
+                throw std::runtime_error("Bad authentication path length.");
+            std::vector<merkle_node> tagged_auth_path(mark);
+            for (merkle_node &mn : tagged_auth_path)
+                archive(mn);
+            archive(leaf);
+            tree_index = 0;
+            auth_path.resize(tagged_auth_path.size());
+            for (size_t h = 0; h < tagged_auth_path.size(); h++) {
+                tree_index |= (uint64_t) (~tagged_auth_path[h].index & 1) << h;
+                auth_path[h] = tagged_auth_path[h].hash;
+            }
+        }
+        leaf.height = 0;
+        cereal::size_type ots_size;
+        archive(cereal::make_size_tag(ots_size));
+        if (!wots_params_for_width(ots_size, &wots_params))
+            throw std::runtime_error("Bad one-time signature size.");
+        for (size_t i = 0; i < ots_size; i++)
+            archive(ots[i]);
     }
 };
 
 struct signer_info_t {
     std::array<byte, HASH_SIZE> secret_key;
-    std::vector<merkle_node> auth_path;
-    merkle_node retain;
+    // auth_path[h] is the sibling of the next leaf's ancestor at height h,
+    // up to the root of the whole tree
+    std::vector<std::array<byte, HASH_SIZE>> auth_path;
+    std::array<byte, HASH_SIZE> retain;
     std::vector<Treehash> treehash_instances;
-    std::vector<merkle_node> keep;
+    std::vector<std::array<byte, HASH_SIZE>> keep;  // keep[h] is at height h
     std::vector<merkle_node> treehash_stack;
     merkle_node root;
+    uint32_t signer_index = 0;
+    uint32_t leaf_index = 0;  // the leaf that will sign the next message
     bool exhausted;
+    wots_params_t wots_params = WOTS_DEFAULT_PARAMS;  // not in the legacy format, whose keys are all WOTS_W4
 
+    // The legacy format, which tags each node with its height and its
+    // index within the signer's subtree, or within the top of the tree.
     template<class Archive>
-    void serialize(Archive & archive) {
-        archive(secret_key, auth_path, retain, treehash_instances, keep, exhausted, treehash_stack);
+    void save(Archive & archive) const {
+        std::vector<merkle_node> tagged_auth_path(auth_path.size()), tagged_keep(keep.size());
+        merkle_node tagged_retain;
+        for (size_t h = 0; h < auth_path.size(); h++) {
+            size_t index = h < keep.size() ? leaf_index >> h : signer_index >> (h - keep.size());
+            tagged_auth_path[h] = tagged_node(auth_path[h], h, index ^ 1);
+        }
+        for (size_t h = 0; h < keep.size(); h++)
+            tagged_keep[h] = tagged_node(keep[h], h, 0);
+        tagged_retain = tagged_node(retain, keep.size() - 2, 3);
+        archive(secret_key, tagged_auth_path, tagged_retain, treehash_instances, tagged_keep, exhausted,
+                treehash_stack);
+    }
+
+    template<class Archive>
+    void load(Archive & archive) {
+        std::vector<merkle_node> tagged_auth_path, tagged_keep;
+        merkle_node tagged_retain;
+        archive(secret_key, tagged_auth_path, tagged_retain, treehash_instances, tagged_keep, exhausted,
+                treehash_stack);
+        if (tagged_keep.size() < 2 || tagged_auth_path.size() <= tagged_keep.size())
+            throw std::runtime_error("Malformed signer state.");
+        leaf_index = tagged_auth_path.front().index ^ 1;
+        signer_index = tagged_auth_path[tagged_keep.size()].index ^ 1;
+        auth_path.resize(tagged_auth_path.size());
+        for (size_t h = 0; h < tagged_auth_path.size(); h++)
+            auth_path[h] = tagged_auth_path[h].hash;
+        keep.resize(tagged_keep.size());
+        for (size_t h = 0; h < tagged_keep.size(); h++)
+            keep[h] = tagged_keep[h].hash;
+        retain = tagged_retain.hash;
+    }
+
+private:
+    static merkle_node tagged_node(const std::array<byte, HASH_SIZE> &hash, size_t height, size_t index) {
+        merkle_node mn;
+        mn.hash = hash;
+        mn.height = height;
+        mn.index = index;
+        return mn;
     }
 };
 
@@ -55,6 +145,7 @@ struct keys_t {
     std::array<byte, HASH_SIZE> public_key;
     std::vector<signer_info_t> signer_states;
     unsigned int n_signers;
+    wots_params_t wots_params;
 };
 
 std::ostream& operator << (std::ostream& os, const merkle_node& mn);
@@ -63,6 +154,9 @@ bool operator < (const merkle_node &a, const merkle_node &b);
 
 merkle_node combine(merkle_node a, merkle_node b);
 
-merkle_node leafcalc(byte *secret, size_t secret_len, size_t index);
+std::array<byte, HASH_SIZE> combine(const std::array<byte, HASH_SIZE> &left, const std::array<byte, HASH_SIZE> &right);
+
+merkle_node leafcalc(byte *secret, size_t secret_len, size_t index, wots_params_t wots_params);
 
-WOTS_CLASS wotscalc(byte *secret, size_t secret_len, size_t index);
\ No newline at end of file
+template <class Params>
+FixedWeightWOTS<Params> wotscalc(byte *secret, size_t secret_len, size_t index, bool keep_levels = false);
\ No newline at end of file
@@ -1,5 +1,55 @@
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "signature_file.hh"
 #include "types.hh"
 
-bool verify(const std::array<byte, HASH_SIZE> &pk, const std::vector<byte> &message, const signature_t &signature);
+// Default number of nodes a VerifierCache holds; enough for the whole
+// treetop of 2^16 signers.
+#define VERIFIER_CACHE_CAPACITY (1 << 18)
+
+class VerifierCache
+{
+private:
+    std::mutex lock;
+    std::array<byte, HASH_SIZE> public_key;
+    size_t capacity;
+    size_t path_length = 0;
+    // nodes proven to be in the tree under public_key, by (height, index)
+    std::map<std::pair<size_t, uint64_t>, std::array<byte, HASH_SIZE>> nodes;
+
+    bool has(size_t height, uint64_t index, const byte *hash) const;
+
+public:
+    VerifierCache(const std::array<byte, HASH_SIZE> &public_key, size_t capacity = VERIFIER_CACHE_CAPACITY);
+    const std::array<byte, HASH_SIZE> &get_public_key() const;
+    size_t size();
+    bool covers(const signature_view_t &signature, size_t height, const std::array<byte, HASH_SIZE> &node);
+    void insert(const signature_view_t &signature, const std::vector<std::array<byte, HASH_SIZE>> &path);
+    bool load(std::string path);
+    void save(std::string path);
+};
+
+bool verify(const std::array<byte, HASH_SIZE> &pk, const std::vector<byte> &message, const signature_t &signature,
+            VerifierCache *cache = NULL);
+bool verify(const std::array<byte, HASH_SIZE> &pk, const message_digest_t &digest, const signature_t &signature,
+            VerifierCache *cache = NULL);
+bool verify(const std::array<byte, HASH_SIZE> &pk, const message_digest_t &digest, const signature_view_t &signature,
+            VerifierCache *cache = NULL);
+bool verify_leaf(const signature_view_t &signature, const std::array<byte, HASH_SIZE> &leaf,
+                 const std::array<byte, HASH_SIZE> &pk);
+bool verify_leaf(const signature_view_t &signature, const std::array<byte, HASH_SIZE> &leaf,
+                 const std::array<byte, HASH_SIZE> &pk, VerifierCache *cache);
+std::vector<bool> verify_batch(const std::array<byte, HASH_SIZE> &pk, const std::vector<std::vector<byte>> &messages,
+                               const std::vector<signature_t> &signatures, size_t n_threads = 0,
+                               VerifierCache *cache = NULL);
+std::vector<bool> verify_batch(const std::array<byte, HASH_SIZE> &pk, const std::vector<message_digest_t> &messages,
+                               const std::vector<signature_t> &signatures, size_t n_threads = 0,
+                               VerifierCache *cache = NULL);
+std::vector<bool> verify_batch(const std::array<byte, HASH_SIZE> &pk, const std::vector<message_digest_t> &messages,
+                               const std::vector<signature_view_t> &signatures, size_t n_threads = 0,
+                               VerifierCache *cache = NULL);
 signature_t load_signature(std::string path);
-std::array<byte, HASH_SIZE> load_public_key(std::string path);
\ No newline at end of file
+std::array<byte, HASH_SIZE> load_public_key(std::string path, wots_params_t *wots_params = NULL);
\ No newline at end of file
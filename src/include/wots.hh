@@ -1,65 +1,180 @@
+#pragma once
 #include <array>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "crypto_utils.hh"
+#include "sha256.hh"
 
-typedef std::vector<std::array<byte, HASH_SIZE> > ots_signature_t;
+// The WOTS parameter sets a key can be generated with, as recorded in
+// the public key, the signer states and every signature.
+enum wots_params_t : uint8_t {
+    WOTS_W4 = 0,
+    WOTS_W16 = 1,
+    WOTS_W256 = 2
+};
+
+#define WOTS_DEFAULT_PARAMS WOTS_W4
+
+// The most chains of any parameter set.
+#define WOTS_MAX_WIDTH 134
+
+// One hash per chain, with room for the widest parameter set.
+typedef std::array<std::array<byte, HASH_SIZE>, WOTS_MAX_WIDTH> ots_signature_t;
+static_assert(sizeof(ots_signature_t) == WOTS_MAX_WIDTH * HASH_SIZE, "chain values must be back to back");
+
+// Composition counts exceed 2^256 but stay under 2^264 (263 bits at most,
+// for w4), so they are stored as little-endian 320-bit integers in native
+// 64-bit limbs. wots_parameter_set checks that every set fits.
+#define COUNT_LIMBS 5
+typedef std::array<uint64_t, COUNT_LIMBS> count_t;
+
+// The number of bits needed to hold n.
+constexpr size_t bit_length(size_t n) {
+    return n ? 1 + bit_length(n >> 1) : 0;
+}
+
+const char *wots_params_name(wots_params_t params);
+bool parse_wots_params(std::string name, wots_params_t *params);
+size_t wots_width(wots_params_t params);
+bool wots_params_for_width(size_t width, wots_params_t *params);
+
+// The chain function f, and the hash that compresses the chain ends into
+// the one-time public key.
+struct sha256_chain_hash {
+    static void f(const byte *in, byte *out) { sha256_32(in, out); }
+    static void f_multi(const byte *in, byte *out, size_t n) { sha256_32_multi(in, out, n); }
+    static void compress(const byte *in, size_t in_size, byte *out) { sha256(const_cast<byte *>(in), in_size, out); }
+};
+
+/**
+ * A WOTS parameter set: width chains of depth + 1 values each, messages
+ * mapped to compositions of weight, and chains built with Hash.
+ */
+template <wots_params_t Id, size_t Width, size_t Depth, size_t Weight, class Hash>
+struct wots_parameter_set {
+    static constexpr wots_params_t id = Id;
+    static constexpr size_t width = Width;
+    static constexpr size_t depth = Depth;
+    static constexpr size_t weight = Weight;
+    typedef Hash hash;
+    static_assert(Width <= WOTS_MAX_WIDTH, "WOTS_MAX_WIDTH is too small");
+    // every composition count is at most (Depth + 1)^Width, and the sums
+    // that build the counts table at most twice that
+    static_assert(Width * bit_length(Depth) + 1 <= 64 * COUNT_LIMBS, "composition counts overflow count_t");
+};
+
+template <wots_params_t Id, size_t Width, size_t Depth, size_t Weight, class Hash>
+constexpr size_t wots_parameter_set<Id, Width, Depth, Weight, Hash>::width;
+template <wots_params_t Id, size_t Width, size_t Depth, size_t Weight, class Hash>
+constexpr size_t wots_parameter_set<Id, Width, Depth, Weight, Hash>::depth;
 
-#define WOTS_CLASS FixedWeightWOTS
+// Each width is the least that still has 2^256 compositions of the weight.
+typedef wots_parameter_set<WOTS_W4, 134, 3, 241, sha256_chain_hash> wots_w4;
+typedef wots_parameter_set<WOTS_W16, 66, 15, 495, sha256_chain_hash> wots_w16;
+typedef wots_parameter_set<WOTS_W256, 34, 255, 4335, sha256_chain_hash> wots_w256;
 
+/**
+ * Call f with a value of the parameter set type named by params.
+ *
+ * @param[in]  params  The parameter set
+ * @param[in]  f       A generic callable, e.g. [&](auto set) { FixedWeightWOTS<decltype(set)> ... }
+ */
+template <class F>
+void with_wots_params(wots_params_t params, F f) {
+    switch (params) {
+        case WOTS_W4: f(wots_w4()); return;
+        case WOTS_W16: f(wots_w16()); return;
+        case WOTS_W256: f(wots_w256()); return;
+    }
+    throw std::runtime_error("Unknown WOTS parameter set.");
+}
+
+template <class Params>
 class WOTS
 {
-private:
+public:
+    // A transformed message: the level revealed on every chain.
+    typedef std::array<size_t, Params::width> composition_t;
 
 protected:
     std::array<byte, HASH_SIZE> sk_seed;
     std::array<byte, HASH_SIZE> pk;
-    size_t depth;
-    size_t width;
     bool used;
-    std::vector<byte> derive_sk();
-    static std::array<byte, HASH_SIZE> iter_f(std::array<byte, HASH_SIZE>, size_t n_iters);
+    // level l of chain i at (l * width + i) * HASH_SIZE; only kept by keys
+    // made for signing, and NULL otherwise
+    std::unique_ptr<std::array<byte, (Params::depth + 1) * Params::width * HASH_SIZE>> chain_values;
+    void derive_sk(byte *sk);
+    static void iter_f(std::array<byte, HASH_SIZE> &value, size_t n_iters);
+    static void iter_f_multi(byte *chains, const size_t *n_iters);
+
+    void derive_pk();
+    void sign_composition(const composition_t &P, ots_signature_t *signature);
+    static bool verify_composition(const std::array<byte, HASH_SIZE> &pk, const composition_t &P,
+                                   const ots_signature_t &signature);
+    static void recover_pk(const composition_t &P, const byte *signature, std::array<byte, HASH_SIZE> *pk);
 
-    virtual void derive_pk() = 0;
-    virtual std::vector<size_t> transform_message(std::vector<byte> message) = 0;
+    explicit WOTS(std::array<byte, HASH_SIZE> key_material, bool keep_levels = false);
+    WOTS() {}; // for verification
 
 public:
-    WOTS(std::array<byte, HASH_SIZE> key_material, size_t width, size_t depth);
-    WOTS(size_t width, size_t height); // for verification
+    WOTS(WOTS &&) = default;
+    WOTS &operator=(WOTS &&) = default;
+    ~WOTS();
     std::array<byte, HASH_SIZE> get_pk();
-    virtual ots_signature_t sign(std::vector<byte> message) = 0;
-    virtual bool verify(std::array<byte, HASH_SIZE> pk, std::vector<byte> message, ots_signature_t signature) = 0;
 };
 
-class BasicWOTS: public WOTS
+template <class Params>
+class BasicWOTS: public WOTS<Params>
 {
-private:
-
 protected:
-    void derive_pk();
-    std::vector<size_t> transform_message(std::vector<byte> message);
-
+    static void transform_message(const std::vector<byte> &message, typename WOTS<Params>::composition_t *P);
 
 public:
-    explicit BasicWOTS(std::array<byte, HASH_SIZE> key_material) : WOTS(key_material, 134, 3) {
-        this->derive_pk();
-    };
-
-    BasicWOTS() : WOTS(134, 3) {};
-    ots_signature_t sign(std::vector<byte> message);
-    bool verify(std::array<byte, HASH_SIZE> pk, std::vector<byte> message, ots_signature_t signature);
+    explicit BasicWOTS(std::array<byte, HASH_SIZE> key_material, bool keep_levels = false)
+        : WOTS<Params>(key_material, keep_levels) {};
+    BasicWOTS() {};
+    void sign(const std::vector<byte> &message, ots_signature_t *signature);
+    static bool verify(const std::array<byte, HASH_SIZE> &pk, const std::vector<byte> &message,
+                       const ots_signature_t &signature);
 };
 
-class FixedWeightWOTS: public BasicWOTS
+template <class Params>
+class FixedWeightWOTS: public WOTS<Params>
 {
-private:
-    const int WeightConstant = 241;
-
 protected:
-    std::vector<size_t> transform_message(std::vector<byte> message);
+    static void transform_message(const std::vector<byte> &message, typename WOTS<Params>::composition_t *P);
+    static void transform_digest(const message_digest_t &digest, typename WOTS<Params>::composition_t *P);
 
 public:
-    explicit FixedWeightWOTS(std::array<byte, HASH_SIZE> key_material) : BasicWOTS(key_material) {};
-    FixedWeightWOTS() : BasicWOTS() {};
-};
\ No newline at end of file
+    explicit FixedWeightWOTS(std::array<byte, HASH_SIZE> key_material, bool keep_levels = false)
+        : WOTS<Params>(key_material, keep_levels) {};
+    FixedWeightWOTS() {};
+    void sign(const std::vector<byte> &message, ots_signature_t *signature);
+    void sign_digest(const message_digest_t &digest, ots_signature_t *signature);
+    static bool verify(const std::array<byte, HASH_SIZE> &pk, const std::vector<byte> &message,
+                       const ots_signature_t &signature);
+    static bool verify_digest(const std::array<byte, HASH_SIZE> &pk, const message_digest_t &digest,
+                              const ots_signature_t &signature);
+    static void recover_pk_digest(const message_digest_t &digest, const byte *signature,
+                                  std::array<byte, HASH_SIZE> *pk);
+
+    // The lexicographic numbering of compositions that digests are mapped through.
+    static count_t composition_count();
+    static count_t composition_to_index(const typename WOTS<Params>::composition_t &P);
+    static void index_to_composition(const count_t &index, typename WOTS<Params>::composition_t *P);
+};
+
+// Defined in wots.cc for these parameter sets.
+extern template class WOTS<wots_w4>;
+extern template class WOTS<wots_w16>;
+extern template class WOTS<wots_w256>;
+extern template class BasicWOTS<wots_w4>;
+extern template class BasicWOTS<wots_w16>;
+extern template class BasicWOTS<wots_w256>;
+extern template class FixedWeightWOTS<wots_w4>;
+extern template class FixedWeightWOTS<wots_w16>;
+extern template class FixedWeightWOTS<wots_w256>;
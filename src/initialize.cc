@@ -1,25 +1,29 @@
 #include "initialize.hh"
 
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <fstream>
-#include <future>
 #include <iostream>
-#include <map>
-#include <thread>
+#include <mutex>
+#include <stdexcept>
 
 #include <cereal/archives/binary.hpp>
 #include <cereal/types/array.hpp>
 #include <cereal/types/stack.hpp>
 #include <cereal/types/vector.hpp>
 
+#include "state_file.hh"
+#include "thread_pool.hh"
+
 using std::array;
 using std::cout;
 using std::endl;
-using std::make_pair;
-using std::map;
-using std::pair;
 using std::string;
 using std::vector;
 
@@ -35,37 +39,74 @@ using std::vector;
 vector<array<byte, HASH_SIZE> > generate_secret_keys(size_t n_keys, const byte *randomness, size_t randomness_size) {
     vector<array<byte, HASH_SIZE> > secret_keys(n_keys);
     cout << "Generating " << n_keys << " secret keys." << endl;
-    for (unsigned int i = 0; i < n_keys; i++) {
-        cout << i << "/" << n_keys << "\r";
-        cout.flush();
-        PRG(randomness, randomness_size, secret_keys[i].data(), HASH_SIZE, i);
-    }
+    HKDF prg(randomness, randomness_size);
+    prg.expand_batch(secret_keys[0].data(), HASH_SIZE, 0, n_keys);
     cout << "Keys generated successfully." << endl;
     return secret_keys;
 }
 
+// Scratch space for computing subtrees, reused by each worker thread.
+struct subtree_workspace {
+    vector<merkle_node> stack;
+    vector<merkle_node> to_save;
+    vector<merkle_node> saved;
+    signer_info_t signer_state;
+};
+
+// Counts finished tasks and prints each new whole percent.
+class Progress
+{
+private:
+    std::atomic<size_t> n_done;
+    size_t total;
+    string what;
+    std::mutex lock;
+    size_t last_percent;
+
+public:
+    Progress(size_t total, string what) : n_done(0), total(total), what(what), last_percent(0) {}
+
+    void tick() {
+        size_t done = ++n_done;
+        size_t percent = done * 100 / total;
+        std::lock_guard<std::mutex> guard(lock);
+        if (percent > last_percent) {
+            last_percent = percent;
+            cout << "\r" << done << " of " << total << " " << what << " (" << percent << "%)" << std::flush;
+        }
+    }
+};
+
 /**
  * Compute a single signer's subtree.
  *
- * @param[in]  secret_key  The signer's secret key
- * @param[in]  height      The height of the subtree.
- *
- * @return     The incomplete initialization state
- *             (still missing the top of the auth path.)
+ * @param[in]  secret_key    The signer's secret key
+ * @param[in]  height        The height of the subtree.
+ * @param[in]  wots_params   The WOTS parameter set of the leaves.
+ * @param      signer_state  The incomplete initialization state
+ *                           (still missing the top of the auth path.)
+ * @param      workspace     Scratch space, reused between calls.
  */
-signer_info_t initialize_subtree(array<byte, HASH_SIZE> secret_key, size_t height) {
-    signer_info_t signer_state;
-    signer_state.secret_key = secret_key;
-    signer_state.auth_path.resize(height);
-    signer_state.keep.resize(height);
-    signer_state.exhausted = false;
-    Treehash t(secret_key, &signer_state.treehash_stack, 0, height);
+void initialize_subtree(const array<byte, HASH_SIZE> &secret_key, size_t height, wots_params_t wots_params,
+                        signer_info_t *signer_state, subtree_workspace *workspace) {
+    signer_state->secret_key = secret_key;
+    signer_state->wots_params = wots_params;
+    signer_state->auth_path.assign(height, array<byte, HASH_SIZE>());
+    signer_state->keep.assign(height, array<byte, HASH_SIZE>());
+    signer_state->leaf_index = 0;
+    signer_state->treehash_stack.clear();
+    signer_state->exhausted = false;
+    workspace->stack.clear();
+    Treehash t(secret_key, &workspace->stack, 0, height, NULL, wots_params);
+    signer_state->treehash_instances.clear();
+    signer_state->treehash_instances.reserve(height - 1);
     for (size_t h = 0; h <= height - 2; h++) {
-        Treehash tinner(secret_key, &signer_state.treehash_stack, 0, h);
-        signer_state.treehash_instances.push_back(tinner);
+        Treehash tinner(secret_key, &signer_state->treehash_stack, 0, h, NULL, wots_params);
+        signer_state->treehash_instances.push_back(tinner);
     }
 
-    vector<merkle_node> to_save;
+    vector<merkle_node> &to_save = workspace->to_save;
+    to_save.clear();
     for (size_t i = 0; i < height; i ++) {
         // save the auth path
         merkle_node placeholder;
@@ -90,94 +131,143 @@ signer_info_t initialize_subtree(array<byte, HASH_SIZE> secret_key, size_t heigh
     sort(to_save.begin(), to_save.end());
     reverse(to_save.begin(), to_save.end());
 
-    vector<merkle_node> saved;
-    saved.reserve(to_save.size());
+    vector<merkle_node> &saved = workspace->saved;
+    saved.clear();
     for (int i = 0; i < 1 << height; i++) {
-        vector<merkle_node> newly_saved = t.update(&to_save);
-        saved.insert(saved.end(), newly_saved.begin(), newly_saved.end());
+        t.update(&to_save, &saved);
     }
 
     // assign relevant saved values to their positions in the signer_state.
-    for (merkle_node mn : saved) {
+    for (const merkle_node &mn : saved) {
         if (mn.index == 1)
-            signer_state.auth_path[mn.height] = mn;
+            signer_state->auth_path[mn.height] = mn.hash;
         else if (mn.index == 3 && mn.height < height - 2)
-            signer_state.treehash_instances[mn.height].node = mn;
+            signer_state->treehash_instances[mn.height].node = mn;
         else if (mn.index == 3 && mn.height == height - 2)
-            signer_state.retain = mn;
+            signer_state->retain = mn.hash;
         else if (mn.index == 0 && mn.height == height)
-            signer_state.root = mn;
+            signer_state->root = mn;
     }
-    return signer_state;
 }
 
 /**
  * Initialize each of the signers' subtrees.
  *
+ * The subtrees are computed on a work-stealing thread pool, each worker
+ * reusing its own scratch space, with progress reported as they finish.
+ *
  * @param[in]  secret_keys             The secret keys for each signer
  * @param[in]  lg_messages_per_signer  The height of each subtree.
+ * @param[in]  n_threads               The number of threads, or 0 for one per hardware thread.
+ * @param[in]  wots_params             The WOTS parameter set of the leaves.
  *
  * @return     Initialization states for each signer without the top of the auth path.
  */
-vector<signer_info_t> initialize_subtrees(vector<array<byte, HASH_SIZE>> secret_keys, size_t lg_messages_per_signer) {
+vector<signer_info_t> initialize_subtrees(const vector<array<byte, HASH_SIZE>> &secret_keys,
+                                          size_t lg_messages_per_signer, size_t n_threads,
+                                          wots_params_t wots_params) {
     vector<signer_info_t> signer_states(secret_keys.size());
-    cout << "Initializing " << secret_keys.size() << " subtrees, each of height " << lg_messages_per_signer << endl;
-    vector<std::future<signer_info_t> > future_signer_info(secret_keys.size());
+    ThreadPool pool(n_threads);
+    cout << "Initializing " << secret_keys.size() << " subtrees, each of height " << lg_messages_per_signer
+         << ", on " << pool.size() << " threads" << endl;
+    vector<subtree_workspace> workspaces(pool.size() + 1);
+    Progress progress(secret_keys.size(), "subtrees done");
     for (size_t i = 0; i < secret_keys.size(); i++) {
-        // Hooray for new C++ threading!
-        future_signer_info[i] = async(initialize_subtree, secret_keys[i], lg_messages_per_signer);
+        pool.submit([&, i]() {
+            initialize_subtree(secret_keys[i], lg_messages_per_signer, wots_params, &signer_states[i],
+                               &workspaces[pool.worker_index()]);
+            progress.tick();
+        });
     }
+    pool.wait();
 
-    for (size_t i = 0; i < secret_keys.size(); i++) {
-        signer_states[i] = future_signer_info[i].get();
-    }
-
-    cout << "Initialization successful." << endl;
+    cout << endl << "Initialization successful." << endl;
     return signer_states;
 }
 
+// Levels of the treetop with more nodes than this are split into tasks
+// of this many nodes.
+#define TREETOP_CHUNK 4096
+
+/**
+ * The offset of a level in treetop_t::nodes.
+ *
+ * @param[in]  height  The height in the treetop
+ *
+ * @return     The index of the level's first node.
+ */
+size_t treetop_t::offset(size_t height) const {
+    return 2 * this->n_signers - ((2 * this->n_signers) >> height);
+}
+
 /**
- * Calculate the shared top of the merkle tree.
+ * A node of the treetop.
  *
- * @param      keys  The information that's been calculated for the subtrees.
+ * @param[in]  height  The height in the treetop
+ * @param[in]  index   The index within the level
  *
- * @return     A vector containing every node in the top of the tree.
+ * @return     The node.
  */
-vector<merkle_node> initialize_treetop(keys_t *keys) {
+const merkle_node &treetop_t::at(size_t height, size_t index) const {
+    return this->nodes[this->offset(height) + index];
+}
+
+/**
+ * Calculate the shared top of the merkle tree, one level at a time.
+ *
+ * The nodes of each level are independent, so large levels are spread
+ * over the thread pool.
+ *
+ * @param[in]  roots  The root of each signer's subtree, in signer order.
+ * @param      pool   The thread pool
+ *
+ * @return     Every node in the top of the tree.
+ */
+treetop_t initialize_treetop(const vector<merkle_node> &roots, ThreadPool *pool) {
     cout << "Calculating public key..." << endl;
-    vector<merkle_node> subtree_roots;
-    subtree_roots.reserve(keys->signer_states.size());
-    for (size_t i = 0; i < keys->signer_states.size(); i++) {
-        merkle_node root = keys->signer_states[i].root;
-        root.height = 0;
-        root.index = i;
-        subtree_roots.push_back(root);
+    treetop_t treetop;
+    treetop.n_signers = roots.size();
+    treetop.nodes.resize(2 * roots.size() - 1);
+    for (size_t i = 0; i < roots.size(); i++) {
+        merkle_node &leaf = treetop.nodes[i];
+        leaf = roots[i];
+        leaf.height = 0;
+        leaf.index = i;
     }
-    vector<merkle_node> global_stack;
-    array<byte, HASH_SIZE> empty_secret;
-    // TODO replace 1000 with log keys->n_signers (or -1)
-    Treehash t(empty_secret, &global_stack, 0, 1000, &subtree_roots);
-    vector<merkle_node> to_save;
-    to_save.reserve(keys->n_signers * 2 - 1);
-    for (size_t h = 0; (size_t) (1 << h) <= keys->n_signers; h++) {
-        for (size_t ix = 0; ix < keys->n_signers / (1 << h); ix++) {
-            merkle_node placeholder;
-            placeholder.height = h;
-            placeholder.index = ix;
-            to_save.push_back(placeholder);
+    for (size_t h = 1; (size_t) (1 << h) <= roots.size(); h++) {
+        const merkle_node *children = &treetop.nodes[treetop.offset(h - 1)];
+        merkle_node *level = &treetop.nodes[treetop.offset(h)];
+        size_t level_size = roots.size() >> h;
+        auto combine_range = [=](size_t first, size_t last) {
+            for (size_t ix = first; ix < last; ix++)
+                level[ix] = combine(children[2 * ix], children[2 * ix + 1]);
+        };
+        if (level_size <= TREETOP_CHUNK) {
+            combine_range(0, level_size);
+            continue;
         }
-    }
-    sort(to_save.begin(), to_save.end());
-    reverse(to_save.begin(), to_save.end());
-
-    vector<merkle_node> saved;
-    saved.reserve(to_save.size());
-    for (size_t i = 0; i < keys->n_signers; i++) {
-        vector<merkle_node> newly_saved = t.update(&to_save);
-        saved.insert(saved.end(), newly_saved.begin(), newly_saved.end());
+        for (size_t first = 0; first < level_size; first += TREETOP_CHUNK)
+            pool->submit([=]() { combine_range(first, std::min<size_t>(first + TREETOP_CHUNK, level_size)); });
+        pool->wait();
     }
     cout << "Public key calculated." << endl;
-    return saved;
+    return treetop;
+}
+
+/**
+ * Complete a signer's auth path with the neighbors of its subtree's
+ * ancestors in the treetop.
+ *
+ * @param      signer_state  The signer state
+ * @param[in]  signer_index  The signer's index
+ * @param[in]  lg_n_signers  The height of the treetop
+ * @param[in]  treetop       The treetop
+ */
+void append_top_auth_path(signer_info_t *signer_state, size_t signer_index, size_t lg_n_signers,
+                          const treetop_t &treetop) {
+    signer_state->signer_index = signer_index;
+    for (size_t height = 0; height < lg_n_signers; height++)
+        signer_state->auth_path.push_back(treetop.at(height, (signer_index >> height) ^ 1).hash);
 }
 
 /**
@@ -187,37 +277,32 @@ vector<merkle_node> initialize_treetop(keys_t *keys) {
  * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
  * @param[in]  randomness              Random bytes to act as a seed.
  * @param[in]  randomness_size         Size of randomness.
+ * @param[in]  n_threads               The number of threads, or 0 for one per hardware thread.
+ * @param[in]  wots_params             The WOTS parameter set of every one-time key.
  *
  * @return     Initial signer states for all signers, and a global public key.
  */
-keys_t *initialize(size_t lg_n_signers, size_t lg_messages_per_signer, const byte *randomness, size_t randomness_size) {
+keys_t *initialize(size_t lg_n_signers, size_t lg_messages_per_signer, const byte *randomness, size_t randomness_size,
+                   size_t n_threads, wots_params_t wots_params) {
     assert(lg_n_signers <= 16);
     assert(lg_messages_per_signer <= 16);
     assert(lg_n_signers % 2 == 0);
     assert(lg_messages_per_signer % 2 == 0);
     keys_t *k = new keys_t;
     k->n_signers = 1 << lg_n_signers;
+    k->wots_params = wots_params;
     vector<array<byte, HASH_SIZE>> secret_keys = generate_secret_keys(k->n_signers, randomness, randomness_size);
-    k->signer_states = initialize_subtrees(secret_keys, lg_messages_per_signer);
-    vector<merkle_node> treetop = initialize_treetop(k);
-    map<pair<unsigned char, unsigned int>, merkle_node > treetop_map;
-    for (merkle_node node : treetop)
-        treetop_map[make_pair(node.height, node.index)] = node;
-    for (size_t i = 0; i < k->signer_states.size(); i++) {
-        size_t index = i;
-        for (unsigned char height = 0; height < lg_n_signers; height++) {
-            size_t neighbor = index + 1;
-            if (index % 2 == 1) {
-                neighbor = index - 1;
-            }
-            merkle_node neighbor_data = treetop_map[make_pair(height, neighbor)];
-            neighbor_data.height += lg_n_signers;
-            k->signer_states[i].auth_path.push_back(neighbor_data);
-            index = index / 2;
-        }
-    }
+    k->signer_states = initialize_subtrees(secret_keys, lg_messages_per_signer, n_threads, wots_params);
+    vector<merkle_node> roots;
+    roots.reserve(k->n_signers);
+    for (const signer_info_t &signer_state : k->signer_states)
+        roots.push_back(signer_state.root);
+    ThreadPool pool(n_threads);
+    treetop_t treetop = initialize_treetop(roots, &pool);
+    for (size_t i = 0; i < k->signer_states.size(); i++)
+        append_top_auth_path(&k->signer_states[i], i, lg_n_signers, treetop);
 
-    k->public_key = treetop_map[make_pair(lg_n_signers, 0)].hash;
+    k->public_key = treetop.at(lg_n_signers, 0).hash;
     return k;
 }
 
@@ -234,6 +319,32 @@ void print_initialize_usage() {
     exit(1);
 }
 
+/**
+ * Write one signer state file.
+ *
+ * @param[in]  signer_state  The signer state
+ * @param[in]  path          The path to the state file
+ */
+void write_signer_state(const signer_info_t &signer_state, string path) {
+    write_state_file(path, signer_state);
+}
+
+/**
+ * Write the public key file: the root hash, then the WOTS parameter set.
+ *
+ * Readers from before the parameter set was recorded only read the hash.
+ *
+ * @param[in]  public_key   The public key
+ * @param[in]  wots_params  The WOTS parameter set of every one-time key.
+ * @param[in]  output_dir   The output directory.
+ */
+void write_public_key(const array<byte, HASH_SIZE> &public_key, wots_params_t wots_params, string output_dir) {
+    std::ofstream os(output_dir + "/public_key");
+    cereal::BinaryOutputArchive oarchive(os);
+    uint8_t params = wots_params;
+    oarchive(public_key, params);
+}
+
 /**
  * Writes signer states to a an existing directory.
  *
@@ -241,12 +352,342 @@ void print_initialize_usage() {
  * @param[in]  output_dir  The output directory.
  */
 void write_signer_states(keys_t *k, string output_dir) {
-    for (size_t i = 0; i < k->signer_states.size(); i++) {
-        std::ofstream os(output_dir + "/signer_" + std::to_string(i));
-        cereal::BinaryOutputArchive oarchive(os);
-        oarchive(k->signer_states[i]);
+    for (size_t i = 0; i < k->signer_states.size(); i++)
+        write_signer_state(k->signer_states[i], output_dir + "/signer_" + std::to_string(i));
+    write_public_key(k->public_key, k->wots_params, output_dir);
+}
+
+#define CHECKPOINT_MAGIC "hhck"
+#define CHECKPOINT_VERSION 2
+
+// The checkpoint file starts with this header, followed by one record
+// for each subtree whose signer state has been durably written.
+struct checkpoint_header_t {
+    char magic[4];
+    uint32_t version;
+    uint32_t lg_n_signers;
+    uint32_t lg_messages_per_signer;
+    byte seed_hash[HASH_SIZE];  // sha256 of the randomness, to catch a resume with other randomness
+    uint32_t wots_params;
+};
+
+struct checkpoint_record_t {
+    uint32_t signer_index;
+    byte root[HASH_SIZE];
+};
+
+/**
+ * The checkpoint header for a set of parameters.
+ *
+ * @param[in]  lg_n_signers            lg(number of signers)
+ * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
+ * @param[in]  randomness              The randomness
+ * @param[in]  randomness_size         Size of randomness.
+ * @param[in]  wots_params             The WOTS parameter set of every one-time key.
+ *
+ * @return     The header.
+ */
+checkpoint_header_t make_checkpoint_header(size_t lg_n_signers, size_t lg_messages_per_signer,
+                                           const byte *randomness, size_t randomness_size,
+                                           wots_params_t wots_params) {
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.lg_n_signers = lg_n_signers;
+    header.lg_messages_per_signer = lg_messages_per_signer;
+    sha256(const_cast<byte *>(randomness), randomness_size, header.seed_hash);
+    header.wots_params = wots_params;
+    return header;
+}
+
+/**
+ * Read the subtree roots recorded in a checkpoint file.
+ *
+ * A torn record at the end, from an interrupted write, is ignored.
+ *
+ * @param[in]  path    The path to the checkpoint file
+ * @param      header  The header
+ * @param      done    Whether each signer's subtree is recorded
+ * @param      roots   The recorded subtree roots
+ *
+ * @return     The number of whole records.
+ */
+size_t read_checkpoint(string path, checkpoint_header_t *header, vector<bool> *done, vector<merkle_node> *roots) {
+    std::ifstream is(path, std::ifstream::binary);
+    if (!is.read(reinterpret_cast<char *>(header), sizeof(*header))
+            || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != CHECKPOINT_VERSION
+            || header->lg_n_signers > 16
+            || header->wots_params > WOTS_W256)
+        throw std::runtime_error(path + " is not a checkpoint file.");
+    size_t n_signers = 1 << header->lg_n_signers;
+    done->assign(n_signers, false);
+    roots->resize(n_signers);
+    checkpoint_record_t record;
+    size_t n_records = 0;
+    for (; is.read(reinterpret_cast<char *>(&record), sizeof(record)); n_records++) {
+        if (record.signer_index >= n_signers)
+            throw std::runtime_error(path + " records an unknown signer.");
+        (*done)[record.signer_index] = true;
+        std::copy(record.root, record.root + HASH_SIZE, (*roots)[record.signer_index].hash.begin());
+        (*roots)[record.signer_index].height = header->lg_messages_per_signer;
+        (*roots)[record.signer_index].index = 0;
     }
-    std::ofstream os(output_dir + "/public_key");
-    cereal::BinaryOutputArchive oarchive(os);
-    oarchive(k->public_key);
+    return n_records;
+}
+
+/**
+ * Durably append a subtree root to a checkpoint file.
+ *
+ * @param[in]  fd            The checkpoint file, opened for appending
+ * @param[in]  signer_index  The signer's index
+ * @param[in]  root          The root of the signer's subtree
+ */
+void append_checkpoint(int fd, size_t signer_index, const merkle_node &root) {
+    checkpoint_record_t record;
+    record.signer_index = signer_index;
+    std::copy(root.hash.begin(), root.hash.end(), record.root);
+    if (write(fd, &record, sizeof(record)) != sizeof(record) || fsync(fd) != 0)
+        throw std::runtime_error("Could not write checkpoint.");
+}
+
+/**
+ * Compute a range of subtrees, writing each signer state to disk as soon
+ * as it is done.
+ *
+ * Each finished subtree is recorded, with its root, in the checkpoint
+ * file in output_dir, so an interrupted run can be resumed. The written
+ * states still lack the top of their auth paths.
+ *
+ * @param[in]  lg_n_signers            lg(number of signers)
+ * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
+ * @param[in]  randomness              Random bytes to act as a seed.
+ * @param[in]  randomness_size         Size of randomness.
+ * @param[in]  output_dir              An existing directory for the signer states and checkpoint.
+ * @param[in]  first                   The first signer to compute
+ * @param[in]  last                    One past the last signer to compute
+ * @param[in]  n_threads               The number of threads, or 0 for one per hardware thread.
+ * @param[in]  resume                  Continue from the checkpoint in output_dir.
+ * @param[in]  wots_params             The WOTS parameter set of every one-time key.
+ *
+ * @return     The subtree root of every signer recorded in the checkpoint.
+ */
+vector<merkle_node> initialize_range(size_t lg_n_signers, size_t lg_messages_per_signer,
+                                     const byte *randomness, size_t randomness_size,
+                                     string output_dir, size_t first, size_t last,
+                                     size_t n_threads, bool resume, wots_params_t wots_params) {
+    assert(lg_n_signers <= 16);
+    assert(lg_messages_per_signer <= 16);
+    assert(lg_n_signers % 2 == 0);
+    assert(lg_messages_per_signer % 2 == 0);
+    size_t n_signers = 1 << lg_n_signers;
+    assert(first < last && last <= n_signers);
+    string checkpoint_path = output_dir + "/checkpoint";
+    checkpoint_header_t header = make_checkpoint_header(lg_n_signers, lg_messages_per_signer,
+                                                        randomness, randomness_size, wots_params);
+    vector<bool> done(n_signers, false);
+    vector<merkle_node> roots(n_signers);
+    int checkpoint_fd;
+    if (resume) {
+        checkpoint_header_t found;
+        size_t n_records = read_checkpoint(checkpoint_path, &found, &done, &roots);
+        if (found.lg_n_signers != lg_n_signers || found.lg_messages_per_signer != lg_messages_per_signer
+                || found.wots_params != wots_params
+                || memcmp(found.seed_hash, header.seed_hash, HASH_SIZE) != 0)
+            throw std::runtime_error(checkpoint_path + " was written with different parameters or randomness.");
+        checkpoint_fd = open(checkpoint_path.c_str(), O_WRONLY | O_APPEND);
+        // drop a torn record, so that new records are appended on a record boundary
+        off_t length = sizeof(header) + n_records * sizeof(checkpoint_record_t);
+        if (checkpoint_fd >= 0 && (ftruncate(checkpoint_fd, length) != 0 || fsync(checkpoint_fd) != 0)) {
+            close(checkpoint_fd);
+            checkpoint_fd = -1;
+        }
+    } else {
+        checkpoint_fd = open(checkpoint_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (checkpoint_fd >= 0 && (write(checkpoint_fd, &header, sizeof(header)) != sizeof(header)
+                                   || fsync(checkpoint_fd) != 0)) {
+            close(checkpoint_fd);
+            checkpoint_fd = -1;
+        }
+    }
+    if (checkpoint_fd < 0)
+        throw std::runtime_error("Could not open " + checkpoint_path);
+
+    vector<array<byte, HASH_SIZE>> secret_keys = generate_secret_keys(n_signers, randomness, randomness_size);
+    size_t n_todo = std::count(done.begin() + first, done.begin() + last, false);
+    if (n_todo < last - first)
+        cout << "Resuming: " << last - first - n_todo << " subtrees already done." << endl;
+
+    ThreadPool pool(n_threads);
+    vector<subtree_workspace> workspaces(pool.size() + 1);
+    cout << "Initializing " << n_todo << " subtrees, each of height " << lg_messages_per_signer
+         << ", on " << pool.size() << " threads" << endl;
+    if (n_todo) {
+        Progress progress(n_todo, "subtrees written");
+        std::mutex checkpoint_lock;
+        for (size_t i = first; i < last; i++) {
+            if (done[i])
+                continue;
+            pool.submit([&, i]() {
+                subtree_workspace &workspace = workspaces[pool.worker_index()];
+                initialize_subtree(secret_keys[i], lg_messages_per_signer, wots_params, &workspace.signer_state,
+                                   &workspace);
+                string path = output_dir + "/signer_" + std::to_string(i);
+                commit_state_file(path, workspace.signer_state);
+                roots[i] = workspace.signer_state.root;
+                {
+                    std::lock_guard<std::mutex> guard(checkpoint_lock);
+                    append_checkpoint(checkpoint_fd, i, roots[i]);
+                }
+                progress.tick();
+            });
+        }
+        pool.wait();
+        cout << endl;
+    }
+    close(checkpoint_fd);
+    cout << "Initialization successful." << endl;
+    return roots;
+}
+
+/**
+ * Recompute the root of a signer's subtree from the one-time key of its
+ * next leaf and the bottom of its auth path.
+ *
+ * @param[in]  signer_state  The signer state
+ * @param[in]  height        The height of the signer's subtree
+ *
+ * @return     The subtree root.
+ */
+static array<byte, HASH_SIZE> recompute_subtree_root(signer_info_t *signer_state, size_t height) {
+    size_t leaf_index = signer_state->leaf_index;
+    array<byte, HASH_SIZE> node = leafcalc(signer_state->secret_key.data(), signer_state->secret_key.size(),
+                                           leaf_index, signer_state->wots_params).hash;
+    for (size_t h = 0; h < height; h++) {
+        if ((leaf_index >> h) & 1)
+            node = combine(signer_state->auth_path[h], node);
+        else
+            node = combine(node, signer_state->auth_path[h]);
+    }
+    return node;
+}
+
+/**
+ * Compute the treetop from the subtree roots, complete the auth path in
+ * every signer state in output_dir, and write the public key.
+ *
+ * Each state is checked against its root first, so that a stale or
+ * mixed-up state file stops the run before a public key is written that
+ * it cannot sign under. Completing a state is idempotent, so this can be
+ * rerun after an interruption.
+ *
+ * @param[in]  lg_n_signers            lg(number of signers)
+ * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
+ * @param[in]  roots                   The root of every signer's subtree
+ * @param[in]  output_dir              The directory holding every signer state.
+ * @param[in]  n_threads               The number of threads, or 0 for one per hardware thread.
+ * @param[in]  wots_params             The WOTS parameter set, recorded in the public key.
+ */
+void complete_signer_states(size_t lg_n_signers, size_t lg_messages_per_signer,
+                            const vector<merkle_node> &roots, string output_dir, size_t n_threads,
+                            wots_params_t wots_params) {
+    size_t n_signers = roots.size();
+    ThreadPool pool(n_threads);
+    treetop_t treetop = initialize_treetop(roots, &pool);
+    vector<signer_info_t> signer_states(pool.size() + 1);
+    Progress progress(n_signers, "auth paths completed");
+    for (size_t i = 0; i < n_signers; i++) {
+        pool.submit([&, i]() {
+            signer_info_t &signer_state = signer_states[pool.worker_index()];
+            string path = output_dir + "/signer_" + std::to_string(i);
+            read_state_file(path, &signer_state);
+            // a resumed run may find the top already appended
+            signer_state.auth_path.resize(lg_messages_per_signer);
+            if (signer_state.exhausted || signer_state.wots_params != wots_params
+                    || recompute_subtree_root(&signer_state, lg_messages_per_signer) != roots[i].hash)
+                throw std::runtime_error(path + " does not match the subtree root in the checkpoint.");
+            append_top_auth_path(&signer_state, i, lg_n_signers, treetop);
+            commit_state_file(path, signer_state);
+            progress.tick();
+        });
+    }
+    pool.wait();
+    cout << endl;
+    write_public_key(treetop.at(lg_n_signers, 0).hash, wots_params, output_dir);
+}
+
+/**
+ * Generate all keys, writing each signer state to disk as soon as its
+ * subtree is done.
+ *
+ * Only the subtree roots stay in memory while the subtrees are computed.
+ * Once the treetop is known, each state file is read back and rewritten
+ * with the top of its auth path, and the checkpoint file is removed.
+ *
+ * @param[in]  lg_n_signers            lg(number of signers)
+ * @param[in]  lg_messages_per_signer  lg(number of messages for each signer.)
+ * @param[in]  randomness              Random bytes to act as a seed.
+ * @param[in]  randomness_size         Size of randomness.
+ * @param[in]  output_dir              An existing directory for the signer states and public key.
+ * @param[in]  n_threads               The number of threads, or 0 for one per hardware thread.
+ * @param[in]  resume                  Continue from the checkpoint in output_dir.
+ * @param[in]  wots_params             The WOTS parameter set of every one-time key.
+ */
+void initialize_to_directory(size_t lg_n_signers, size_t lg_messages_per_signer,
+                             const byte *randomness, size_t randomness_size,
+                             string output_dir, size_t n_threads, bool resume, wots_params_t wots_params) {
+    size_t n_signers = 1 << lg_n_signers;
+    vector<merkle_node> roots = initialize_range(lg_n_signers, lg_messages_per_signer, randomness, randomness_size,
+                                                 output_dir, 0, n_signers, n_threads, resume, wots_params);
+    complete_signer_states(lg_n_signers, lg_messages_per_signer, roots, output_dir, n_threads, wots_params);
+    remove((output_dir + "/checkpoint").c_str());
+}
+
+/**
+ * Join the shards of a key generation run into complete keys.
+ *
+ * Every signer state must already be in output_dir, each shard's
+ * checkpoint file names the subtree roots it computed, and together the
+ * shards must cover every signer.
+ *
+ * @param[in]  output_dir        The directory holding every signer state.
+ * @param[in]  checkpoint_paths  The shards' checkpoint files
+ * @param[in]  n_threads         The number of threads, or 0 for one per hardware thread.
+ */
+void initialize_merge(string output_dir, const vector<string> &checkpoint_paths, size_t n_threads) {
+    if (checkpoint_paths.empty())
+        throw std::runtime_error("No shards to merge.");
+    checkpoint_header_t header;
+    vector<bool> done;
+    vector<merkle_node> roots;
+    for (size_t s = 0; s < checkpoint_paths.size(); s++) {
+        checkpoint_header_t shard_header;
+        vector<bool> shard_done;
+        vector<merkle_node> shard_roots;
+        read_checkpoint(checkpoint_paths[s], &shard_header, &shard_done, &shard_roots);
+        if (s == 0) {
+            header = shard_header;
+            done = shard_done;
+            roots = shard_roots;
+            continue;
+        }
+        if (shard_header.lg_n_signers != header.lg_n_signers
+                || shard_header.lg_messages_per_signer != header.lg_messages_per_signer
+                || shard_header.wots_params != header.wots_params
+                || memcmp(shard_header.seed_hash, header.seed_hash, HASH_SIZE) != 0)
+            throw std::runtime_error(checkpoint_paths[s] + " belongs to a different key generation run.");
+        for (size_t i = 0; i < shard_done.size(); i++) {
+            if (shard_done[i]) {
+                done[i] = true;
+                roots[i] = shard_roots[i];
+            }
+        }
+    }
+    size_t n_missing = std::count(done.begin(), done.end(), false);
+    if (n_missing)
+        throw std::runtime_error("The shards are missing " + std::to_string(n_missing) + " of "
+                                 + std::to_string(done.size()) + " subtrees.");
+    complete_signer_states(header.lg_n_signers, header.lg_messages_per_signer, roots, output_dir, n_threads,
+                           static_cast<wots_params_t>(header.wots_params));
 }
@@ -0,0 +1,272 @@
+/**
+ * A load generator for the sign and verify pipelines.
+ *
+ * Worker threads each own a signer and sign random messages in a loop,
+ * verifying every signature a given number of times, as a fleet of
+ * signers and relying parties would. Each concurrency level prints one
+ * JSON object per operation with its throughput and latency percentiles.
+ */
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "initialize.hh"
+#include "sign.hh"
+#include "verify.hh"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// Distinct random messages each worker cycles through.
+#define MESSAGES_PER_WORKER 16
+
+struct loadgen_options_t {
+    vector<size_t> concurrency {1};
+    size_t message_size = 4096;
+    size_t ops = 1000;
+    size_t verifies_per_sign = 1;
+    size_t lg_messages_per_signer = 8;
+    string state_dir;  // sign through state files here, or in memory if empty
+};
+
+// Latencies of one kind of operation, in nanoseconds.
+struct latencies_t {
+    vector<uint64_t> ns;
+    uint64_t bytes = 0;
+};
+
+static void print_usage() {
+    cout << endl
+         << "Usage:" << endl
+         << "\t./loadgen [--concurrency <c>[,<c>...]] [--message-size <bytes>] [--ops <n>]" << endl
+         << "\t          [--verifies <k>] [--lg-messages-per-signer <m>] [--state-dir <dir>]" << endl
+         << endl
+         << "\tRuns n signatures at each concurrency level c (default 1), on c threads with a" << endl
+         << "\tsigner each, and verifies each signature k times (default 1). Messages are random" << endl
+         << "\tand 4096 bytes long by default. Signers have 2^m leaves (default m = 8) and are" << endl
+         << "\tsigned with in memory, unless dir is given: then their state files are written" << endl
+         << "\tthere and every signature goes through 'sign', durable state commit included." << endl
+         << endl;
+    exit(1);
+}
+
+/**
+ * Parse the command line, or exit with usage on a malformed one.
+ *
+ * @param[in]  argc  The argument count
+ * @param      argv  The arguments
+ *
+ * @return     The options.
+ */
+static loadgen_options_t parse_options(int argc, char *argv[]) {
+    loadgen_options_t options;
+    for (int i = 1; i < argc; i += 2) {
+        string name = argv[i];
+        if (i + 1 >= argc)
+            print_usage();
+        string value = argv[i + 1];
+        if (name == "--concurrency") {
+            options.concurrency.clear();
+            std::istringstream levels(value);
+            string level;
+            while (std::getline(levels, level, ','))
+                options.concurrency.push_back(std::stoul(level));
+        } else if (name == "--message-size") {
+            options.message_size = std::stoul(value);
+        } else if (name == "--ops") {
+            options.ops = std::stoul(value);
+        } else if (name == "--verifies") {
+            options.verifies_per_sign = std::stoul(value);
+        } else if (name == "--lg-messages-per-signer") {
+            options.lg_messages_per_signer = std::stoul(value);
+        } else if (name == "--state-dir") {
+            options.state_dir = value;
+        } else {
+            print_usage();
+        }
+    }
+    for (size_t c : options.concurrency) {
+        if (c == 0)
+            print_usage();
+    }
+    return options;
+}
+
+/**
+ * The latency at a percentile.
+ *
+ * @param[in]  sorted  The latencies, sorted
+ * @param[in]  p       The percentile, between 0 and 100
+ *
+ * @return     The latency in microseconds.
+ */
+static double percentile_us(const vector<uint64_t> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()));
+    return sorted[i] / 1e3;
+}
+
+/**
+ * Print the results for one operation at one concurrency level.
+ *
+ * @param[in]  operation    "sign" or "verify"
+ * @param[in]  concurrency  The number of worker threads
+ * @param[in]  options      The options
+ * @param      results      The latencies of every operation
+ * @param[in]  seconds      The wall-clock time of the whole run
+ */
+static void report(string operation, size_t concurrency, const loadgen_options_t &options,
+                   latencies_t *results, double seconds) {
+    vector<uint64_t> &sorted = results->ns;
+    std::sort(sorted.begin(), sorted.end());
+    cout << "{\"operation\": \"" << operation << "\""
+         << ", \"concurrency\": " << concurrency
+         << ", \"message_size\": " << options.message_size
+         << ", \"durable\": " << (options.state_dir.empty() ? "false" : "true")
+         << ", \"ops\": " << sorted.size()
+         << ", \"ops_per_sec\": " << sorted.size() / seconds
+         << ", \"bytes_per_sec\": " << results->bytes / seconds
+         << ", \"latency_us\": {\"p50\": " << percentile_us(sorted, 50)
+         << ", \"p90\": " << percentile_us(sorted, 90)
+         << ", \"p99\": " << percentile_us(sorted, 99)
+         << ", \"p999\": " << percentile_us(sorted, 99.9)
+         << ", \"max\": " << (sorted.empty() ? 0 : sorted.back() / 1e3) << "}}" << endl;
+}
+
+/**
+ * Run one concurrency level.
+ *
+ * @param[in]  concurrency  The number of worker threads, each with its own signer
+ * @param[in]  options      The options
+ */
+static void run_level(size_t concurrency, const loadgen_options_t &options) {
+    size_t lg_n_signers = 2;
+    while ((1UL << lg_n_signers) < concurrency)
+        lg_n_signers += 2;
+    size_t signatures_per_signer = 1UL << options.lg_messages_per_signer;
+    bool durable = !options.state_dir.empty();
+    if (durable && options.ops > concurrency * signatures_per_signer) {
+        cerr << "ERROR: " << options.ops << " signatures do not fit in " << concurrency
+             << " signers of 2^" << options.lg_messages_per_signer << " leaves each." << endl;
+        exit(1);
+    }
+
+    const byte *randomness = reinterpret_cast<const byte *>("loadgenrandomness");
+    // keep initialize's progress messages out of the results
+    std::streambuf *out = cout.rdbuf(NULL);
+    keys_t *keys = initialize(lg_n_signers, options.lg_messages_per_signer, randomness, 17);
+    string level_dir = options.state_dir + "/concurrency_" + std::to_string(concurrency);
+    if (durable) {
+        mkdir(level_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+        write_signer_states(keys, level_dir);
+    }
+    cout.rdbuf(out);
+    cout.clear();
+
+    std::atomic<size_t> n_failed(0);
+    vector<latencies_t> sign_results(concurrency), verify_results(concurrency);
+    vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t w = 0; w < concurrency; w++) {
+        // a fixed share of the ops, so that no worker signs more than its signer's leaves
+        size_t quota = options.ops / concurrency + (w < options.ops % concurrency);
+        workers.emplace_back([&, w, quota]() {
+            std::mt19937_64 rng(w);
+            vector<vector<byte>> messages(MESSAGES_PER_WORKER, vector<byte>(options.message_size));
+            for (auto &message : messages) {
+                for (auto &b : message)
+                    b = rng();
+            }
+            string state_path = level_dir + "/signer_" + std::to_string(w);
+            signer_info_t signer_state;
+            auto reset_signer = [&]() {
+                signer_state = keys->signer_states[w];
+                for (auto &t : signer_state.treehash_instances)
+                    t.set_stack(&signer_state.treehash_stack);
+            };
+            reset_signer();
+            // keep sign's progress messages out of the results
+            std::ostream quiet(NULL);
+
+            for (size_t op = 0; op < quota; op++) {
+                const vector<byte> &message = messages[op % MESSAGES_PER_WORKER];
+                auto sign_start = std::chrono::steady_clock::now();
+                signature_t signature;
+                if (durable) {
+                    signature = sign(state_path, message, quiet);
+                } else {
+                    if (signer_state.exhausted)
+                        reset_signer();
+                    signature = prepare_signature(&signer_state);
+                    complete_signature(&signature, signer_state.secret_key, message);
+                }
+                auto sign_end = std::chrono::steady_clock::now();
+                sign_results[w].ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(sign_end - sign_start).count());
+                sign_results[w].bytes += message.size();
+
+                for (size_t v = 0; v < options.verifies_per_sign; v++) {
+                    auto verify_start = std::chrono::steady_clock::now();
+                    if (!verify(keys->public_key, message, signature))
+                        n_failed++;
+                    auto verify_end = std::chrono::steady_clock::now();
+                    verify_results[w].ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(verify_end - verify_start).count());
+                    verify_results[w].bytes += message.size();
+                }
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    delete keys;
+
+    if (n_failed) {
+        cerr << "ERROR: " << n_failed << " signatures did not verify." << endl;
+        exit(1);
+    }
+    latencies_t signs, verifies;
+    for (size_t w = 0; w < concurrency; w++) {
+        signs.ns.insert(signs.ns.end(), sign_results[w].ns.begin(), sign_results[w].ns.end());
+        signs.bytes += sign_results[w].bytes;
+        verifies.ns.insert(verifies.ns.end(), verify_results[w].ns.begin(), verify_results[w].ns.end());
+        verifies.bytes += verify_results[w].bytes;
+    }
+    report("sign", concurrency, options, &signs, seconds);
+    if (options.verifies_per_sign)
+        report("verify", concurrency, options, &verifies, seconds);
+}
+
+int main(int argc, char *argv[]) {
+    loadgen_options_t options = parse_options(argc, argv);
+    if (options.lg_messages_per_signer % 2 || options.lg_messages_per_signer < 2
+            || options.lg_messages_per_signer > 16) {
+        cerr << "ERROR: lg_messages_per_signer must be an even integer between 2 and 16, inclusive." << endl;
+        exit(1);
+    }
+    if (!options.state_dir.empty()) {
+        struct stat buf;
+        if (stat(options.state_dir.c_str(), &buf) == 0) {
+            cerr << "ERROR: " << options.state_dir << " already exists." << endl;
+            exit(1);
+        }
+        if (mkdir(options.state_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR)) {
+            cerr << "ERROR: " << options.state_dir << " could not be created." << endl;
+            exit(1);
+        }
+    }
+    for (size_t concurrency : options.concurrency)
+        run_level(concurrency, options);
+    return 0;
+}
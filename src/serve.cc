@@ -0,0 +1,561 @@
+#include "serve.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "sha256.hh"
+#include "sign.hh"
+#include "signature_file.hh"
+#include "treehash.hh"
+
+using std::array;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+// Full signer states are rewritten after this many signatures; in between,
+// only reserved leaf indices are made durable, through the signing journal.
+#define CHECKPOINT_INTERVAL 256
+
+// Leaves are reserved in the journal this many at a time, so that one
+// sync covers a block of signatures.
+#define LEAF_RESERVATION_BLOCK 64
+
+// Messages are read and hashed this many bytes at a time, so memory use
+// does not grow with the message.
+#define MESSAGE_CHUNK_SIZE (1 << 16)
+
+// A connection is closed when its client sends nothing, or reads nothing,
+// for this long.
+#define IDLE_TIMEOUT_MS 30000
+
+// Connections beyond this many are refused.
+#define MAX_CONNECTIONS 64
+
+enum response_status : uint8_t {
+    RESPONSE_OK = 0,
+    RESPONSE_ERROR = 1
+};
+
+struct served_signer {
+    std::mutex lock;  // held while the signer's state is used
+    string path;
+    signer_info_t *info;
+    size_t unsaved;  // signatures since the state file was last written
+    size_t reserved;  // leaves below this index are reserved in the journal
+    // completes a signature with the one-time key derived ahead of time, if set
+    std::function<void(signature_t *, const message_digest_t &)> next_ots;
+    size_t next_ots_index;  // the leaf of next_ots
+};
+
+// Signers whose next one-time key should be derived, and the thread that
+// derives them, so that no request waits for it.
+struct precompute_queue {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<served_signer *> pending;
+    bool stopping = false;
+    std::thread thread;
+};
+
+struct served_connection {
+    std::thread thread;
+    std::atomic<bool> done{false};
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// Written to by request_stop, so that every thread waiting in poll wakes
+// up. Nothing reads from it, so it stays readable once a stop is requested.
+static int shutdown_pipe[2] = {-1, -1};
+
+static void request_stop(int) {
+    stop_requested = 1;
+    if (shutdown_pipe[1] >= 0 && write(shutdown_pipe[1], "", 1) < 0) {
+        // the pipe is non-blocking and already readable if it is full
+    }
+}
+
+/**
+ * Wait until a socket can be read from.
+ *
+ * @param[in]  fd          The socket
+ * @param[in]  timeout_ms  How long to wait, or -1 to wait indefinitely
+ *
+ * @return     True once the socket is readable or hung up, false on
+ *             timeout, error or a stop request.
+ */
+static bool wait_readable(int fd, int timeout_ms) {
+    pollfd fds[2] = {{fd, POLLIN, 0}, {shutdown_pipe[0], POLLIN, 0}};
+    while (!stop_requested) {
+        int r = poll(fds, 2, timeout_ms);
+        if (r < 0 && errno == EINTR)
+            continue;
+        return r > 0 && !fds[1].revents;
+    }
+    return false;
+}
+
+/**
+ * Read exactly n bytes from a socket.
+ *
+ * @param[in]  fd          The socket
+ * @param      buf         The output buffer
+ * @param[in]  n           The number of bytes to read
+ * @param[in]  timeout_ms  How long to wait for each part, or -1 to wait indefinitely
+ *
+ * @return     True on success, false on EOF, error, timeout or a stop request.
+ */
+static bool read_all(int fd, void *buf, size_t n, int timeout_ms) {
+    char *p = static_cast<char *>(buf);
+    while (n) {
+        if (!wait_readable(fd, timeout_ms))
+            return false;
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR && !stop_requested)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/**
+ * Write exactly n bytes to a socket.
+ *
+ * @param[in]  fd    The socket
+ * @param[in]  buf   The bytes to write
+ * @param[in]  n     The number of bytes to write
+ *
+ * @return     True on success, false on error.
+ */
+static bool write_all(int fd, const void *buf, size_t n) {
+    const char *p = static_cast<const char *>(buf);
+    while (n) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+/**
+ * Send a response: a status byte, then a length-prefixed payload.
+ *
+ * @param[in]  fd       The socket
+ * @param[in]  status   The status
+ * @param[in]  payload  The payload
+ *
+ * @return     True on success, false on error.
+ */
+static bool send_response(int fd, response_status status, const string &payload) {
+    uint8_t status_byte = status;
+    uint64_t size = payload.size();
+    return write_all(fd, &status_byte, sizeof(status_byte))
+        && write_all(fd, &size, sizeof(size))
+        && write_all(fd, payload.data(), payload.size());
+}
+
+/**
+ * Write a signer's state file and forget any unsaved signatures.
+ *
+ * The state file is synced before the journal it supersedes is removed.
+ *
+ * @param      signer  The signer
+ */
+static void save_signer(served_signer *signer) {
+    write_signer_info(signer->path, *signer->info);
+    clear_journal(signer->path);
+    signer->unsaved = 0;
+    signer->reserved = 0;
+}
+
+/**
+ * Make sure the signer's next leaf is reserved in its journal, reserving
+ * a new block of leaves if it is not.
+ *
+ * @param      signer  The signer
+ */
+static void reserve_next_leaf(served_signer *signer) {
+    size_t leaf_index = next_leaf_index(signer->info);
+    if (leaf_index < signer->reserved)
+        return;
+    size_t signatures_allowed = 1 << signer->info->keep.size();
+    size_t end = std::min<size_t>(leaf_index + LEAF_RESERVATION_BLOCK, signatures_allowed);
+    journal_leaf(signer->path, end - 1);
+    signer->reserved = end;
+}
+
+/**
+ * Derive the one-time key of a signer's next leaf ahead of time, so that
+ * signing the next request only walks the message-dependent chains.
+ *
+ * The signer is only locked to read its next leaf and to store the key,
+ * not while the key is derived. If a request used the leaf in between,
+ * the key is dropped.
+ *
+ * @param      signer  The signer
+ */
+static void precompute_next_leaf(served_signer *signer) {
+    size_t leaf_index;
+    wots_params_t wots_params;
+    array<byte, HASH_SIZE> secret_key;
+    {
+        std::lock_guard<std::mutex> guard(signer->lock);
+        if (signer->info->exhausted)
+            return;
+        leaf_index = next_leaf_index(signer->info);
+        if (signer->next_ots && signer->next_ots_index == leaf_index)
+            return;
+        wots_params = signer->info->wots_params;
+        secret_key = signer->info->secret_key;
+    }
+
+    std::function<void(signature_t *, const message_digest_t &)> next_ots;
+    with_wots_params(wots_params, [&](auto set) {
+        typedef FixedWeightWOTS<decltype(set)> ots_t;
+        std::shared_ptr<ots_t> ots(new ots_t(wotscalc<decltype(set)>(secret_key.data(), secret_key.size(),
+                                                                      leaf_index, true)));
+        next_ots = [ots](signature_t *signature, const message_digest_t &digest) {
+            complete_signature(signature, ots.get(), digest);
+        };
+    });
+    OPENSSL_cleanse(secret_key.data(), secret_key.size());
+
+    std::lock_guard<std::mutex> guard(signer->lock);
+    if (signer->info->exhausted || next_leaf_index(signer->info) != leaf_index)
+        return;
+    signer->next_ots = next_ots;
+    signer->next_ots_index = leaf_index;
+}
+
+/**
+ * Ask the precompute thread to derive a signer's next one-time key.
+ *
+ * @param      queue   The precompute queue
+ * @param      signer  The signer
+ */
+static void schedule_precompute(precompute_queue *queue, served_signer *signer) {
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        if (std::find(queue->pending.begin(), queue->pending.end(), signer) == queue->pending.end())
+            queue->pending.push_back(signer);
+    }
+    queue->wake.notify_one();
+}
+
+/**
+ * Derive the next one-time key of each scheduled signer until asked to
+ * stop.
+ *
+ * @param      queue  The precompute queue
+ */
+static void run_precompute(precompute_queue *queue) {
+    std::unique_lock<std::mutex> guard(queue->lock);
+    while (true) {
+        queue->wake.wait(guard, [queue]() { return queue->stopping || !queue->pending.empty(); });
+        if (queue->stopping)
+            return;
+        served_signer *signer = queue->pending.front();
+        queue->pending.pop_front();
+        guard.unlock();
+        precompute_next_leaf(signer);
+        guard.lock();
+    }
+}
+
+/**
+ * Sign a message digest with one of the served signers. The caller holds
+ * the signer's lock.
+ *
+ * The leaf is reserved in the journal before the signature is computed,
+ * and the whole state is only rewritten every CHECKPOINT_INTERVAL
+ * signatures.
+ *
+ * @param      signer  The signer
+ * @param[in]  digest  The digest of the message
+ *
+ * @return     The serialized signature.
+ */
+static string sign_request(served_signer *signer, const message_digest_t &digest) {
+    if (signer->info->exhausted)
+        throw runtime_error("This signer is exhausted.");
+    reserve_next_leaf(signer);
+    signature_t signature = prepare_signature(signer->info);
+    signer->unsaved++;
+
+    if (signer->info->exhausted) {
+        // just in case it isn't deleted properly, write a marker info file:
+        save_signer(signer);
+        if (remove(signer->path.c_str()) != 0) {
+            cout << "State file could not be removed. Please delete "
+                 << signer->path
+                 << " as it is no longer useful."
+                 << endl;
+        } else {
+            cout << signer->path << " exhausted; state file removed." << endl;
+        }
+    } else if (signer->unsaved >= CHECKPOINT_INTERVAL) {
+        save_signer(signer);
+    }
+
+    if (signer->next_ots && signer->next_ots_index == signature.leaf.index) {
+        signer->next_ots(&signature, digest);
+        signer->next_ots = nullptr;
+    } else {
+        complete_signature(&signature, signer->info->secret_key, digest);
+    }
+
+    vector<byte> image;
+    encode_signature(signature, &image);
+    return string(image.begin(), image.end());
+}
+
+/**
+ * Answer sign requests on a connection until the client hangs up, goes
+ * idle for IDLE_TIMEOUT_MS or the daemon is asked to stop.
+ *
+ * Each request is a 4-byte signer index, an 8-byte message length and
+ * the message. Each response is a status byte, an 8-byte length and
+ * either a signature in the signature file layout or an error message.
+ * The message is hashed as it arrives and never held in memory, and the
+ * signer is only locked once all of it has been received.
+ *
+ * @param[in]  fd          The connected socket
+ * @param      signers     The served signers
+ * @param      precompute  The queue that derives the signers' next keys
+ */
+static void handle_connection(int fd, std::deque<served_signer> *signers, precompute_queue *precompute) {
+    vector<byte> chunk(MESSAGE_CHUNK_SIZE);
+    while (!stop_requested) {
+        uint32_t signer_ix;
+        uint64_t message_size;
+        if (!read_all(fd, &signer_ix, sizeof(signer_ix), IDLE_TIMEOUT_MS)
+                || !read_all(fd, &message_size, sizeof(message_size), IDLE_TIMEOUT_MS))
+            return;
+        Sha256 h;
+        while (message_size) {
+            size_t n = std::min<uint64_t>(message_size, chunk.size());
+            if (!read_all(fd, chunk.data(), n, IDLE_TIMEOUT_MS))
+                return;
+            h.update(chunk.data(), n);
+            message_size -= n;
+        }
+        message_digest_t digest;
+        h.final(digest.data());
+
+        response_status status = RESPONSE_OK;
+        string payload;
+        if (signer_ix >= signers->size()) {
+            status = RESPONSE_ERROR;
+            payload = "Unknown signer " + std::to_string(signer_ix) + ".";
+        } else {
+            served_signer *signer = &(*signers)[signer_ix];
+            std::lock_guard<std::mutex> guard(signer->lock);
+            try {
+                payload = sign_request(signer, digest);
+            } catch (std::exception &e) {
+                status = RESPONSE_ERROR;
+                payload = e.what();
+            }
+        }
+        if (signer_ix < signers->size())
+            schedule_precompute(precompute, &(*signers)[signer_ix]);
+        if (!send_response(fd, status, payload))
+            return;
+    }
+}
+
+/**
+ * Join the threads of connections that have been closed.
+ *
+ * @param      connections  The open connections
+ */
+static void reap_connections(std::list<served_connection> *connections) {
+    for (auto it = connections->begin(); it != connections->end();) {
+        if (it->done) {
+            it->thread.join();
+            it = connections->erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Run a signing daemon on a Unix domain socket.
+ *
+ * Signer states stay in memory between requests. Leaves are reserved in
+ * blocks with one small durable write to the signer's journal; full
+ * states are rewritten periodically and on SIGINT or SIGTERM. After
+ * every signature, a background thread derives the one-time key of the
+ * signer's next leaf, ahead of the request that will use it.
+ *
+ * Each connection is served on its own thread, up to MAX_CONNECTIONS at
+ * once; requests to the same signer take turns on its lock.
+ *
+ * @param[in]  socket_path  The path of the socket to create
+ * @param[in]  state_paths  The state files to serve, addressed by position.
+ */
+void serve(string socket_path, const vector<string> &state_paths) {
+    // a deque, so that the signers and their locks never move
+    std::deque<served_signer> signers;
+    precompute_queue precompute;
+    for (size_t i = 0; i < state_paths.size(); i++) {
+        signers.emplace_back();
+        served_signer &signer = signers.back();
+        signer.path = state_paths[i];
+        signer.info = load_signer_info(state_paths[i]);
+        signer.unsaved = 0;
+        signer.reserved = 0;
+        precompute.pending.push_back(&signer);
+        cout << "signer " << i << ": " << state_paths[i] << endl;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        throw runtime_error("Socket path too long.");
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0
+            || bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+            || listen(listen_fd, 16) != 0)
+        throw runtime_error("Could not listen on " + socket_path + ": " + strerror(errno));
+
+    if (pipe2(shutdown_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        throw runtime_error(string("Could not create a pipe: ") + strerror(errno));
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // a client that stops reading its responses must not hold its thread forever
+    timeval send_timeout;
+    send_timeout.tv_sec = IDLE_TIMEOUT_MS / 1000;
+    send_timeout.tv_usec = 0;
+
+    precompute.thread = std::thread(run_precompute, &precompute);
+    std::list<served_connection> connections;
+    cout << "Listening on " << socket_path << endl;
+    while (!stop_requested) {
+        if (!wait_readable(listen_fd, -1))
+            continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR)
+                cerr << "accept failed: " << strerror(errno) << endl;
+            continue;
+        }
+        reap_connections(&connections);
+        if (connections.size() >= MAX_CONNECTIONS) {
+            send_response(fd, RESPONSE_ERROR, "Too many connections.");
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        connections.emplace_back();
+        served_connection *connection = &connections.back();
+        connection->thread = std::thread([fd, connection, &signers, &precompute]() {
+            handle_connection(fd, &signers, &precompute);
+            close(fd);
+            connection->done = true;
+        });
+    }
+
+    // every connection sees the stop in its next wait and returns
+    for (auto &connection : connections)
+        connection.thread.join();
+    {
+        std::lock_guard<std::mutex> guard(precompute.lock);
+        precompute.stopping = true;
+    }
+    precompute.wake.notify_one();
+    precompute.thread.join();
+
+    cout << "Saving signer states..." << endl;
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    for (auto &signer : signers) {
+        if (signer.unsaved && !signer.info->exhausted)
+            save_signer(&signer);
+        delete signer.info;
+    }
+}
+
+/**
+ * Ask a signing daemon to sign a message.
+ *
+ * @param[in]  socket_path  The daemon's socket
+ * @param[in]  signer       The position of the signer's state file on the daemon's command line
+ * @param[in]  message      The message
+ *
+ * @return     The signature.
+ */
+signature_t request_signature(string socket_path, uint32_t signer, const vector<byte> &message) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        throw runtime_error("Socket path too long.");
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Could not connect to " + socket_path + ": " + strerror(errno));
+    }
+
+    uint64_t message_size = message.size();
+    uint8_t status;
+    uint64_t payload_size = 0;
+    bool ok = write_all(fd, &signer, sizeof(signer))
+           && write_all(fd, &message_size, sizeof(message_size))
+           && write_all(fd, message.data(), message.size())
+           && read_all(fd, &status, sizeof(status), -1)
+           && read_all(fd, &payload_size, sizeof(payload_size), -1);
+    string payload(ok ? payload_size : 0, '\0');
+    ok = ok && read_all(fd, &payload[0], payload.size(), -1);
+    close(fd);
+    if (!ok)
+        throw runtime_error("Lost connection to signing daemon.");
+    if (status != RESPONSE_OK)
+        throw runtime_error(payload);
+
+    signature_t signature;
+    decode_signature(reinterpret_cast<const byte *>(payload.data()), payload.size(), &signature);
+    return signature;
+}
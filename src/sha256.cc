@@ -0,0 +1,568 @@
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HARDYHASH_X86 1
+#endif
+
+#include "sha256.hh"
+#include "stats.hh"
+
+static constexpr uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// Message words 8..15 of the single padded block for a 32-byte input.
+static const uint32_t PAD_32[8] = {0x80000000, 0, 0, 0, 0, 0, 0, 256};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * K[t] + W[t] for the second block of a 64-byte input.
+ *
+ * That block is pure padding (0x80, zeros, and a bit length of 512),
+ * so its whole message schedule is known at compile time.
+ */
+struct padding_schedule {
+    uint32_t kw[64];
+
+    constexpr padding_schedule() : kw() {
+        uint32_t W[64] = {0x80000000};
+        W[15] = 512;
+        for (size_t t = 16; t < 64; t++) {
+            uint32_t s0 = ROTR(W[t - 15], 7) ^ ROTR(W[t - 15], 18) ^ (W[t - 15] >> 3);
+            uint32_t s1 = ROTR(W[t - 2], 17) ^ ROTR(W[t - 2], 19) ^ (W[t - 2] >> 10);
+            W[t] = W[t - 16] + s0 + W[t - 7] + s1;
+        }
+        for (size_t t = 0; t < 64; t++)
+            kw[t] = K[t] + W[t];
+    }
+};
+
+static constexpr padding_schedule PAD_64_SCHEDULE;
+
+// The padding block above as bytes, for compression functions that compute
+// their own message schedule.
+static const byte PAD_64_BLOCK[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0};
+
+static inline uint32_t load_be32(const byte *p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16)
+         | (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+static inline void store_be32(byte *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+/**
+ * Run the 64 SHA-256 rounds given a message schedule with K already added.
+ *
+ * @param      state  The chaining value, updated in place.
+ * @param[in]  KW     K[t] + W[t] for every round t.
+ */
+static inline void sha256_rounds(uint32_t state[8], const uint32_t KW[64]) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t t = 0; t < 64; t++) {
+        uint32_t S1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + KW[t];
+        uint32_t S0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/**
+ * Portable SHA-256 compression of a single 64-byte block.
+ *
+ * @param      state  The chaining value, updated in place.
+ * @param[in]  block  The message block.
+ */
+static void compress_portable(uint32_t state[8], const byte *block) {
+    uint32_t W[64];
+    for (size_t t = 0; t < 16; t++)
+        W[t] = load_be32(block + 4 * t);
+    for (size_t t = 16; t < 64; t++) {
+        uint32_t s0 = ROTR(W[t - 15], 7) ^ ROTR(W[t - 15], 18) ^ (W[t - 15] >> 3);
+        uint32_t s1 = ROTR(W[t - 2], 17) ^ ROTR(W[t - 2], 19) ^ (W[t - 2] >> 10);
+        W[t] = W[t - 16] + s0 + W[t - 7] + s1;
+    }
+    for (size_t t = 0; t < 64; t++)
+        W[t] += K[t];
+    sha256_rounds(state, W);
+}
+
+/**
+ * Portable compression of the constant padding block of a 64-byte input.
+ *
+ * @param      state  The chaining value, updated in place.
+ */
+static void compress_padding_portable(uint32_t state[8]) {
+    sha256_rounds(state, PAD_64_SCHEDULE.kw);
+}
+
+#ifdef HARDYHASH_X86
+
+/**
+ * SHA-256 compression of a single 64-byte block using the SHA extensions.
+ *
+ * @param      state  The chaining value, updated in place.
+ * @param[in]  block  The message block.
+ */
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t state[8], const byte *block) {
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // rearrange the state into the ABEF / CDGH layout sha256rnds2 expects
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    __m128i abef_save = state0;
+    __m128i cdgh_save = state1;
+
+    __m128i M[4];
+    for (size_t i = 0; i < 4; i++)
+        M[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i)), MASK);
+
+    for (size_t i = 0; i < 16; i++) {
+        if (i >= 4) {
+            // W[4i..4i+3] from the four previous groups of the schedule
+            __m128i w = _mm_sha256msg1_epu32(M[i % 4], M[(i + 1) % 4]);
+            w = _mm_add_epi32(w, _mm_alignr_epi8(M[(i + 3) % 4], M[(i + 2) % 4], 4));
+            M[i % 4] = _mm_sha256msg2_epu32(w, M[(i + 3) % 4]);
+        }
+        __m128i kw = _mm_add_epi32(M[i % 4], _mm_loadu_si128(reinterpret_cast<const __m128i *>(K + 4 * i)));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, kw);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(kw, 0x0E));
+    }
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+
+/**
+ * Compression of the constant padding block of a 64-byte input using the SHA extensions.
+ *
+ * @param      state  The chaining value, updated in place.
+ */
+static void compress_padding_shani(uint32_t state[8]) {
+    compress_shani(state, PAD_64_BLOCK);
+}
+
+#endif
+
+struct compress_impl {
+    void (*block)(uint32_t *, const byte *);
+    void (*padding)(uint32_t *);
+    const char *name;
+};
+
+/**
+ * Pick the fastest single-block compression function supported by this CPU.
+ *
+ * @return     The selected implementation.
+ */
+static compress_impl select_compress() {
+#ifdef HARDYHASH_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)
+            && __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1))
+        return {compress_shani, compress_padding_shani, "sha-ni"};
+#endif
+    return {compress_portable, compress_padding_portable, "portable"};
+}
+
+static const compress_impl &compressor() {
+    static const compress_impl c = select_compress();
+    return c;
+}
+
+/**
+ * Run the SHA-256 compression function on a single 64-byte block.
+ *
+ * @param      state  The chaining value, updated in place.
+ * @param[in]  block  The message block.
+ */
+void sha256_compress(uint32_t state[8], const byte *block) {
+    count_stat(STAT_SHA256_COMPRESSIONS);
+    compressor().block(state, block);
+}
+
+/**
+ * Hash exactly 32 bytes without counting the compression, for callers
+ * that count it themselves.
+ *
+ * @param[in]  in    32 bytes of input
+ * @param      out   32 bytes of output (may alias in)
+ */
+static void hash_32(const byte *in, byte *out) {
+    byte block[64];
+    memcpy(block, in, HASH_SIZE);
+    for (size_t t = 0; t < 8; t++)
+        store_be32(block + HASH_SIZE + 4 * t, PAD_32[t]);
+    uint32_t state[8];
+    std::copy(IV, IV + 8, state);
+    compressor().block(state, block);
+    for (size_t i = 0; i < 8; i++)
+        store_be32(out + 4 * i, state[i]);
+}
+
+/**
+ * Compute the sha256 hash of exactly 32 bytes.
+ *
+ * The input and its padding fit in one block, so this is a single
+ * compression call.
+ *
+ * @param[in]  in    32 bytes of input
+ * @param      out   32 bytes of output (may alias in)
+ */
+void sha256_32(const byte *in, byte *out) {
+    count_stat(STAT_SHA256_COMPRESSIONS);
+    hash_32(in, out);
+}
+
+/**
+ * Compute the sha256 hash of exactly 64 bytes, e.g. two concatenated hashes.
+ *
+ * The second block is constant padding whose schedule is precomputed.
+ *
+ * @param[in]  in    64 bytes of input
+ * @param      out   32 bytes of output (may alias in)
+ */
+void sha256_64(const byte *in, byte *out) {
+    count_stat(STAT_SHA256_COMPRESSIONS, 2);
+    const compress_impl &c = compressor();
+    uint32_t state[8];
+    std::copy(IV, IV + 8, state);
+    c.block(state, in);
+    c.padding(state);
+    for (size_t i = 0; i < 8; i++)
+        store_be32(out + 4 * i, state[i]);
+}
+
+/**
+ * Name of the compression function used by sha256_32 and sha256_64.
+ *
+ * @return     "sha-ni" or "portable".
+ */
+const char *sha256_compress_impl() {
+    return compressor().name;
+}
+
+/**
+ * Constructs an incremental sha256 hasher.
+ */
+Sha256::Sha256() {
+    std::copy(IV, IV + 8, this->state);
+    this->buffered = 0;
+    this->n_bytes = 0;
+}
+
+/**
+ * Constructs a hasher that resumes from a saved midstate.
+ *
+ * @param[in]  midstate  The chaining value after n_bytes of input.
+ * @param[in]  n_bytes   The number of bytes absorbed so far (a multiple of 64).
+ */
+Sha256::Sha256(const uint32_t midstate[8], uint64_t n_bytes) {
+    std::copy(midstate, midstate + 8, this->state);
+    this->buffered = 0;
+    this->n_bytes = n_bytes;
+}
+
+/**
+ * Absorb more input.
+ *
+ * @param[in]  in       The input
+ * @param[in]  in_size  Size of in.
+ */
+void Sha256::update(const byte *in, size_t in_size) {
+    this->n_bytes += in_size;
+    if (this->buffered) {
+        size_t n = std::min(in_size, sizeof(this->buffer) - this->buffered);
+        memcpy(this->buffer + this->buffered, in, n);
+        this->buffered += n;
+        in += n;
+        in_size -= n;
+        if (this->buffered < sizeof(this->buffer))
+            return;
+        sha256_compress(this->state, this->buffer);
+        this->buffered = 0;
+    }
+    for (; in_size >= sizeof(this->buffer); in += 64, in_size -= 64)
+        sha256_compress(this->state, in);
+    memcpy(this->buffer, in, in_size);
+    this->buffered = in_size;
+}
+
+/**
+ * Save the chaining value, e.g. after absorbing an HMAC key block.
+ *
+ * Only meaningful when a whole number of blocks has been absorbed.
+ *
+ * @param      out   The chaining value.
+ */
+void Sha256::get_midstate(uint32_t out[8]) {
+    std::copy(this->state, this->state + 8, out);
+}
+
+/**
+ * Pad the input and write the hash.
+ *
+ * @param      out   32 bytes of output.
+ */
+void Sha256::final(byte *out) {
+    uint64_t n_bits = this->n_bytes * 8;
+    this->buffer[this->buffered++] = 0x80;
+    if (this->buffered > 56) {
+        memset(this->buffer + this->buffered, 0, 64 - this->buffered);
+        sha256_compress(this->state, this->buffer);
+        this->buffered = 0;
+    }
+    memset(this->buffer + this->buffered, 0, 56 - this->buffered);
+    store_be32(this->buffer + 56, n_bits >> 32);
+    store_be32(this->buffer + 60, n_bits);
+    sha256_compress(this->state, this->buffer);
+    for (size_t i = 0; i < 8; i++)
+        store_be32(out + 4 * i, this->state[i]);
+}
+
+#ifdef HARDYHASH_X86
+
+// The lane kernels below transpose their inputs so that every vector holds
+// the same message word for each lane, then run the 64 rounds on all lanes at
+// once. Rotations and shifts are written as macros since their counts must be
+// immediates, even when compiling without optimization.
+
+#define SHA256_ROUNDS(V, ADD, XOR, AND, ANDNOT, OR, SET1, ROR, SHR)                   \
+    for (size_t t = 0; t < 64; t++) {                                                \
+        V w;                                                                         \
+        if (t < 16) {                                                                \
+            w = W[t];                                                                \
+        } else {                                                                     \
+            V w15 = W[(t - 15) & 15], w2 = W[(t - 2) & 15];                          \
+            V s0 = XOR(XOR(ROR(w15, 7), ROR(w15, 18)), SHR(w15, 3));                 \
+            V s1 = XOR(XOR(ROR(w2, 17), ROR(w2, 19)), SHR(w2, 10));                  \
+            w = ADD(ADD(W[t & 15], s0), ADD(W[(t - 7) & 15], s1));                   \
+            W[t & 15] = w;                                                           \
+        }                                                                            \
+        V S1 = XOR(XOR(ROR(e, 6), ROR(e, 11)), ROR(e, 25));                          \
+        V ch = XOR(AND(e, f), ANDNOT(e, g));                                         \
+        V t1 = ADD(ADD(ADD(h, S1), ADD(ch, SET1(K[t]))), w);                         \
+        V S0 = XOR(XOR(ROR(a, 2), ROR(a, 13)), ROR(a, 22));                          \
+        V maj = OR(AND(a, b), AND(c, OR(a, b)));                                     \
+        h = g;                                                                       \
+        g = f;                                                                       \
+        f = e;                                                                       \
+        e = ADD(d, t1);                                                              \
+        d = c;                                                                       \
+        c = b;                                                                       \
+        b = a;                                                                       \
+        a = ADD(t1, ADD(S0, maj));                                                   \
+    }
+
+#define AVX2_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/**
+ * Hash eight independent 32-byte inputs using AVX2.
+ *
+ * @param[in]  in    8 * 32 bytes of input
+ * @param      out   8 * 32 bytes of output (may alias in)
+ */
+__attribute__((target("avx2")))
+static void sha256_32_x8(const byte *in, byte *out) {
+    const size_t LANES = 8;
+    alignas(32) uint32_t words[16][LANES];
+    for (size_t j = 0; j < LANES; j++) {
+        for (size_t t = 0; t < 8; t++) {
+            words[t][j] = load_be32(in + HASH_SIZE * j + 4 * t);
+            words[8 + t][j] = PAD_32[t];
+        }
+    }
+    __m256i W[16];
+    for (size_t t = 0; t < 16; t++)
+        W[t] = _mm256_load_si256(reinterpret_cast<const __m256i *>(words[t]));
+
+    __m256i a = _mm256_set1_epi32(IV[0]), b = _mm256_set1_epi32(IV[1]);
+    __m256i c = _mm256_set1_epi32(IV[2]), d = _mm256_set1_epi32(IV[3]);
+    __m256i e = _mm256_set1_epi32(IV[4]), f = _mm256_set1_epi32(IV[5]);
+    __m256i g = _mm256_set1_epi32(IV[6]), h = _mm256_set1_epi32(IV[7]);
+
+    SHA256_ROUNDS(__m256i, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256,
+                  _mm256_andnot_si256, _mm256_or_si256, _mm256_set1_epi32,
+                  AVX2_ROR, _mm256_srli_epi32)
+
+    __m256i result[8] = {a, b, c, d, e, f, g, h};
+    for (size_t i = 0; i < 8; i++) {
+        result[i] = _mm256_add_epi32(result[i], _mm256_set1_epi32(IV[i]));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(words[i]), result[i]);
+    }
+    for (size_t j = 0; j < LANES; j++)
+        for (size_t i = 0; i < 8; i++)
+            store_be32(out + HASH_SIZE * j + 4 * i, words[i][j]);
+}
+
+// GCC's AVX-512 intrinsics trip -Wuninitialized on their own undefined
+// pass-through operands.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/**
+ * Hash sixteen independent 32-byte inputs using AVX-512.
+ *
+ * @param[in]  in    16 * 32 bytes of input
+ * @param      out   16 * 32 bytes of output (may alias in)
+ */
+__attribute__((target("avx512f")))
+static void sha256_32_x16(const byte *in, byte *out) {
+    const size_t LANES = 16;
+    alignas(64) uint32_t words[16][LANES];
+    for (size_t j = 0; j < LANES; j++) {
+        for (size_t t = 0; t < 8; t++) {
+            words[t][j] = load_be32(in + HASH_SIZE * j + 4 * t);
+            words[8 + t][j] = PAD_32[t];
+        }
+    }
+    __m512i W[16];
+    for (size_t t = 0; t < 16; t++)
+        W[t] = _mm512_load_si512(words[t]);
+
+    __m512i a = _mm512_set1_epi32(IV[0]), b = _mm512_set1_epi32(IV[1]);
+    __m512i c = _mm512_set1_epi32(IV[2]), d = _mm512_set1_epi32(IV[3]);
+    __m512i e = _mm512_set1_epi32(IV[4]), f = _mm512_set1_epi32(IV[5]);
+    __m512i g = _mm512_set1_epi32(IV[6]), h = _mm512_set1_epi32(IV[7]);
+
+    SHA256_ROUNDS(__m512i, _mm512_add_epi32, _mm512_xor_si512, _mm512_and_si512,
+                  _mm512_andnot_si512, _mm512_or_si512, _mm512_set1_epi32,
+                  _mm512_ror_epi32, _mm512_srli_epi32)
+
+    __m512i result[8] = {a, b, c, d, e, f, g, h};
+    for (size_t i = 0; i < 8; i++) {
+        result[i] = _mm512_add_epi32(result[i], _mm512_set1_epi32(IV[i]));
+        _mm512_store_si512(words[i], result[i]);
+    }
+    for (size_t j = 0; j < LANES; j++)
+        for (size_t i = 0; i < 8; i++)
+            store_be32(out + HASH_SIZE * j + 4 * i, words[i][j]);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+struct multi_kernel {
+    void (*fn)(const byte *, byte *);
+    size_t lanes;
+    const char *name;
+};
+
+/**
+ * Pick the widest multi-lane kernel supported by this CPU.
+ *
+ * @return     The selected kernel.
+ */
+static multi_kernel select_kernel() {
+#ifdef HARDYHASH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {sha256_32_x16, 16, "avx512"};
+    if (__builtin_cpu_supports("avx2"))
+        return {sha256_32_x8, 8, "avx2"};
+#endif
+    // sha256_32_multi counts every lane, so the scalar kernel must not count again
+    return {hash_32, 1, "scalar"};
+}
+
+static const multi_kernel &kernel() {
+    static const multi_kernel k = select_kernel();
+    return k;
+}
+
+/**
+ * Compute sha256 of n independent 32-byte inputs.
+ *
+ * Inputs are hashed in groups using the widest SIMD kernel available
+ * at runtime, so hash chains can be advanced in lockstep.
+ *
+ * @param[in]  in    n consecutive 32-byte inputs
+ * @param      out   n consecutive 32-byte outputs (may alias in)
+ * @param[in]  n     The number of inputs
+ */
+void sha256_32_multi(const byte *in, byte *out, size_t n) {
+    count_stat(STAT_SHA256_COMPRESSIONS, n);
+    const multi_kernel &k = kernel();
+    size_t i = 0;
+    for (; i + k.lanes <= n; i += k.lanes)
+        k.fn(in + i * HASH_SIZE, out + i * HASH_SIZE);
+    if (i == n)
+        return;
+    // pad the tail out to a full group
+    byte tail[16 * HASH_SIZE] = {0};
+    memcpy(tail, in + i * HASH_SIZE, (n - i) * HASH_SIZE);
+    k.fn(tail, tail);
+    memcpy(out + i * HASH_SIZE, tail, (n - i) * HASH_SIZE);
+}
+
+/**
+ * The number of inputs hashed at once by sha256_32_multi.
+ *
+ * @return     The lane count of the selected kernel.
+ */
+size_t sha256_multi_lanes() {
+    return kernel().lanes;
+}
+
+/**
+ * Name of the kernel selected by sha256_32_multi.
+ *
+ * @return     "avx512", "avx2" or "scalar".
+ */
+const char *sha256_multi_impl() {
+    return kernel().name;
+}
@@ -1,9 +1,18 @@
 #include "sign.hh"
 
+#include <fcntl.h>
 #include <strings.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <fstream>
+#include <stdexcept>
 
+#include "signature_file.hh"
+#include "state_file.hh"
+#include "stats.hh"
+#include "thread_pool.hh"
 #include "treehash.hh"
 
 using std::cerr;
@@ -32,6 +41,87 @@ void print_usage() {
     exit(1);
 }
 
+/**
+ * The index of the leaf that will sign the next message.
+ *
+ * @param[in]  signer_info  The signer information
+ *
+ * @return     The next leaf index.
+ */
+size_t next_leaf_index(const signer_info_t *signer_info) {
+    return signer_info->leaf_index;
+}
+
+/**
+ * The path of the journal of leaves used since the state file was written.
+ *
+ * @param[in]  state_path  The path to the state file
+ *
+ * @return     The journal path.
+ */
+static string journal_path(string state_path) {
+    return state_path + ".journal";
+}
+
+/**
+ * Durably reserve every leaf up to and including leaf_index.
+ *
+ * The journal is an append-only list of 8-byte leaf indices. It must be
+ * synced before a signature made with a reserved leaf is released, so
+ * that a crash can never lead to the leaf being used again. Reserving a
+ * block of leaves at once spreads one sync over many signatures; after a
+ * crash, reserved leaves that were never used are skipped.
+ *
+ * @param[in]  state_path  The path to the state file
+ * @param[in]  leaf_index  The last leaf index reserved
+ */
+void journal_leaf(string state_path, size_t leaf_index) {
+    int fd = open(journal_path(state_path).c_str(), O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        throw std::runtime_error("Could not open signing journal for " + state_path);
+    uint64_t record = leaf_index;
+    bool ok = write(fd, &record, sizeof(record)) == sizeof(record) && fsync(fd) == 0;
+    close(fd);
+    if (!ok)
+        throw std::runtime_error("Could not write signing journal for " + state_path);
+}
+
+/**
+ * Discard a state file's journal once the state file itself is up to date.
+ *
+ * @param[in]  state_path  The path to the state file
+ */
+void clear_journal(string state_path) {
+    remove(journal_path(state_path).c_str());
+}
+
+/**
+ * Read the last leaf reserved in a state file's journal.
+ *
+ * @param[in]  state_path  The path to the state file
+ * @param      last_used   The last leaf index reserved.
+ *
+ * @return     True if the journal exists and holds at least one record.
+ */
+bool read_journal(string state_path, size_t *last_used) {
+    std::ifstream is(journal_path(state_path), std::ifstream::binary);
+    if (!is)
+        return false;
+    is.seekg(0, is.end);
+    std::streamoff n_bytes = is.tellg();
+    // a torn trailing record was never synced, so its signature was never released
+    std::streamoff n_records = n_bytes / sizeof(uint64_t);
+    if (n_records == 0)
+        return false;
+    uint64_t record;
+    is.seekg((n_records - 1) * sizeof(uint64_t), is.beg);
+    is.read(reinterpret_cast<char *>(&record), sizeof(record));
+    if (!is)
+        return false;
+    *last_used = record;
+    return true;
+}
+
 /**
  * Loads signer information from a state file.
  *
@@ -40,26 +130,26 @@ void print_usage() {
  * @return     Relevant signer information to sign the next message.
  */
 signer_info_t *load_signer_info(string path) {
-    std::ifstream is(path);
-    cereal::BinaryInputArchive iarchive(is);
     signer_info_t *signer_info = new signer_info_t;
-    iarchive(*signer_info);
-    for (auto &t : signer_info->treehash_instances) {
-        t.set_stack(&(signer_info->treehash_stack));
+    read_state_file(path, signer_info);
+
+    // a signing daemon may have reserved leaves since the state was last written
+    size_t last_used;
+    if (read_journal(path, &last_used)) {
+        while (!signer_info->exhausted && next_leaf_index(signer_info) <= last_used)
+            advance_signer(signer_info);
     }
     return signer_info;
 }
 
 /**
- * Serialize signer information to a state file.
+ * Atomically replace a state file with new signer information.
  *
  * @param[in]  path         The path to the state file
  * @param[in]  signer_info  The signer information
  */
-void write_signer_info(string path, signer_info_t signer_info) {
-    std::ofstream os(path);
-    cereal::BinaryOutputArchive oarchive(os);
-    oarchive(signer_info);
+void write_signer_info(string path, const signer_info_t &signer_info) {
+    commit_state_file(path, signer_info);
 }
 
 /**
@@ -69,9 +159,13 @@ void write_signer_info(string path, signer_info_t signer_info) {
  * @param[in]  path       The output path.
  */
 void write_signature(const signature_t &signature, string path) {
-    std::ofstream os(path);
-    cereal::BinaryOutputArchive oarchive(os);
-    oarchive(signature);  // TODO check success
+    PhaseTimer timer(PHASE_SIGNATURE_IO);
+    vector<byte> image;
+    encode_signature(signature, &image);
+    std::ofstream os(path, std::ofstream::binary | std::ofstream::trunc);
+    os.write(reinterpret_cast<const char *>(image.data()), image.size());
+    if (!os)
+        throw std::runtime_error("Could not write " + path);
 }
 
 /**
@@ -80,14 +174,13 @@ void write_signature(const signature_t &signature, string path) {
  * This algorithm is described in detail in Merkle Tree Traversal Revisited
  * (Buchmann et. al.)
  *
+ * The state moves on to the leaf after the one that was used.
+ *
  * @param      signer_info  The signer information
  */
 void update_auth_path(signer_info_t *signer_info) {
-    size_t leaf_index = signer_info->auth_path.front().index;
-    if (leaf_index % 2)
-        leaf_index--;
-    else
-        leaf_index++;
+    PhaseTimer timer(PHASE_UPDATE_AUTH_PATH);
+    size_t leaf_index = signer_info->leaf_index;
 
     size_t H = signer_info->keep.size();
 
@@ -106,7 +199,7 @@ void update_auth_path(signer_info_t *signer_info) {
     if (tau == 0) {
         signer_info->auth_path[0] = leafcalc(signer_info->secret_key.data(),
                                              signer_info->secret_key.size(),
-                                             leaf_index);
+                                             leaf_index, signer_info->wots_params).hash;
     } else {  // step 4
         // a
         signer_info->auth_path[tau] = combine(signer_info->auth_path[tau - 1], signer_info->keep[tau - 1]);
@@ -116,7 +209,7 @@ void update_auth_path(signer_info_t *signer_info) {
             if (h == H - 2) {
                 signer_info->auth_path[h] = signer_info->retain;
             } else {
-                signer_info->auth_path[h] = signer_info->treehash_instances[h].node;
+                signer_info->auth_path[h] = signer_info->treehash_instances[h].node.hash;
             }
 
             // c
@@ -142,32 +235,145 @@ void update_auth_path(signer_info_t *signer_info) {
             signer_info->treehash_instances[best_ix].update();
         }
     }
+    signer_info->leaf_index++;
 }
 
+/**
+ * Move the signer state past its next leaf.
+ *
+ * @param      signer_info  The signer information
+ */
+void advance_signer(signer_info_t *signer_info) {
+    size_t signatures_allowed = 1 << signer_info->keep.size();
+    if (next_leaf_index(signer_info) < signatures_allowed - 1)
+        update_auth_path(signer_info);
+    else
+        signer_info->exhausted = true;
+}
+
+/**
+ * Claim the next leaf for a signature and advance the signer state.
+ *
+ * The state must be persisted (or the leaf journaled) before the
+ * signature is completed and released.
+ *
+ * @param      signer_info  The signer information
+ *
+ * @return     A signature with its authentication path and leaf index
+ *             filled in, but no one-time signature yet.
+ */
+signature_t prepare_signature(signer_info_t *signer_info) {
+    size_t leaf_index = next_leaf_index(signer_info);
+    size_t signatures_allowed = 1 << signer_info->keep.size();
+    if (leaf_index >= signatures_allowed || signer_info->exhausted)
+        throw std::runtime_error("Attempted to sign more signatures than allowed.");
+
+    signature_t signature;
+    signature.auth_path = signer_info->auth_path;
+    signature.tree_index = ((uint64_t) signer_info->signer_index << signer_info->keep.size()) | leaf_index;
+    signature.leaf.height = 0;
+    signature.leaf.index = leaf_index;
+    signature.wots_params = signer_info->wots_params;
+    advance_signer(signer_info);
+    return signature;
+}
+
+/**
+ * Compute the one-time signature part of a prepared signature.
+ *
+ * @param      signature   The signature from prepare_signature
+ * @param[in]  secret_key  The signer's secret key
+ * @param[in]  message     The message to sign
+ */
+void complete_signature(signature_t *signature, const std::array<byte, HASH_SIZE> &secret_key,
+                        const vector<byte> &message) {
+    complete_signature(signature, secret_key, digest_message(message));
+}
+
+/**
+ * Compute the one-time signature part of a prepared signature, given
+ * the digest of the message.
+ *
+ * @param      signature   The signature from prepare_signature
+ * @param[in]  secret_key  The signer's secret key
+ * @param[in]  digest      The digest of the message to sign
+ */
+void complete_signature(signature_t *signature, const std::array<byte, HASH_SIZE> &secret_key,
+                        const message_digest_t &digest) {
+    with_wots_params(signature->wots_params, [&](auto set) {
+        auto w = wotscalc<decltype(set)>(const_cast<byte *>(secret_key.data()), secret_key.size(),
+                                         signature->leaf.index, true);
+        complete_signature(signature, &w, digest);
+    });
+}
+
+/**
+ * Compute the one-time signature part of a prepared signature with a
+ * one-time key that was derived ahead of time.
+ *
+ * Only the message-dependent chain walk is left to do.
+ *
+ * @param      signature  The signature from prepare_signature
+ * @param      ots        The unused one-time key of the signature's leaf
+ * @param[in]  message    The message to sign
+ */
+template <class Params>
+void complete_signature(signature_t *signature, FixedWeightWOTS<Params> *ots, const vector<byte> &message) {
+    complete_signature(signature, ots, digest_message(message));
+}
+
+/**
+ * Compute the one-time signature part of a prepared signature with a
+ * one-time key that was derived ahead of time, given the digest of the
+ * message.
+ *
+ * @param      signature  The signature from prepare_signature
+ * @param      ots        The unused one-time key of the signature's leaf
+ * @param[in]  digest     The digest of the message to sign
+ */
+template <class Params>
+void complete_signature(signature_t *signature, FixedWeightWOTS<Params> *ots, const message_digest_t &digest) {
+    ots->sign_digest(digest, &signature->ots);
+    signature->leaf.hash = ots->get_pk();
+    signature->wots_params = Params::id;
+}
+
+template void complete_signature(signature_t *, FixedWeightWOTS<wots_w4> *, const vector<byte> &);
+template void complete_signature(signature_t *, FixedWeightWOTS<wots_w16> *, const vector<byte> &);
+template void complete_signature(signature_t *, FixedWeightWOTS<wots_w256> *, const vector<byte> &);
+template void complete_signature(signature_t *, FixedWeightWOTS<wots_w4> *, const message_digest_t &);
+template void complete_signature(signature_t *, FixedWeightWOTS<wots_w16> *, const message_digest_t &);
+template void complete_signature(signature_t *, FixedWeightWOTS<wots_w256> *, const message_digest_t &);
+
 /**
  * Sign a message
  *
  * @param[in]  state_path  The signer's key state
  * @param[in]  message     The message to sign
+ * @param      log         Where progress messages go
+ *
+ * @return     The signature
+ */
+signature_t sign(string state_path, const vector<byte> &message, std::ostream &log) {
+    return sign(state_path, digest_message(message), log);
+}
+
+/**
+ * Sign a message given its digest, e.g. from digest_file.
+ *
+ * @param[in]  state_path  The signer's key state
+ * @param[in]  digest      The digest of the message to sign
+ * @param      log         Where progress messages go
  *
  * @return     The signature
  */
-signature_t sign(string state_path, const vector<byte> &message) {
+signature_t sign(string state_path, const message_digest_t &digest, std::ostream &log) {
     // signature is already totally computed in the previous step
     // but we have to do some housekeeping
     // to make sure the state is updated before we return it.
     signer_info_t *signer_info = load_signer_info(state_path);
 
-    signature_t signature;
-    signature.auth_path = signer_info->auth_path;
-
-    size_t leaf_index = signature.auth_path.front().index;
-    if (leaf_index % 2)
-        leaf_index--;
-    else
-        leaf_index++;
-
-    // now update state.
+    size_t leaf_index = next_leaf_index(signer_info);
     size_t signatures_allowed = 1 << signer_info->keep.size();
 
     if (leaf_index >= signatures_allowed || signer_info->exhausted) {
@@ -176,37 +382,111 @@ signature_t sign(string state_path, const vector<byte> &message) {
         exit(1);
     }
 
-    if (leaf_index < signatures_allowed - 1) {
+    // now update state.
+    signature_t signature = prepare_signature(signer_info);
+    log << "Signing message " << leaf_index + 1 << " of " << signatures_allowed << " allowed." << endl;
+
+    if (!signer_info->exhausted) {
         // update state file before returning the signature
-        cout << "Signing message " << leaf_index + 1 << " of " << signatures_allowed << " allowed." << endl;
-        update_auth_path(signer_info);
         write_signer_info(state_path, *signer_info);
-    }
-
-
-    if (leaf_index == signatures_allowed - 1) {
-        cout << "Signing message " << leaf_index + 1 << " of " << signatures_allowed << " allowed." << endl;
-        cout << "This is the last signature that this state file can support." << endl;
+        clear_journal(state_path);
+    } else {
+        log << "This is the last signature that this state file can support." << endl;
         // just in case it isn't deleted properly, write a marker info file:
-        signer_info->exhausted = true;
         write_signer_info(state_path, *signer_info);
+        clear_journal(state_path);
 
         if (remove(state_path.c_str()) != 0) {
-            cout << "State file could not be removed. Please delete "
-                 << state_path
-                 << " as it is no longer useful."
-                 << endl;
+            log << "State file could not be removed. Please delete "
+                << state_path
+                << " as it is no longer useful."
+                << endl;
         } else {
-            cout << "State file removed." << endl;
+            log << "State file removed." << endl;
         }
     }
 
-    WOTS_CLASS w = wotscalc(signer_info->secret_key.data(), signer_info->secret_key.size(), leaf_index);
-    signature.ots = w.sign(message);
-    signature.leaf.height = 0;
-    signature.leaf.index = leaf_index;
-    signature.leaf.hash = w.get_pk();
+    complete_signature(&signature, signer_info->secret_key, digest);
 
     delete signer_info;
     return signature;
 }
+
+/**
+ * Sign several messages with consecutive leaves of one signer.
+ *
+ * The state is advanced past every leaf and written once, before any
+ * signature is computed; the one-time signatures are then computed in
+ * parallel.
+ *
+ * @param[in]  state_path  The signer's key state
+ * @param[in]  messages    The messages to sign, in leaf order
+ * @param[in]  n_threads   The number of threads, or 0 for one per hardware thread.
+ * @param      log         Where progress messages go
+ *
+ * @return     One signature per message
+ */
+vector<signature_t> sign_batch(string state_path, const vector<vector<byte>> &messages, size_t n_threads,
+                               std::ostream &log) {
+    vector<message_digest_t> digests;
+    for (const auto &message : messages)
+        digests.push_back(digest_message(message));
+    return sign_batch(state_path, digests, n_threads, log);
+}
+
+/**
+ * Sign several messages with consecutive leaves of one signer, given
+ * their digests.
+ *
+ * @param[in]  state_path  The signer's key state
+ * @param[in]  messages    The digests of the messages to sign, in leaf order
+ * @param[in]  n_threads   The number of threads, or 0 for one per hardware thread.
+ * @param      log         Where progress messages go
+ *
+ * @return     One signature per message
+ */
+vector<signature_t> sign_batch(string state_path, const vector<message_digest_t> &messages, size_t n_threads,
+                               std::ostream &log) {
+    signer_info_t *signer_info = load_signer_info(state_path);
+
+    size_t leaf_index = next_leaf_index(signer_info);
+    size_t signatures_allowed = 1 << signer_info->keep.size();
+
+    if (signer_info->exhausted || leaf_index + messages.size() > signatures_allowed) {
+        cerr << "ERROR: Attempted to sign more signatures than allowed." << endl;
+        cerr << "This state file can sign " << (signer_info->exhausted ? 0 : signatures_allowed - leaf_index)
+             << " more messages." << endl;
+        exit(1);
+    }
+
+    vector<signature_t> signatures(messages.size());
+    for (size_t i = 0; i < messages.size(); i++)
+        signatures[i] = prepare_signature(signer_info);
+    log << "Signing messages " << leaf_index + 1 << " to " << leaf_index + messages.size()
+        << " of " << signatures_allowed << " allowed." << endl;
+
+    // update state file once, before returning any signature
+    write_signer_info(state_path, *signer_info);
+    clear_journal(state_path);
+    if (signer_info->exhausted) {
+        log << "This batch used the last signature that this state file can support." << endl;
+        if (remove(state_path.c_str()) != 0) {
+            log << "State file could not be removed. Please delete "
+                << state_path
+                << " as it is no longer useful."
+                << endl;
+        } else {
+            log << "State file removed." << endl;
+        }
+    }
+
+    {
+        ThreadPool pool(n_threads);
+        for (size_t i = 0; i < messages.size(); i++)
+            pool.submit([&, i]() { complete_signature(&signatures[i], signer_info->secret_key, messages[i]); });
+        pool.wait();
+    }
+
+    delete signer_info;
+    return signatures;
+}
@@ -0,0 +1,202 @@
+#include "signature_file.hh"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include "stats.hh"
+
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+static_assert(sizeof(signature_header_t) % HASH_SIZE == 0, "hashes must follow the header unpadded");
+static_assert(sizeof(std::array<byte, HASH_SIZE>) == HASH_SIZE, "auth path hashes must be back to back");
+
+/**
+ * The size of a signature file.
+ *
+ * @param[in]  wots_params       The WOTS parameter set
+ * @param[in]  auth_path_length  The length of the auth path
+ *
+ * @return     The size in bytes.
+ */
+size_t signature_file_size(wots_params_t wots_params, size_t auth_path_length) {
+    return sizeof(signature_header_t) + (wots_width(wots_params) + auth_path_length) * HASH_SIZE;
+}
+
+/**
+ * Lay out a signature in the fixed-layout signature file format.
+ *
+ * @param[in]  signature  The signature
+ * @param      image      The file contents
+ */
+void encode_signature(const signature_t &signature, vector<byte> *image) {
+    size_t width = wots_width(signature.wots_params);
+    size_t auth_path_length = signature.auth_path.size();
+    image->assign(signature_file_size(signature.wots_params, auth_path_length), 0);
+    byte *p = image->data();
+    signature_header_t *header = reinterpret_cast<signature_header_t *>(p);
+    memcpy(header->magic, SIGNATURE_FILE_MAGIC, sizeof(SIGNATURE_FILE_MAGIC));
+    header->version = SIGNATURE_FILE_VERSION;
+    header->wots_params = signature.wots_params;
+    header->auth_path_length = auth_path_length;
+    header->tree_index = signature.tree_index;
+
+    byte *ots = p + sizeof(signature_header_t);
+    byte *auth_path = ots + width * HASH_SIZE;
+    for (size_t i = 0; i < width; i++)
+        std::copy(signature.ots[i].begin(), signature.ots[i].end(), ots + i * HASH_SIZE);
+    for (size_t h = 0; h < auth_path_length; h++)
+        std::copy(signature.auth_path[h].begin(), signature.auth_path[h].end(), auth_path + h * HASH_SIZE);
+}
+
+/**
+ * Read a signature in place from its fixed-layout form.
+ *
+ * Nothing is copied; the view points into image.
+ *
+ * @param[in]  image       The file contents
+ * @param[in]  image_size  The size of the file
+ * @param      view        The signature
+ *
+ * @return     False if image is not a well-formed signature, true otherwise.
+ */
+bool view_signature(const byte *image, size_t image_size, signature_view_t *view) {
+    const signature_header_t *header = reinterpret_cast<const signature_header_t *>(image);
+    if (image_size < sizeof(signature_header_t)
+            || memcmp(header->magic, SIGNATURE_FILE_MAGIC, sizeof(SIGNATURE_FILE_MAGIC)) != 0
+            || header->version != SIGNATURE_FILE_VERSION
+            || header->reserved != 0
+            || header->wots_params > WOTS_W256
+            || header->auth_path_length >= 64
+            || header->tree_index >> header->auth_path_length
+            || image_size != signature_file_size(static_cast<wots_params_t>(header->wots_params),
+                                                 header->auth_path_length))
+        return false;
+    view->wots_params = static_cast<wots_params_t>(header->wots_params);
+    view->tree_index = header->tree_index;
+    view->auth_path_length = header->auth_path_length;
+    view->ots = image + sizeof(signature_header_t);
+    view->auth_path = view->ots + wots_width(view->wots_params) * HASH_SIZE;
+    return true;
+}
+
+/**
+ * View a signature held in memory as if it were in the file layout.
+ *
+ * @param[in]  signature  The signature, which must outlive the view
+ *
+ * @return     The view.
+ */
+signature_view_t view_signature(const signature_t &signature) {
+    signature_view_t view;
+    view.wots_params = signature.wots_params;
+    view.tree_index = signature.tree_index;
+    view.auth_path_length = signature.auth_path.size();
+    view.ots = signature.ots[0].data();
+    view.auth_path = signature.auth_path.empty() ? NULL : signature.auth_path[0].data();
+    return view;
+}
+
+/**
+ * Copy a viewed signature into a signature of its own.
+ *
+ * The file layout holds neither the one-time public key nor the leaf's
+ * index within its subtree, so signature->leaf is left zeroed; verification
+ * only needs tree_index and recomputes the key.
+ *
+ * @param[in]  view       The signature
+ * @param      signature  The copy
+ */
+void copy_signature(const signature_view_t &view, signature_t *signature) {
+    size_t width = wots_width(view.wots_params);
+    signature->wots_params = view.wots_params;
+    signature->tree_index = view.tree_index;
+    signature->leaf.index = 0;
+    signature->leaf.height = 0;
+    signature->leaf.hash.fill(0);
+    signature->ots = ots_signature_t {};
+    for (size_t i = 0; i < width; i++)
+        std::copy(view.ots + i * HASH_SIZE, view.ots + (i + 1) * HASH_SIZE, signature->ots[i].begin());
+    signature->auth_path.resize(view.auth_path_length);
+    for (size_t h = 0; h < view.auth_path_length; h++)
+        std::copy(view.auth_path + h * HASH_SIZE, view.auth_path + (h + 1) * HASH_SIZE,
+                  signature->auth_path[h].begin());
+}
+
+/**
+ * Copy a signature out of its fixed-layout form.
+ *
+ * @param[in]  image       The file contents
+ * @param[in]  image_size  The size of the file
+ * @param      signature   The signature
+ */
+void decode_signature(const byte *image, size_t image_size, signature_t *signature) {
+    signature_view_t view;
+    if (!view_signature(image, image_size, &view))
+        throw runtime_error("Malformed signature.");
+    copy_signature(view, signature);
+}
+
+/**
+ * Map a signature file.
+ *
+ * A file that is in neither format gives a null view() rather than an
+ * exception, so a bad file among many is just a failed verification.
+ *
+ * @param[in]  path  The path to the signature file
+ */
+SignatureFile::SignatureFile(string path) : map(MAP_FAILED), map_size(0), valid(false) {
+    PhaseTimer timer(PHASE_SIGNATURE_IO);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Could not open " + path);
+    struct stat st;
+    char magic[sizeof(SIGNATURE_FILE_MAGIC)] = {0};
+    if (fstat(fd, &st) != 0 || pread(fd, magic, sizeof(magic), 0) < 0) {
+        close(fd);
+        throw runtime_error("Could not read " + path);
+    }
+
+    if (memcmp(magic, SIGNATURE_FILE_MAGIC, sizeof(SIGNATURE_FILE_MAGIC)) != 0) {
+        close(fd);
+        std::ifstream is(path, std::ifstream::binary);
+        cereal::BinaryInputArchive iarchive(is);
+        try {
+            iarchive(legacy);
+        } catch (std::exception &) {
+            return;
+        }
+        signature_view = view_signature(legacy);
+        valid = true;
+        return;
+    }
+
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw runtime_error("Could not map " + path);
+    valid = view_signature(static_cast<const byte *>(map), map_size, &signature_view);
+}
+
+SignatureFile::~SignatureFile() {
+    if (map != MAP_FAILED)
+        munmap(map, map_size);
+}
+
+/**
+ * The signature in the file.
+ *
+ * @return     The signature, or NULL if the file is malformed.
+ */
+const signature_view_t *SignatureFile::view() const {
+    return valid ? &signature_view : NULL;
+}
@@ -0,0 +1,396 @@
+#include "state_file.hh"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/array.hpp>
+#include <cereal/types/vector.hpp>
+
+#include "sha256.hh"
+#include "stats.hh"
+#include "treehash.hh"
+
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+/**
+ * The size of a state file.
+ *
+ * @param[in]  height            The height of the signer's subtree
+ * @param[in]  auth_path_length  The length of the signer's auth path
+ *
+ * @return     The size in bytes.
+ */
+static size_t state_file_size(size_t height, size_t auth_path_length) {
+    return sizeof(state_header_t)
+        + (auth_path_length + height) * HASH_SIZE
+        + (height - 1) * sizeof(packed_treehash_t)
+        + height * sizeof(packed_node_t);
+}
+
+/**
+ * The size of a version 1 state file.
+ *
+ * @param[in]  height            The height of the signer's subtree
+ * @param[in]  auth_path_length  The length of the signer's auth path
+ *
+ * @return     The size in bytes.
+ */
+static size_t state_file_v1_size(size_t height, size_t auth_path_length) {
+    return sizeof(state_header_v1_t)
+        + (auth_path_length + 2 * height) * sizeof(packed_node_t)
+        + (height - 1) * sizeof(packed_treehash_t);
+}
+
+static void pack_node(const merkle_node &mn, packed_node_t *packed) {
+    std::copy(mn.hash.begin(), mn.hash.end(), packed->hash);
+    packed->index = mn.index;
+    packed->height = mn.height;
+}
+
+static void unpack_node(const packed_node_t &packed, merkle_node *mn) {
+    std::copy(packed.hash, packed.hash + HASH_SIZE, mn->hash.begin());
+    mn->index = packed.index;
+    mn->height = packed.height;
+}
+
+/**
+ * Copy a treehash instance's state into its on-disk form.
+ *
+ * @param[in]  t       The treehash instance
+ * @param      packed  The on-disk form
+ */
+void pack_treehash(const Treehash &t, packed_treehash_t *packed) {
+    packed->leaf_index = t.leaf_index;
+    packed->nodes_on_stack = t.nodes_on_stack;
+    packed->n_updates = t.n_updates;
+    packed->h = t.h;
+    packed->initialized = t.initialized;
+    packed->reserved = 0;
+    pack_node(t.node, &packed->node);
+}
+
+/**
+ * Restore a treehash instance's state from its on-disk form.
+ *
+ * The caller sets the global stack.
+ *
+ * @param[in]  packed       The on-disk form
+ * @param[in]  secret       The signer's secret
+ * @param[in]  wots_params  The signer's WOTS parameter set
+ * @param      t            The treehash instance
+ */
+void unpack_treehash(const packed_treehash_t &packed, const std::array<byte, HASH_SIZE> &secret,
+                     wots_params_t wots_params, Treehash *t) {
+    t->leaf_index = packed.leaf_index;
+    t->nodes_on_stack = packed.nodes_on_stack;
+    t->n_updates = packed.n_updates;
+    t->h = packed.h;
+    t->initialized = packed.initialized;
+    t->secret = secret;
+    t->wots_params = wots_params;
+    t->leaves = NULL;
+    unpack_node(packed.node, &t->node);
+}
+
+/**
+ * Compute the checksum of a state file image.
+ *
+ * @param[in]  image            The image
+ * @param[in]  image_size       The image size
+ * @param[in]  checksum_offset  Where the header holds the checksum
+ * @param      out              The checksum
+ */
+static void state_checksum(const byte *image, size_t image_size, size_t checksum_offset, byte *out) {
+    const byte zeros[HASH_SIZE] = {0};
+    Sha256 h;
+    h.update(image, checksum_offset);
+    h.update(zeros, HASH_SIZE);
+    h.update(image + checksum_offset + HASH_SIZE, image_size - checksum_offset - HASH_SIZE);
+    h.final(out);
+}
+
+/**
+ * Lay out a signer state in the fixed-layout state file format.
+ *
+ * @param[in]  signer_info  The signer information
+ * @param      image        The file contents
+ */
+void encode_signer_state(const signer_info_t &signer_info, vector<byte> *image) {
+    size_t height = signer_info.keep.size();
+    size_t auth_path_length = signer_info.auth_path.size();
+    if (height < 2 || signer_info.treehash_instances.size() != height - 1)
+        throw runtime_error("Malformed signer state.");
+    if (signer_info.treehash_stack.size() > height)
+        throw runtime_error("Treehash stack larger than the state file allows.");
+
+    image->assign(state_file_size(height, auth_path_length), 0);
+    byte *p = image->data();
+    state_header_t *header = reinterpret_cast<state_header_t *>(p);
+    memcpy(header->magic, STATE_FILE_MAGIC, sizeof(STATE_FILE_MAGIC));
+    header->version = STATE_FILE_VERSION;
+    header->height = height;
+    header->auth_path_length = auth_path_length;
+    header->stack_size = signer_info.treehash_stack.size();
+    header->exhausted = signer_info.exhausted;
+    header->wots_params = signer_info.wots_params;
+    header->signer_index = signer_info.signer_index;
+    header->leaf_index = signer_info.leaf_index;
+    std::copy(signer_info.secret_key.begin(), signer_info.secret_key.end(), header->secret_key);
+    std::copy(signer_info.retain.begin(), signer_info.retain.end(), header->retain);
+
+    byte *auth_path = p + sizeof(state_header_t);
+    byte *keep = auth_path + auth_path_length * HASH_SIZE;
+    packed_treehash_t *treehash_instances = reinterpret_cast<packed_treehash_t *>(keep + height * HASH_SIZE);
+    packed_node_t *stack = reinterpret_cast<packed_node_t *>(treehash_instances + height - 1);
+    for (size_t i = 0; i < auth_path_length; i++)
+        std::copy(signer_info.auth_path[i].begin(), signer_info.auth_path[i].end(), auth_path + i * HASH_SIZE);
+    for (size_t i = 0; i < height; i++)
+        std::copy(signer_info.keep[i].begin(), signer_info.keep[i].end(), keep + i * HASH_SIZE);
+    for (size_t i = 0; i < height - 1; i++)
+        pack_treehash(signer_info.treehash_instances[i], &treehash_instances[i]);
+    for (size_t i = 0; i < signer_info.treehash_stack.size(); i++)
+        pack_node(signer_info.treehash_stack[i], &stack[i]);
+
+    state_checksum(p, image->size(), offsetof(state_header_t, checksum), header->checksum);
+}
+
+/**
+ * Restore a signer's treehash instances and their shared stack.
+ *
+ * @param[in]  treehash_instances  The on-disk treehash instances
+ * @param[in]  stack               The on-disk stack
+ * @param[in]  height              The height of the signer's subtree
+ * @param[in]  stack_size          The number of nodes on the stack
+ * @param      signer_info         The signer information, with its secret
+ *                                 key and WOTS parameter set
+ */
+static void unpack_treehashes(const packed_treehash_t *treehash_instances, const packed_node_t *stack,
+                              size_t height, size_t stack_size, signer_info_t *signer_info) {
+    signer_info->treehash_stack.resize(stack_size);
+    for (size_t i = 0; i < stack_size; i++)
+        unpack_node(stack[i], &signer_info->treehash_stack[i]);
+    signer_info->treehash_instances.resize(height - 1);
+    for (size_t i = 0; i < height - 1; i++) {
+        Treehash &t = signer_info->treehash_instances[i];
+        unpack_treehash(treehash_instances[i], signer_info->secret_key, signer_info->wots_params, &t);
+        t.set_stack(&signer_info->treehash_stack);
+    }
+}
+
+/**
+ * Read a signer state from a version 1 file, whose auth path and keep
+ * nodes carry their heights and indices.
+ *
+ * @param[in]  image        The file contents
+ * @param[in]  image_size   The size of the file
+ * @param      signer_info  The signer information
+ */
+static void decode_signer_state_v1(const byte *image, size_t image_size, signer_info_t *signer_info) {
+    const state_header_v1_t *header = reinterpret_cast<const state_header_v1_t *>(image);
+    size_t height = header->height;
+    size_t auth_path_length = header->auth_path_length;
+    if (image_size < sizeof(state_header_v1_t) || height < 2 || height > 32 || auth_path_length > 64
+            || auth_path_length < height || header->stack_size > height
+            || image_size != state_file_v1_size(height, auth_path_length))
+        throw runtime_error("Malformed state file.");
+    byte checksum[HASH_SIZE];
+    state_checksum(image, image_size, offsetof(state_header_v1_t, checksum), checksum);
+    if (memcmp(checksum, header->checksum, HASH_SIZE) != 0)
+        throw runtime_error("State file checksum mismatch.");
+    if (header->wots_params > WOTS_W256)
+        throw runtime_error("Unknown WOTS parameter set.");
+
+    const packed_node_t *auth_path = reinterpret_cast<const packed_node_t *>(image + sizeof(state_header_v1_t));
+    const packed_node_t *keep = auth_path + auth_path_length;
+    const packed_treehash_t *treehash_instances = reinterpret_cast<const packed_treehash_t *>(keep + height);
+    const packed_node_t *stack = reinterpret_cast<const packed_node_t *>(treehash_instances + height - 1);
+
+    std::copy(header->secret_key, header->secret_key + HASH_SIZE, signer_info->secret_key.begin());
+    signer_info->exhausted = header->exhausted;
+    signer_info->wots_params = static_cast<wots_params_t>(header->wots_params);
+    // auth_path[0] is the sibling of the next leaf, and auth_path[height]
+    // that of the signer's subtree, once the top of the path is filled in
+    signer_info->leaf_index = auth_path[0].index ^ 1;
+    signer_info->signer_index = auth_path_length > height ? auth_path[height].index ^ 1 : 0;
+    std::copy(header->retain.hash, header->retain.hash + HASH_SIZE, signer_info->retain.begin());
+    signer_info->auth_path.resize(auth_path_length);
+    for (size_t i = 0; i < auth_path_length; i++)
+        std::copy(auth_path[i].hash, auth_path[i].hash + HASH_SIZE, signer_info->auth_path[i].begin());
+    signer_info->keep.resize(height);
+    for (size_t i = 0; i < height; i++)
+        std::copy(keep[i].hash, keep[i].hash + HASH_SIZE, signer_info->keep[i].begin());
+    unpack_treehashes(treehash_instances, stack, height, header->stack_size, signer_info);
+}
+
+/**
+ * Read a signer state from its fixed-layout form.
+ *
+ * @param[in]  image        The file contents
+ * @param[in]  image_size   The size of the file
+ * @param      signer_info  The signer information
+ */
+void decode_signer_state(const byte *image, size_t image_size, signer_info_t *signer_info) {
+    const state_header_t *header = reinterpret_cast<const state_header_t *>(image);
+    if (image_size < sizeof(state_header_v1_t)
+            || memcmp(header->magic, STATE_FILE_MAGIC, sizeof(STATE_FILE_MAGIC)) != 0)
+        throw runtime_error("Not a state file.");
+    if (header->version == 1)
+        return decode_signer_state_v1(image, image_size, signer_info);
+    if (header->version != STATE_FILE_VERSION)
+        throw runtime_error("Unsupported state file version.");
+    size_t height = header->height;
+    size_t auth_path_length = header->auth_path_length;
+    if (image_size < sizeof(state_header_t) || height < 2 || height > 32 || auth_path_length > 64
+            || header->stack_size > height || header->leaf_index >> height
+            || image_size != state_file_size(height, auth_path_length))
+        throw runtime_error("Malformed state file.");
+    byte checksum[HASH_SIZE];
+    state_checksum(image, image_size, offsetof(state_header_t, checksum), checksum);
+    if (memcmp(checksum, header->checksum, HASH_SIZE) != 0)
+        throw runtime_error("State file checksum mismatch.");
+    if (header->wots_params > WOTS_W256)
+        throw runtime_error("Unknown WOTS parameter set.");
+
+    const byte *auth_path = image + sizeof(state_header_t);
+    const byte *keep = auth_path + auth_path_length * HASH_SIZE;
+    const packed_treehash_t *treehash_instances = reinterpret_cast<const packed_treehash_t *>(keep + height * HASH_SIZE);
+    const packed_node_t *stack = reinterpret_cast<const packed_node_t *>(treehash_instances + height - 1);
+
+    std::copy(header->secret_key, header->secret_key + HASH_SIZE, signer_info->secret_key.begin());
+    signer_info->exhausted = header->exhausted;
+    signer_info->wots_params = static_cast<wots_params_t>(header->wots_params);
+    signer_info->signer_index = header->signer_index;
+    signer_info->leaf_index = header->leaf_index;
+    std::copy(header->retain, header->retain + HASH_SIZE, signer_info->retain.begin());
+    signer_info->auth_path.resize(auth_path_length);
+    for (size_t i = 0; i < auth_path_length; i++)
+        std::copy(auth_path + i * HASH_SIZE, auth_path + (i + 1) * HASH_SIZE, signer_info->auth_path[i].begin());
+    signer_info->keep.resize(height);
+    for (size_t i = 0; i < height; i++)
+        std::copy(keep + i * HASH_SIZE, keep + (i + 1) * HASH_SIZE, signer_info->keep[i].begin());
+    unpack_treehashes(treehash_instances, stack, height, header->stack_size, signer_info);
+}
+
+/**
+ * Load a signer state file.
+ *
+ * Fixed-layout files are mapped and decoded in place; files from before
+ * the format existed are read with cereal.
+ *
+ * @param[in]  path         The path to the state file
+ * @param      signer_info  The signer information
+ */
+void read_state_file(string path, signer_info_t *signer_info) {
+    PhaseTimer timer(PHASE_STATE_LOAD);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Could not open " + path);
+    struct stat st;
+    char magic[sizeof(STATE_FILE_MAGIC)] = {0};
+    if (fstat(fd, &st) != 0 || pread(fd, magic, sizeof(magic), 0) < 0) {
+        close(fd);
+        throw runtime_error("Could not read " + path);
+    }
+
+    if (memcmp(magic, STATE_FILE_MAGIC, sizeof(STATE_FILE_MAGIC)) != 0) {
+        close(fd);
+        std::ifstream is(path);
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive(*signer_info);
+        signer_info->wots_params = WOTS_W4;
+        for (auto &t : signer_info->treehash_instances)
+            t.set_stack(&signer_info->treehash_stack);
+        return;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw runtime_error("Could not map " + path);
+    try {
+        decode_signer_state(static_cast<const byte *>(map), st.st_size, signer_info);
+    } catch (runtime_error &e) {
+        munmap(map, st.st_size);
+        throw runtime_error(path + ": " + e.what());
+    }
+    munmap(map, st.st_size);
+}
+
+/**
+ * Write a whole signer state file.
+ *
+ * @param[in]  path         The path to the state file
+ * @param[in]  signer_info  The signer information
+ */
+void write_state_file(string path, const signer_info_t &signer_info) {
+    PhaseTimer timer(PHASE_STATE_SAVE);
+    vector<byte> image;
+    encode_signer_state(signer_info, &image);
+    std::ofstream os(path, std::ofstream::binary | std::ofstream::trunc);
+    os.write(reinterpret_cast<const char *>(image.data()), image.size());
+    if (!os)
+        throw runtime_error("Could not write " + path);
+}
+
+/**
+ * Flush a file to disk.
+ *
+ * @param[in]  path  The path to the file
+ */
+void sync_file(string path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Could not sync " + path);
+    }
+    close(fd);
+}
+
+/**
+ * Flush the directory entry of a file to disk, e.g. after a rename.
+ *
+ * @param[in]  path  The path to the file
+ */
+static void sync_parent_directory(string path) {
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Could not sync " + dir);
+    }
+    close(fd);
+}
+
+/**
+ * Atomically replace a signer state file.
+ *
+ * The state is written to a temporary file, which is synced and renamed
+ * over the old one, and the rename is synced too. After a crash the
+ * file is either the old state or the new one, never a mix.
+ *
+ * @param[in]  path         The path to the state file
+ * @param[in]  signer_info  The signer information
+ */
+void commit_state_file(string path, const signer_info_t &signer_info) {
+    string tmp_path = path + ".tmp";
+    write_state_file(tmp_path, signer_info);
+    PhaseTimer timer(PHASE_STATE_SYNC);
+    sync_file(tmp_path);
+    if (rename(tmp_path.c_str(), path.c_str()) != 0)
+        throw runtime_error("Could not write " + path);
+    sync_parent_directory(path);
+}
@@ -0,0 +1,72 @@
+#include "stats.hh"
+
+#include <sstream>
+
+using std::atomic;
+using std::string;
+
+atomic<bool> stats_enabled(false);
+atomic<uint64_t> stat_counts[N_STAT_COUNTERS];
+atomic<uint64_t> phase_calls[N_STAT_PHASES];
+atomic<uint64_t> phase_nanoseconds[N_STAT_PHASES];
+
+static const char *COUNTER_NAMES[N_STAT_COUNTERS] = {
+    "sha256_compressions",
+    "sha256_openssl",
+    "sha512",
+    "prg",
+    "combine"
+};
+
+static const char *PHASE_NAMES[N_STAT_PHASES] = {
+    "prg",
+    "derive_pk",
+    "transform_message",
+    "update_auth_path",
+    "treehash",
+    "state_load",
+    "state_save",
+    "state_sync",
+    "signature_io"
+};
+
+/**
+ * Start gathering statistics.
+ *
+ * Call this before starting any threads that should be counted.
+ */
+void enable_stats() {
+    stats_enabled = true;
+}
+
+/**
+ * Zero every counter and timer.
+ */
+void reset_stats() {
+    for (auto &c : stat_counts)
+        c = 0;
+    for (size_t i = 0; i < N_STAT_PHASES; i++) {
+        phase_calls[i] = 0;
+        phase_nanoseconds[i] = 0;
+    }
+}
+
+/**
+ * Dump the statistics gathered so far.
+ *
+ * @return     A JSON object with a "counters" object of event counts
+ *             and a "phases" object of {"calls", "ns"} per phase.
+ */
+string stats_json() {
+    std::ostringstream os;
+    os << "{\"counters\": {";
+    for (size_t i = 0; i < N_STAT_COUNTERS; i++)
+        os << (i ? ", " : "") << "\"" << COUNTER_NAMES[i] << "\": " << stat_counts[i].load();
+    os << "}, \"phases\": {";
+    for (size_t i = 0; i < N_STAT_PHASES; i++) {
+        os << (i ? ", " : "") << "\"" << PHASE_NAMES[i] << "\": {\"calls\": " << phase_calls[i].load()
+           << ", \"ns\": " << phase_nanoseconds[i].load() << "}";
+    }
+    os << "}}";
+    return os.str();
+}
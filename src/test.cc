@@ -1,15 +1,25 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main()
 #include "catch.hpp"
 
+#include <string.h>
 #include <sys/stat.h>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 
 #include "crypto_utils.hh"
+#include "sha256.hh"
 #include "treehash.hh"
 #include "sign.hh"
+#include "state_file.hh"
+#include "stats.hh"
 #include "verify.hh"
 #include "initialize.hh"
+#include "thread_pool.hh"
 
 using namespace std;
 
@@ -35,6 +45,49 @@ TEST_CASE("sha256 gives correct output", "[crypto_utils]") {
     REQUIRE(desired == received);
 }
 
+TEST_CASE("multi-lane sha256 matches sha256", "[sha256]") {
+    for (size_t n : {1, 7, 8, 17, 134}) {
+        vector<byte> in(n * HASH_SIZE);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = i * 31 + n;
+        vector<byte> out(in.size());
+        sha256_32_multi(in.data(), out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            byte expected[HASH_SIZE];
+            sha256(in.data() + i * HASH_SIZE, HASH_SIZE, expected);
+            REQUIRE(print_bytes(expected, HASH_SIZE) == print_bytes(out.data() + i * HASH_SIZE, HASH_SIZE));
+        }
+    }
+}
+
+TEST_CASE("fixed-length sha256 matches sha256", "[sha256]") {
+    byte in[2 * HASH_SIZE];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = i * 7 + 3;
+    byte expected[HASH_SIZE], out[HASH_SIZE];
+    sha256(in, HASH_SIZE, expected);
+    sha256_32(in, out);
+    REQUIRE(print_bytes(expected, HASH_SIZE) == print_bytes(out, HASH_SIZE));
+    sha256(in, 2 * HASH_SIZE, expected);
+    sha256_64(in, out);
+    REQUIRE(print_bytes(expected, HASH_SIZE) == print_bytes(out, HASH_SIZE));
+}
+
+TEST_CASE("HKDF context matches PRG", "[crypto_utils]") {
+    array<byte, HASH_SIZE> seed;
+    seed.fill(42);
+    HKDF prg(seed.data(), HASH_SIZE);
+    vector<byte> batch(4 * HASH_SIZE);
+    prg.expand_batch(batch.data(), HASH_SIZE, 0, 4);
+    REQUIRE(print_bytes(batch.data(), HASH_SIZE) == "66020db0cff30cd94d511cb1300c8abe29bce36b4acaf0531fa2587dd9c53b59");
+    REQUIRE(print_bytes(batch.data() + 3 * HASH_SIZE, HASH_SIZE) == "f23ae132e30d5cd71fd5df8020dc8f5c07000c5ef829cd6dbc759702ded8c8b4");
+    vector<byte> long_output(134 * HASH_SIZE);
+    vector<byte> expected(134 * HASH_SIZE);
+    prg.expand(long_output.data(), long_output.size(), 12345);
+    PRG(seed.data(), HASH_SIZE, expected.data(), expected.size(), 12345);
+    REQUIRE(long_output == expected);
+}
+
 TEST_CASE("treehash with explicit leaves computes correct root", "[treehash]") {
     array<byte, HASH_SIZE> seed;
     seed.fill(42);
@@ -76,19 +129,98 @@ TEST_CASE("treehash with explicit leaves computes correct root", "[treehash]") {
     REQUIRE(root == "12ba80836d8bb85de4f7243ed14f3b6889ac586e8d91d42593a0df63201fc1e7");
 }
 
+TEST_CASE("treetop built in parallel matches treehash", "[initialize]") {
+    array<byte, HASH_SIZE> seed;
+    seed.fill(7);
+    size_t lg_n_signers = 14;
+    vector<merkle_node> roots(1 << lg_n_signers);
+    for (size_t i = 0; i < roots.size(); i++) {
+        roots[i].index = i;
+        roots[i].height = 0;
+        PRG(seed.data(), HASH_SIZE, roots[i].hash.data(), HASH_SIZE, i);
+    }
+    ThreadPool one_thread(1);
+    ThreadPool pool(4);
+    treetop_t serial = initialize_treetop(roots, &one_thread);
+    treetop_t parallel = initialize_treetop(roots, &pool);
+    REQUIRE(serial.nodes.size() == 2 * roots.size() - 1);
+    REQUIRE(parallel.nodes.size() == serial.nodes.size());
+    REQUIRE(std::equal(serial.nodes.begin(), serial.nodes.end(), parallel.nodes.begin(),
+                       [](const merkle_node &a, const merkle_node &b) { return a.hash == b.hash; }));
+
+    for (size_t h = 1; h <= lg_n_signers; h++) {
+        vector<merkle_node> global_stack;
+        Treehash t(seed, &global_stack, 0, h, &roots);
+        for (size_t i = 0; i < (size_t) (1 << h); i++)
+            t.update();
+        REQUIRE(parallel.at(h, 0).hash == t.node.hash);
+        size_t last = (roots.size() >> h) - 1;
+        REQUIRE(parallel.at(h, last).index == last);
+    }
+}
+
 TEST_CASE("wots verifies correct OTS but does not verify incorrect", "[wots]") {
     array<byte, HASH_SIZE> randomness;
     get_randomness(randomness.data(), HASH_SIZE);
-    BasicWOTS w(randomness);
+    BasicWOTS<wots_w4> w(randomness);
     vector<byte> test_msg {1, 2, 3, 4};
     vector<byte> fail_msg {1, 2, 3, 4, 5};
 
-    auto sig = w.sign(test_msg);
-    BasicWOTS w2;
+    ots_signature_t sig;
+    w.sign(test_msg, &sig);
+    BasicWOTS<wots_w4> w2;
     REQUIRE(w2.verify(w.get_pk(), test_msg, sig));
     REQUIRE(!w2.verify(w.get_pk(), fail_msg, sig));
 }
 
+// Exposes the digest-to-composition mapping, which every signature and
+// verifier depends on.
+template <class Params>
+struct exposed_fixed_weight : FixedWeightWOTS<Params> {
+    using FixedWeightWOTS<Params>::transform_message;
+};
+
+TEST_CASE("messages map to the compositions of the original BIGNUM mapping", "[fixed_weight]") {
+    string text = "hardyhash known answer";
+    vector<byte> message(text.begin(), text.end());
+    // as computed by the BIGNUM implementation the limb arithmetic replaced
+    vector<vector<size_t>> expected {
+        {
+            3, 2, 0, 1, 3, 3, 1, 3, 3, 0, 2, 1, 0, 3, 3, 3, 1, 2, 1, 0, 3, 3, 3, 0, 1, 1, 2, 3, 1, 2, 3, 0, 1,
+            1, 1, 0, 0, 2, 2, 2, 3, 1, 3, 3, 0, 2, 1, 1, 2, 0, 2, 0, 3, 1, 2, 3, 0, 3, 2, 1, 1, 1, 3, 3, 1, 1,
+            1, 3, 2, 2, 0, 3, 0, 3, 3, 3, 1, 3, 3, 2, 2, 1, 3, 3, 3, 2, 1, 3, 3, 0, 3, 1, 0, 1, 3, 0, 2, 2, 2,
+            2, 0, 0, 2, 2, 3, 2, 0, 3, 0, 1, 3, 1, 1, 1, 2, 3, 3, 3, 2, 3, 3, 2, 2, 3, 2, 3, 2, 3, 2, 0, 1, 2,
+            3, 3
+        },
+        {
+            4, 14, 7, 4, 5, 7, 1, 9, 9, 3, 2, 6, 10, 8, 0, 2, 15, 10, 4, 9, 3, 6, 9, 6, 15, 1, 14, 13, 11, 13,
+            4, 9, 0, 14, 12, 5, 11, 11, 5, 7, 6, 9, 3, 10, 12, 3, 10, 8, 9, 6, 1, 13, 4, 7, 4, 13, 5, 10, 14,
+            13, 7, 13, 4, 5, 7, 1
+        },
+        {
+            3, 163, 196, 30, 21, 137, 133, 213, 149, 18, 144, 94, 244, 72, 116, 129, 214, 137, 53, 181, 135, 5,
+            230, 160, 255, 28, 206, 240, 156, 70, 66, 194, 12, 131
+        }
+    };
+    for (wots_params_t params : {WOTS_W4, WOTS_W16, WOTS_W256}) {
+        with_wots_params(params, [&](auto set) {
+            typedef exposed_fixed_weight<decltype(set)> ots_t;
+            typename ots_t::composition_t P;
+            ots_t::transform_message(message, &P);
+            REQUIRE(vector<size_t>(P.begin(), P.end()) == expected[params]);
+
+            // the first and last indices round-trip
+            count_t first = {};
+            count_t last = ots_t::composition_count();
+            for (size_t limb = 0; last[limb]-- == 0; limb++) {}
+            for (const count_t &index : {first, last}) {
+                ots_t::index_to_composition(index, &P);
+                REQUIRE(ots_t::composition_to_index(P) == index);
+            }
+        });
+    }
+}
+
 TEST_CASE("initialize, sign, and verify", "[initialize, sign, verify]") {
     const byte* randomness = (byte *) "otherrandomness";
     keys_t *keys = initialize(4, 4, randomness, 15);
@@ -106,3 +238,645 @@ TEST_CASE("initialize, sign, and verify", "[initialize, sign, verify]") {
     }
     delete keys;
 }
+
+TEST_CASE("journaled leaves are skipped when loading a signer state", "[sign]") {
+    const byte* randomness = (byte *) "journalrandomness";
+    keys_t *keys = initialize(2, 4, randomness, 17);
+    mkdir("/tmp/hardyhash_journal_tests", S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, "/tmp/hardyhash_journal_tests");
+    string state_path = "/tmp/hardyhash_journal_tests/signer_1";
+    remove((state_path + ".journal").c_str());
+    array<byte, HASH_SIZE> pk = load_public_key("/tmp/hardyhash_journal_tests/public_key");
+
+    journal_leaf(state_path, 0);
+    journal_leaf(state_path, 1);
+    signer_info_t *signer_info = load_signer_info(state_path);
+    REQUIRE(next_leaf_index(signer_info) == 2);
+
+    vector<byte> msg {1, 2, 3};
+    signature_t signature = prepare_signature(signer_info);
+    complete_signature(&signature, signer_info->secret_key, msg);
+    REQUIRE(signature.leaf.index == 2);
+    REQUIRE(verify(pk, msg, signature));
+    delete signer_info;
+    delete keys;
+}
+
+TEST_CASE("sign_batch signs with consecutive leaves", "[sign]") {
+    const byte* randomness = (byte *) "batchrandomness";
+    keys_t *keys = initialize(2, 4, randomness, 15);
+    mkdir("/tmp/hardyhash_batch_tests", S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, "/tmp/hardyhash_batch_tests");
+    string state_path = "/tmp/hardyhash_batch_tests/signer_2";
+    remove((state_path + ".journal").c_str());
+    array<byte, HASH_SIZE> pk = load_public_key("/tmp/hardyhash_batch_tests/public_key");
+
+    signature_t first = sign(state_path, vector<byte> {0});
+    REQUIRE(verify(pk, vector<byte> {0}, first));
+
+    vector<vector<byte>> messages;
+    for (byte i = 1; i < 6; i++)
+        messages.push_back(vector<byte> {i, i});
+    std::ostringstream log;
+    vector<signature_t> signatures = sign_batch(state_path, messages, 2, log);
+    REQUIRE(log.str() == "Signing messages 2 to 6 of 16 allowed.\n");
+    REQUIRE(signatures.size() == messages.size());
+    for (size_t i = 0; i < signatures.size(); i++) {
+        REQUIRE(signatures[i].leaf.index == i + 1);
+        REQUIRE(verify(pk, messages[i], signatures[i]));
+    }
+
+    signature_t next = sign(state_path, vector<byte> {6});
+    REQUIRE(next.leaf.index == 6);
+    REQUIRE(verify(pk, vector<byte> {6}, next));
+    delete keys;
+}
+
+TEST_CASE("verify_batch matches verify", "[verify]") {
+    const byte* randomness = (byte *) "verifybatchrandomness";
+    keys_t *keys = initialize(2, 2, randomness, 21);
+    mkdir("/tmp/hardyhash_verify_batch_tests", S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, "/tmp/hardyhash_verify_batch_tests");
+    array<byte, HASH_SIZE> pk = load_public_key("/tmp/hardyhash_verify_batch_tests/public_key");
+
+    vector<vector<byte>> messages;
+    vector<signature_t> signatures;
+    for (size_t signer = 0; signer < 4; signer++) {
+        string state_path = "/tmp/hardyhash_verify_batch_tests/signer_" + std::to_string(signer);
+        remove((state_path + ".journal").c_str());
+        for (byte i = 0; i < 4; i++) {
+            messages.push_back(vector<byte> {(byte) signer, i});
+            signatures.push_back(sign(state_path, messages.back()));
+        }
+    }
+    // a wrong message, and a tampered path above a node other signatures verify
+    messages[5][1] ^= 1;
+    signatures[10].auth_path.back()[0] ^= 1;
+
+    vector<bool> results = verify_batch(pk, messages, signatures, 3);
+    REQUIRE(results.size() == messages.size());
+    for (size_t i = 0; i < messages.size(); i++)
+        REQUIRE(results[i] == verify(pk, messages[i], signatures[i]));
+    REQUIRE(!results[5]);
+    delete keys;
+}
+
+TEST_CASE("verifier cache is bounded and survives a reload", "[verify]") {
+    const byte* randomness = (byte *) "verifiercacherandomness";
+    keys_t *keys = initialize(2, 2, randomness, 23);
+    mkdir("/tmp/hardyhash_verifier_cache_tests", S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, "/tmp/hardyhash_verifier_cache_tests");
+    array<byte, HASH_SIZE> pk = load_public_key("/tmp/hardyhash_verifier_cache_tests/public_key");
+    string state_path = "/tmp/hardyhash_verifier_cache_tests/signer_3";
+    remove((state_path + ".journal").c_str());
+    vector<byte> msg {7, 7};
+    signature_t first = sign(state_path, msg);
+    signature_t second = sign(state_path, msg);
+
+    VerifierCache cache(pk, 3);
+    REQUIRE(verify(pk, msg, first, &cache));
+    REQUIRE(cache.size() == 3);
+    cache.save("/tmp/hardyhash_verifier_cache_tests/cache");
+
+    VerifierCache reloaded(pk);
+    REQUIRE(reloaded.load("/tmp/hardyhash_verifier_cache_tests/cache"));
+    REQUIRE(reloaded.size() == 3);
+    REQUIRE(verify(pk, msg, second, &reloaded));
+    second.auth_path.back()[0] ^= 1;
+    REQUIRE(!verify(pk, msg, second, &reloaded));
+
+    array<byte, HASH_SIZE> other_pk = pk;
+    other_pk[0] ^= 1;
+    VerifierCache other(other_pk);
+    REQUIRE_THROWS(other.load("/tmp/hardyhash_verifier_cache_tests/cache"));
+
+    // positions past 2^32 keep their own nodes rather than sharing those
+    // of the positions they equal mod 2^32
+    vector<array<byte, HASH_SIZE>> high_auth_path(34), low_auth_path(34), high_path(33), low_path(33);
+    for (size_t h = 0; h < 34; h++) {
+        high_auth_path[h].fill(h);
+        low_auth_path[h].fill(h + 50);
+    }
+    for (size_t h = 0; h < 33; h++) {
+        high_path[h].fill(h + 100);
+        low_path[h].fill(h + 150);
+    }
+    // the two paths meet at the root, each the other's top sibling
+    high_auth_path[33] = low_path[32];
+    low_auth_path[33] = high_path[32];
+    signature_view_t high = view_signature(first);
+    high.tree_index = (1ULL << 33) | 5;
+    high.auth_path_length = 34;
+    high.auth_path = high_auth_path[0].data();
+    signature_view_t low = high;
+    low.tree_index = 5;
+    low.auth_path = low_auth_path[0].data();
+    VerifierCache wide(pk);
+    wide.insert(high, high_path);
+    wide.insert(low, low_path);
+    wide.save("/tmp/hardyhash_verifier_cache_tests/cache");
+    VerifierCache wide_reloaded(pk);
+    REQUIRE(wide_reloaded.load("/tmp/hardyhash_verifier_cache_tests/cache"));
+    REQUIRE(wide_reloaded.covers(high, 1, high_path[0]));
+    REQUIRE(wide_reloaded.covers(low, 1, low_path[0]));
+    REQUIRE(!wide_reloaded.covers(low, 1, high_path[0]));
+    delete keys;
+}
+
+TEST_CASE("thread pool runs nested tasks and reports failures", "[thread_pool]") {
+    ThreadPool pool(3);
+    std::atomic<size_t> n_run(0);
+    std::atomic<size_t> n_outside(0);
+    for (size_t i = 0; i < 100; i++) {
+        pool.submit([&]() {
+            n_run++;
+            if (pool.worker_index() >= pool.size())
+                n_outside++;
+            pool.submit([&]() { n_run++; });
+        });
+    }
+    pool.wait();
+    REQUIRE(n_run == 200);
+    REQUIRE(n_outside == 0);
+    REQUIRE(pool.worker_index() == pool.size());
+
+    pool.submit([]() { throw std::runtime_error("task failed"); });
+    REQUIRE_THROWS(pool.wait());
+    pool.submit([&]() { n_run++; });
+    pool.wait();
+    REQUIRE(n_run == 201);
+}
+
+TEST_CASE("initialize_to_directory writes the same files as initialize", "[initialize]") {
+    const byte* randomness = (byte *) "streamingrandomness";
+    keys_t *keys = initialize(4, 2, randomness, 19);
+    mkdir("/tmp/hardyhash_memory_init_tests", S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, "/tmp/hardyhash_memory_init_tests");
+    mkdir("/tmp/hardyhash_streaming_init_tests", S_IRUSR | S_IWUSR | S_IXUSR);
+    initialize_to_directory(4, 2, randomness, 19, "/tmp/hardyhash_streaming_init_tests", 3);
+
+    REQUIRE(read_file("/tmp/hardyhash_streaming_init_tests/public_key")
+            == read_file("/tmp/hardyhash_memory_init_tests/public_key"));
+    for (size_t i = 0; i < keys->signer_states.size(); i++) {
+        string name = "/signer_" + std::to_string(i);
+        REQUIRE(read_file("/tmp/hardyhash_streaming_init_tests" + name)
+                == read_file("/tmp/hardyhash_memory_init_tests" + name));
+    }
+    delete keys;
+}
+
+TEST_CASE("merged shards match a single initialize run", "[initialize]") {
+    const byte* randomness = (byte *) "shardrandomness";
+    string dir = "/tmp/hardyhash_shard_tests";
+    mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    mkdir((dir + "/shard_0").c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    mkdir((dir + "/shard_1").c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    remove((dir + "/shard_0/checkpoint").c_str());
+    remove((dir + "/shard_1/checkpoint").c_str());
+    remove((dir + "/shard_0/public_key").c_str());
+    initialize_range(2, 2, randomness, 15, dir + "/shard_0", 0, 3);
+    initialize_range(2, 2, randomness, 15, dir + "/shard_1", 3, 4);
+
+    // a state file that is not the one the checkpoint recorded
+    vector<byte> stale = read_file(dir + "/shard_0/signer_0");
+    {
+        std::ofstream os(dir + "/shard_0/signer_3", std::ofstream::binary | std::ofstream::trunc);
+        os.write(reinterpret_cast<const char *>(stale.data()), stale.size());
+    }
+    REQUIRE_THROWS(initialize_merge(dir + "/shard_0", vector<string> {dir + "/shard_0/checkpoint",
+                                                                      dir + "/shard_1/checkpoint"}));
+    struct stat st;
+    REQUIRE(stat((dir + "/shard_0/public_key").c_str(), &st) != 0);
+
+    rename((dir + "/shard_1/signer_3").c_str(), (dir + "/shard_0/signer_3").c_str());
+    initialize_merge(dir + "/shard_0", vector<string> {dir + "/shard_0/checkpoint", dir + "/shard_1/checkpoint"});
+
+    keys_t *keys = initialize(2, 2, randomness, 15);
+    array<byte, HASH_SIZE> pk = load_public_key(dir + "/shard_0/public_key");
+    REQUIRE(pk == keys->public_key);
+    vector<byte> msg {3, 1, 4};
+    signature_t signature = sign(dir + "/shard_0/signer_3", msg);
+    REQUIRE(verify(pk, msg, signature));
+    delete keys;
+}
+
+TEST_CASE("state files convert from cereal and reject corruption", "[state_file]") {
+    const byte* randomness = (byte *) "staterandomness";
+    keys_t *keys = initialize(2, 4, randomness, 15);
+    string dir = "/tmp/hardyhash_state_file_tests";
+    mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, dir);
+    string state_path = dir + "/signer_0";
+    remove((state_path + ".journal").c_str());
+    {
+        std::ofstream os(state_path);
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive(keys->signer_states[0]);
+    }
+
+    vector<byte> msg {2, 7, 1, 8};
+    array<byte, HASH_SIZE> pk = load_public_key(dir + "/public_key");
+    REQUIRE(verify(pk, msg, sign(state_path, msg)));
+    vector<byte> contents = read_file(state_path);
+    REQUIRE(memcmp(contents.data(), STATE_FILE_MAGIC, sizeof(STATE_FILE_MAGIC)) == 0);
+    REQUIRE(verify(pk, msg, sign(state_path, msg)));
+
+    signer_info_t signer_info;
+    read_state_file(state_path, &signer_info);
+    REQUIRE(next_leaf_index(&signer_info) == 2);
+    vector<byte> image;
+    encode_signer_state(signer_info, &image);
+    REQUIRE(image == read_file(state_path));
+
+    image[image.size() - 1] ^= 1;
+    REQUIRE_THROWS(decode_signer_state(image.data(), image.size(), &signer_info));
+    delete keys;
+}
+
+TEST_CASE("nodes are stored by position, and tagged signatures and states still load", "[state_file]") {
+    const byte* randomness = (byte *) "untaggedrandomness";
+    keys_t *keys = initialize(2, 4, randomness, 18);
+    signer_info_t &signer_info = keys->signer_states[2];
+    REQUIRE(signer_info.signer_index == 2);
+    vector<byte> msg {3, 1, 4, 1, 5};
+    for (size_t i = 0; i < 3; i++)
+        prepare_signature(&signer_info);
+    signature_t signature = prepare_signature(&signer_info);
+    complete_signature(&signature, signer_info.secret_key, msg);
+    REQUIRE(signature.tree_index == (2 << 4) + 3);
+    REQUIRE(verify(keys->public_key, msg, signature));
+
+    // a signature holds one hash per level, and no tags
+    std::ostringstream compact;
+    {
+        cereal::BinaryOutputArchive oarchive(compact);
+        oarchive(signature);
+    }
+    REQUIRE(compact.str().size() == 3 * sizeof(uint64_t) + sizeof(uint32_t) + 7 * HASH_SIZE
+                                    + sizeof(uint64_t) + 134 * HASH_SIZE);
+
+    // the tagged form signatures were written in before
+    std::ostringstream tagged;
+    {
+        cereal::BinaryOutputArchive oarchive(tagged);
+        vector<merkle_node> auth_path(signature.auth_path.size());
+        for (size_t h = 0; h < auth_path.size(); h++) {
+            auth_path[h].hash = signature.auth_path[h];
+            auth_path[h].height = h;
+            auth_path[h].index = (signature.tree_index >> h) ^ 1;
+        }
+        cereal::size_type ots_size = 134;
+        oarchive(auth_path, signature.leaf, cereal::make_size_tag(ots_size));
+        for (size_t i = 0; i < ots_size; i++)
+            oarchive(signature.ots[i]);
+    }
+    signature_t loaded;
+    {
+        std::istringstream is(tagged.str());
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive(loaded);
+    }
+    REQUIRE(loaded.tree_index == signature.tree_index);
+    REQUIRE(loaded.auth_path == signature.auth_path);
+    REQUIRE(verify(keys->public_key, msg, loaded));
+    loaded.tree_index ^= 1 << 5;
+    REQUIRE(!verify(keys->public_key, msg, loaded));
+
+    // the same state in the version 1 layout, with tagged nodes
+    vector<byte> image;
+    encode_signer_state(signer_info, &image);
+    size_t height = signer_info.keep.size();
+    size_t auth_path_length = signer_info.auth_path.size();
+    size_t untagged = sizeof(state_header_t) + (auth_path_length + height) * HASH_SIZE;
+    vector<byte> v1_image(sizeof(state_header_v1_t) + (auth_path_length + height) * sizeof(packed_node_t)
+                          + image.size() - untagged, 0);
+    state_header_v1_t *header = reinterpret_cast<state_header_v1_t *>(v1_image.data());
+    memcpy(header->magic, STATE_FILE_MAGIC, sizeof(STATE_FILE_MAGIC));
+    header->version = 1;
+    header->height = height;
+    header->auth_path_length = auth_path_length;
+    header->stack_size = signer_info.treehash_stack.size();
+    header->exhausted = signer_info.exhausted;
+    std::copy(signer_info.secret_key.begin(), signer_info.secret_key.end(), header->secret_key);
+    std::copy(signer_info.retain.begin(), signer_info.retain.end(), header->retain.hash);
+    packed_node_t *nodes = reinterpret_cast<packed_node_t *>(v1_image.data() + sizeof(state_header_v1_t));
+    for (size_t h = 0; h < auth_path_length; h++) {
+        std::copy(signer_info.auth_path[h].begin(), signer_info.auth_path[h].end(), nodes[h].hash);
+        nodes[h].index = (h < height ? signer_info.leaf_index >> h : 2 >> (h - height)) ^ 1;
+        nodes[h].height = h;
+    }
+    for (size_t h = 0; h < height; h++)
+        std::copy(signer_info.keep[h].begin(), signer_info.keep[h].end(), nodes[auth_path_length + h].hash);
+    std::copy(image.begin() + untagged, image.end(), reinterpret_cast<byte *>(nodes + auth_path_length + height));
+    sha256(v1_image.data(), v1_image.size(), header->checksum);
+
+    signer_info_t converted;
+    decode_signer_state(v1_image.data(), v1_image.size(), &converted);
+    REQUIRE(converted.signer_index == 2);
+    REQUIRE(converted.leaf_index == 4);
+    vector<byte> reencoded;
+    encode_signer_state(converted, &reencoded);
+    REQUIRE(reencoded == image);
+
+    // and in the cereal format from before either
+    std::stringstream legacy;
+    {
+        cereal::BinaryOutputArchive oarchive(legacy);
+        oarchive(signer_info);
+    }
+    {
+        cereal::BinaryInputArchive iarchive(legacy);
+        iarchive(converted);
+    }
+    REQUIRE(converted.signer_index == 2);
+    REQUIRE(converted.leaf_index == 4);
+    delete keys;
+}
+
+TEST_CASE("a block of reserved leaves is skipped and commits replace the state atomically", "[sign]") {
+    const byte* randomness = (byte *) "reserverandomness";
+    keys_t *keys = initialize(2, 4, randomness, 17);
+    string dir = "/tmp/hardyhash_reservation_tests";
+    mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    write_signer_states(keys, dir);
+    string state_path = dir + "/signer_2";
+    remove((state_path + ".journal").c_str());
+    array<byte, HASH_SIZE> pk = load_public_key(dir + "/public_key");
+
+    // a crash after reserving leaves 0 to 7 and using some of them
+    journal_leaf(state_path, 7);
+    vector<byte> msg {5, 5, 5};
+    signature_t signature = sign(state_path, msg);
+    REQUIRE(signature.leaf.index == 8);
+    REQUIRE(verify(pk, msg, signature));
+
+    struct stat st;
+    REQUIRE(stat((state_path + ".tmp").c_str(), &st) != 0);
+    REQUIRE(stat((state_path + ".journal").c_str(), &st) != 0);
+    signer_info_t *signer_info = load_signer_info(state_path);
+    REQUIRE(next_leaf_index(signer_info) == 9);
+    delete signer_info;
+    delete keys;
+}
+
+TEST_CASE("a one-time key derived ahead of time gives the same signature", "[sign]") {
+    const byte* randomness = (byte *) "precomputerandomness";
+    keys_t *keys = initialize(2, 4, randomness, 20);
+    signer_info_t &signer_info = keys->signer_states[1];
+    vector<byte> msg {8, 6, 7, 5, 3, 0, 9};
+
+    // as serve keeps it, with its chain levels, and as keygen makes it, without
+    FixedWeightWOTS<wots_w4> ots = wotscalc<wots_w4>(signer_info.secret_key.data(), signer_info.secret_key.size(),
+                                                     next_leaf_index(&signer_info), true);
+    FixedWeightWOTS<wots_w4> walked = wotscalc<wots_w4>(signer_info.secret_key.data(),
+                                                        signer_info.secret_key.size(), next_leaf_index(&signer_info));
+    signature_t precomputed = prepare_signature(&signer_info);
+    signature_t computed = precomputed;
+    signature_t rewalked = precomputed;
+    complete_signature(&precomputed, &ots, msg);
+    complete_signature(&computed, signer_info.secret_key, msg);
+    complete_signature(&rewalked, &walked, msg);
+    REQUIRE(precomputed.leaf.hash == computed.leaf.hash);
+    REQUIRE(precomputed.ots == computed.ots);
+    REQUIRE(rewalked.ots == computed.ots);
+    REQUIRE(verify(keys->public_key, msg, precomputed));
+    delete keys;
+}
+
+TEST_CASE("fixed-size one-time signatures keep their serialized layout", "[sign, verify]") {
+    const byte* randomness = (byte *) "fixedsizerandomness!";
+    keys_t *keys = initialize(2, 4, randomness, 20);
+    vector<byte> msg {2, 7, 1, 8};
+    signature_t signature = prepare_signature(&keys->signer_states[0]);
+    complete_signature(&signature, keys->signer_states[0].secret_key, msg);
+
+    std::ostringstream os;
+    {
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive(signature);
+    }
+    string bytes = os.str();
+    // the one-time signature is still a size tag and 134 hashes at the end
+    size_t ots_offset = bytes.size() - sizeof(uint64_t) - 134 * HASH_SIZE;
+    uint64_t ots_size;
+    memcpy(&ots_size, bytes.data() + ots_offset, sizeof(ots_size));
+    REQUIRE(ots_size == 134);
+    REQUIRE(memcmp(bytes.data() + ots_offset + sizeof(ots_size), signature.ots[0].data(), HASH_SIZE) == 0);
+
+    signature_t loaded;
+    {
+        std::istringstream is(bytes);
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive(loaded);
+    }
+    REQUIRE(loaded.ots == signature.ots);
+    REQUIRE(verify(keys->public_key, msg, loaded));
+
+    ots_size = 133;
+    memcpy(&bytes[ots_offset], &ots_size, sizeof(ots_size));
+    std::istringstream is(bytes);
+    cereal::BinaryInputArchive iarchive(is);
+    REQUIRE_THROWS_AS(iarchive(loaded), std::runtime_error);
+    delete keys;
+}
+
+TEST_CASE("every WOTS parameter set signs and verifies, and is recorded in the key", "[sign, verify]") {
+    for (wots_params_t params : {WOTS_W4, WOTS_W16, WOTS_W256}) {
+        const byte* randomness = (byte *) "parametersetrandomness";
+        keys_t *keys = initialize(2, 2, randomness, 22, 0, params);
+        string dir = string("/tmp/hardyhash_tests/wots_") + wots_params_name(params);
+        mkdir("/tmp/hardyhash_tests", S_IRWXU);
+        mkdir(dir.c_str(), S_IRWXU);
+        write_signer_states(keys, dir);
+        wots_params_t loaded_params;
+        REQUIRE(load_public_key(dir + "/public_key", &loaded_params) == keys->public_key);
+        REQUIRE(loaded_params == params);
+
+        string state_path = dir + "/signer_1";
+        vector<byte> msg {1, 6, 1, 8};
+        vector<signature_t> signatures;
+        for (size_t i = 0; i < 4; i++)
+            signatures.push_back(sign(state_path, msg));
+        for (const signature_t &signature : signatures) {
+            REQUIRE(signature.wots_params == params);
+            REQUIRE(verify(keys->public_key, msg, signature));
+            REQUIRE(!verify(keys->public_key, vector<byte> {1, 6, 1, 9}, signature));
+        }
+
+        // the size tag tells the parameter sets apart
+        std::stringstream ss;
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(signatures[0]);
+        }
+        signature_t loaded;
+        {
+            cereal::BinaryInputArchive iarchive(ss);
+            iarchive(loaded);
+        }
+        REQUIRE(loaded.wots_params == params);
+        REQUIRE(verify(keys->public_key, msg, loaded));
+        delete keys;
+    }
+}
+
+TEST_CASE("stats count hashes and time phases once enabled", "[stats]") {
+    reset_stats();
+    byte in[HASH_SIZE] = {0};
+    sha256_32(in, in);
+    REQUIRE(stat_counts[STAT_SHA256_COMPRESSIONS] == 0);
+
+    enable_stats();
+    sha256_32(in, in);
+    sha256_64(in, in);
+    REQUIRE(stat_counts[STAT_SHA256_COMPRESSIONS] == 3);
+    // one compression per input, whichever kernel runs and however the tail is padded
+    vector<byte> lanes(17 * HASH_SIZE);
+    sha256_32_multi(lanes.data(), lanes.data(), 17);
+    REQUIRE(stat_counts[STAT_SHA256_COMPRESSIONS] == 3 + 17);
+    const byte* randomness = (byte *) "statsrandomness";
+    keys_t *keys = initialize(2, 2, randomness, 15);
+    signature_t signature = prepare_signature(&keys->signer_states[0]);
+    complete_signature(&signature, keys->signer_states[0].secret_key, vector<byte> {1});
+    stats_enabled = false;
+
+    REQUIRE(stat_counts[STAT_SHA256_COMPRESSIONS] > 3 + 17);
+    REQUIRE(stat_counts[STAT_PRG] > 0);
+    REQUIRE(stat_counts[STAT_COMBINE] >= 4 * 3 + 3);
+    REQUIRE(phase_calls[PHASE_DERIVE_PK] > (1 << 4));
+    REQUIRE(phase_calls[PHASE_UPDATE_AUTH_PATH] == 1);
+    REQUIRE(phase_calls[PHASE_TRANSFORM_MESSAGE] == 1);
+    string json = stats_json();
+    REQUIRE(json.find("\"derive_pk\": {\"calls\": " + std::to_string(phase_calls[PHASE_DERIVE_PK])) != string::npos);
+    reset_stats();
+    REQUIRE(stat_counts[STAT_PRG] == 0);
+    delete keys;
+}
+
+TEST_CASE("streamed file digests sign and verify like whole messages", "[sign, verify]") {
+    string path = "/tmp/hardyhash_digest_test_message";
+    vector<byte> message(3 * (1 << 20) + 17);
+    for (size_t i = 0; i < message.size(); i++)
+        message[i] = i * 7 + (i >> 12);
+    {
+        std::ofstream os(path, std::ofstream::binary);
+        os.write(reinterpret_cast<const char *>(message.data()), message.size());
+    }
+    message_digest_t digest = digest_file(path);
+    message_digest_t expected;
+    sha256(message.data(), message.size(), expected.data());
+    REQUIRE(digest == expected);
+    REQUIRE(digest_message(message) == expected);
+
+    const byte* randomness = (byte *) "digestrandomness";
+    keys_t *keys = initialize(2, 2, randomness, 16);
+    signature_t signature = prepare_signature(&keys->signer_states[0]);
+    complete_signature(&signature, keys->signer_states[0].secret_key, digest);
+    REQUIRE(verify(keys->public_key, message, signature));
+    REQUIRE(verify(keys->public_key, digest, signature));
+    message[0] ^= 1;
+    REQUIRE(!verify(keys->public_key, message, signature));
+    delete keys;
+}
+
+TEST_CASE("signatures verify in place from the fixed file layout", "[verify]") {
+    const byte* randomness = (byte *) "signaturefilerandomness";
+    keys_t *keys = initialize(2, 4, randomness, 19);
+    vector<byte> msg {2, 7, 1, 8};
+    message_digest_t digest = digest_message(msg);
+    vector<signature_t> signatures;
+    for (size_t i = 0; i < 3; i++) {
+        signatures.push_back(prepare_signature(&keys->signer_states[1]));
+        complete_signature(&signatures.back(), keys->signer_states[1].secret_key, digest);
+    }
+    signature_t &signature = signatures[2];
+
+    // a header, the chain values and one hash per level; no one-time public key
+    vector<byte> image;
+    encode_signature(signature, &image);
+    REQUIRE(image.size() == sizeof(signature_header_t) + (134 + 6) * HASH_SIZE);
+    signature_view_t view;
+    REQUIRE(view_signature(image.data(), image.size(), &view));
+    REQUIRE(view.ots == image.data() + sizeof(signature_header_t));
+    REQUIRE(view.tree_index == (1 << 4) + 2);
+    REQUIRE(verify(keys->public_key, digest, view));
+
+    signature_t decoded;
+    decode_signature(image.data(), image.size(), &decoded);
+    REQUIRE(decoded.auth_path == signature.auth_path);
+    REQUIRE(verify(keys->public_key, msg, decoded));
+
+    string path = "/tmp/hardyhash_signature_file_test";
+    write_signature(signature, path);
+    {
+        SignatureFile file(path);
+        REQUIRE(file.view() != NULL);
+        REQUIRE(verify(keys->public_key, digest, *file.view()));
+    }
+    REQUIRE(load_signature(path).tree_index == signature.tree_index);
+
+    // signatures written with cereal before the layout existed
+    {
+        std::ofstream os(path, std::ofstream::binary | std::ofstream::trunc);
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive(signature);
+    }
+    {
+        SignatureFile file(path);
+        REQUIRE(file.view() != NULL);
+        REQUIRE(verify(keys->public_key, digest, *file.view()));
+    }
+    REQUIRE(load_signature(path).auth_path == signature.auth_path);
+
+    // truncated, wrong version, the reserved word set, and a leaf moved to
+    // the other side of its sibling
+    REQUIRE(!view_signature(image.data(), image.size() - 1, &view));
+    vector<byte> bad = image;
+    reinterpret_cast<signature_header_t *>(bad.data())->version++;
+    REQUIRE(!view_signature(bad.data(), bad.size(), &view));
+    REQUIRE_THROWS(decode_signature(bad.data(), bad.size(), &decoded));
+    bad = image;
+    reinterpret_cast<signature_header_t *>(bad.data())->reserved = 2;
+    REQUIRE(!view_signature(bad.data(), bad.size(), &view));
+    REQUIRE_THROWS(decode_signature(bad.data(), bad.size(), &decoded));
+    bad = image;
+    reinterpret_cast<signature_header_t *>(bad.data())->tree_index ^= 1;
+    REQUIRE(view_signature(bad.data(), bad.size(), &view));
+    REQUIRE(!verify(keys->public_key, digest, view));
+    {
+        std::ofstream os(path, std::ofstream::binary | std::ofstream::trunc);
+        os.write(reinterpret_cast<const char *>(image.data()), 40);
+    }
+    REQUIRE(SignatureFile(path).view() == NULL);
+    REQUIRE_THROWS(load_signature(path));
+
+    vector<vector<byte>> images(signatures.size());
+    vector<signature_view_t> views(signatures.size());
+    for (size_t i = 0; i < signatures.size(); i++) {
+        encode_signature(signatures[i], &images[i]);
+        REQUIRE(view_signature(images[i].data(), images[i].size(), &views[i]));
+    }
+    images[1][sizeof(signature_header_t) + 5] ^= 1;
+    vector<bool> results = verify_batch(keys->public_key, vector<message_digest_t>(3, digest), views, 2);
+    REQUIRE(results == (vector<bool> {true, false, true}));
+    delete keys;
+}
+
+TEST_CASE("a torn checkpoint record is dropped on resume", "[initialize]") {
+    const byte* randomness = (byte *) "resumerandomness";
+    string dir = "/tmp/hardyhash_resume_tests";
+    mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    remove((dir + "/checkpoint").c_str());
+    initialize_range(2, 2, randomness, 16, dir, 0, 2);
+    {
+        std::ofstream os(dir + "/checkpoint", std::ofstream::binary | std::ofstream::app);
+        os.write("torn", 4);
+    }
+    // each resume is interrupted again, or finishes
+    initialize_range(2, 2, randomness, 16, dir, 0, 3, 0, true);
+    initialize_to_directory(2, 2, randomness, 16, dir, 0, true);
+
+    keys_t *keys = initialize(2, 2, randomness, 16);
+    REQUIRE(load_public_key(dir + "/public_key") == keys->public_key);
+    delete keys;
+}
@@ -0,0 +1,170 @@
+#include "thread_pool.hh"
+
+#include <algorithm>
+
+using std::function;
+using std::mutex;
+using std::unique_lock;
+
+// the pool and worker index of the calling thread, if it is a worker
+static thread_local const ThreadPool *current_pool = NULL;
+static thread_local size_t current_worker = 0;
+
+/**
+ * Start a fixed number of worker threads, each with its own task queue.
+ *
+ * @param[in]  n_threads  The number of workers, or 0 for one per hardware thread.
+ */
+ThreadPool::ThreadPool(size_t n_threads) {
+    if (n_threads == 0)
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    queued = 0;
+    pending = 0;
+    next_queue = 0;
+    stopping = false;
+    for (size_t i = 0; i < n_threads; i++)
+        queues.emplace_back(new task_queue);
+    for (size_t i = 0; i < n_threads; i++)
+        workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+/**
+ * Finish the queued tasks and join the workers.
+ */
+ThreadPool::~ThreadPool() {
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    task_ready.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+/**
+ * Take a task: the newest from the worker's own queue, or else the
+ * oldest from another worker's queue.
+ *
+ * @param[in]  worker  The worker's index
+ * @param      task    The task taken
+ *
+ * @return     True if a task was taken.
+ */
+bool ThreadPool::take(size_t worker, function<void()> *task) {
+    {
+        task_queue &own = *queues[worker];
+        unique_lock<mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            *task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        task_queue &victim = *queues[(worker + i) % queues.size()];
+        unique_lock<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            *task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Run tasks until the pool is destroyed.
+ *
+ * A worker first reserves one of the queued tasks, so the search that
+ * follows always finds one.
+ *
+ * @param[in]  worker  The worker's index
+ */
+void ThreadPool::work(size_t worker) {
+    current_pool = this;
+    current_worker = worker;
+    for (;;) {
+        {
+            unique_lock<mutex> guard(lock);
+            task_ready.wait(guard, [this] { return stopping || queued > 0; });
+            if (queued == 0)
+                return;
+            queued--;
+        }
+        function<void()> task;
+        while (!take(worker, &task))
+            std::this_thread::yield();
+        try {
+            task();
+        } catch (...) {
+            unique_lock<mutex> guard(lock);
+            if (!error)
+                error = std::current_exception();
+        }
+        unique_lock<mutex> guard(lock);
+        if (--pending == 0)
+            all_done.notify_all();
+    }
+}
+
+/**
+ * Queue a task to run on one of the workers.
+ *
+ * Tasks submitted by a worker go to its own queue; others are spread
+ * over the queues in turn. Idle workers steal from busy ones.
+ *
+ * @param[in]  task  The task
+ */
+void ThreadPool::submit(function<void()> task) {
+    size_t target;
+    if (current_pool == this) {
+        target = current_worker;
+    } else {
+        unique_lock<mutex> guard(lock);
+        target = next_queue++ % queues.size();
+    }
+    {
+        task_queue &queue = *queues[target];
+        unique_lock<mutex> guard(queue.lock);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        unique_lock<mutex> guard(lock);
+        queued++;
+        pending++;
+    }
+    task_ready.notify_one();
+}
+
+/**
+ * Block until every submitted task has finished.
+ *
+ * If a task threw, the first exception is rethrown here.
+ */
+void ThreadPool::wait() {
+    unique_lock<mutex> guard(lock);
+    all_done.wait(guard, [this] { return pending == 0; });
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+/**
+ * The number of worker threads.
+ *
+ * @return     The number of workers.
+ */
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+/**
+ * The index of the calling worker, for picking per-worker scratch space.
+ *
+ * @return     A number below size() on this pool's workers, size() elsewhere.
+ */
+size_t ThreadPool::worker_index() const {
+    return current_pool == this ? current_worker : workers.size();
+}
@@ -2,6 +2,8 @@
 #include <iostream>
 #include <algorithm>
 
+#include "stats.hh"
+
 using std::array;
 using std::vector;
 
@@ -13,12 +15,15 @@ using std::vector;
  * @param[in]  leaf_index    The leaf index on which this treehash object starts.
  * @param[in]  h             The height of this treehash object.
  * @param      leaves        The leaves (optional, if missing generated using a PRG using secret.)
+ * @param[in]  wots_params   The WOTS parameter set of the generated leaves.
  */
 Treehash::Treehash(array<byte, HASH_SIZE> secret,
                    vector<merkle_node>* global_stack,
                    size_t leaf_index, size_t h,
-                   vector<merkle_node> *leaves) {
+                   vector<merkle_node> *leaves,
+                   wots_params_t wots_params) {
     this->secret = secret;
+    this->wots_params = wots_params;
     this->global_stack = global_stack;
     this->leaf_index = leaf_index;
     this->h = h;
@@ -61,7 +66,7 @@ merkle_node Treehash::leafcalc(size_t leaf_index) {
     if (this->leaves != NULL) {
         return (*this->leaves)[leaf_index];
     }
-    return ::leafcalc(this->secret.data(), this->secret.size(), leaf_index);
+    return ::leafcalc(this->secret.data(), this->secret.size(), leaf_index, this->wots_params);
 }
 
 /**
@@ -85,15 +90,28 @@ void Treehash::update() {
  * @return     The values of the saved nodes.
  */
 vector<merkle_node> Treehash::update(vector<merkle_node> *to_save) {
+    vector<merkle_node> saved;
+    this->update(to_save, &saved);
+    return saved;
+}
+
+/**
+ * Make one update step in the treehash algorithm, appending the saved
+ * nodes to a vector the caller can reuse across steps.
+ *
+ * @param      to_save  Nodes whose hashes should be saved. If null, none are saved.
+ * @param      saved    The values of the saved nodes are appended here.
+ */
+void Treehash::update(vector<merkle_node> *to_save, vector<merkle_node> *saved) {
+    PhaseTimer timer(PHASE_TREEHASH);
     merkle_node leaf = leafcalc(this->leaf_index);
     this->leaf_index++;
-    vector<merkle_node> saved;
 
     while (this->nodes_on_stack && (this->global_stack->back().height == leaf.height)) {
         if (to_save != NULL && !to_save->empty()
                             && to_save->back().height == leaf.height
                             && to_save->back().index == leaf.index) {
-            saved.push_back(leaf);
+            saved->push_back(leaf);
             to_save->pop_back();
         }
         merkle_node top = this->global_stack->back();
@@ -104,7 +122,7 @@ vector<merkle_node> Treehash::update(vector<merkle_node> *to_save) {
     if (to_save != NULL && !to_save->empty()
                         && to_save->back().height == leaf.height
                         && to_save->back().index == leaf.index) {
-        saved.push_back(leaf);
+        saved->push_back(leaf);
         to_save->pop_back();
     }
     global_stack->push_back(leaf);
@@ -116,8 +134,6 @@ vector<merkle_node> Treehash::update(vector<merkle_node> *to_save) {
         this->global_stack->pop_back();
         this->nodes_on_stack--;
     }
-
-    return saved;
 }
 
 /**
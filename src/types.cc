@@ -1,4 +1,6 @@
 #include "types.hh"
+#include "sha256.hh"
+#include "stats.hh"
 
 using std::endl;
 
@@ -46,15 +48,30 @@ bool operator < (const merkle_node &a, const merkle_node &b) {
  * @return     Parent of a and b.
  */
 merkle_node combine(merkle_node a, merkle_node b) {
-    byte sha_input[2 * HASH_SIZE];
-    std::copy(a.hash.begin(), a.hash.begin() + HASH_SIZE, sha_input);
-    std::copy(b.hash.begin(), b.hash.begin() + HASH_SIZE, sha_input + HASH_SIZE);
-    sha256(sha_input, 2 * HASH_SIZE, b.hash.data());
+    b.hash = combine(a.hash, b.hash);
     b.index = b.index / 2;
     b.height++;
     return b;
 }
 
+/**
+ * Combine the hashes of two merkle nodes to that of their parent.
+ *
+ * @param[in]  left   Left child's hash
+ * @param[in]  right  Right child's hash
+ *
+ * @return     The parent's hash.
+ */
+std::array<byte, HASH_SIZE> combine(const std::array<byte, HASH_SIZE> &left, const std::array<byte, HASH_SIZE> &right) {
+    count_stat(STAT_COMBINE);
+    byte sha_input[2 * HASH_SIZE];
+    std::copy(left.begin(), left.end(), sha_input);
+    std::copy(right.begin(), right.end(), sha_input + HASH_SIZE);
+    std::array<byte, HASH_SIZE> parent;
+    sha256_64(sha_input, parent.data());
+    return parent;
+}
+
 /**
  * Calculate a leaf of the merkle tree.
  *
@@ -64,15 +81,17 @@ merkle_node combine(merkle_node a, merkle_node b) {
  * @param      secret      This merkle node's seed
  * @param[in]  secret_len  The secret length
  * @param[in]  index       The index of the leaf
+ * @param[in]  wots_params The signer's WOTS parameter set
  *
  * @return     The public key at this leaf.
  */
-merkle_node leafcalc(byte *secret, size_t secret_len, size_t index) {
+merkle_node leafcalc(byte *secret, size_t secret_len, size_t index, wots_params_t wots_params) {
     merkle_node leaf;
-    WOTS_CLASS w = wotscalc(secret, secret_len, index);
+    with_wots_params(wots_params, [&](auto set) {
+        leaf.hash = wotscalc<decltype(set)>(secret, secret_len, index).get_pk();
+    });
     leaf.height = 0;
     leaf.index = index;
-    leaf.hash = w.get_pk();
     return leaf;
 }
 
@@ -82,12 +101,21 @@ merkle_node leafcalc(byte *secret, size_t secret_len, size_t index) {
  * @param      secret      The secret
  * @param[in]  secret_len  The secret length
  * @param[in]  index       The index
+ * @param[in]  keep_levels Keep the chain levels, for a key that will sign.
  *
- * @return     The WOTS_CLASS which has a public key available.
+ * @return     The one-time key, which has a public key available.
  */
-WOTS_CLASS wotscalc(byte *secret, size_t secret_len, size_t index) {
+template <class Params>
+FixedWeightWOTS<Params> wotscalc(byte *secret, size_t secret_len, size_t index, bool keep_levels) {
     merkle_node leaf;
     PRG(secret, secret_len, leaf.hash.data(), HASH_SIZE, index);
-    WOTS_CLASS w(leaf.hash);
+    FixedWeightWOTS<Params> w(leaf.hash, keep_levels);
     return w;
 }
+
+template FixedWeightWOTS<wots_w4> wotscalc<wots_w4>(byte *secret, size_t secret_len, size_t index,
+                                                    bool keep_levels);
+template FixedWeightWOTS<wots_w16> wotscalc<wots_w16>(byte *secret, size_t secret_len, size_t index,
+                                                      bool keep_levels);
+template FixedWeightWOTS<wots_w256> wotscalc<wots_w256>(byte *secret, size_t secret_len, size_t index,
+                                                        bool keep_levels);
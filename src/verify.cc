@@ -1,8 +1,14 @@
 #include "verify.hh"
 
+#include <stdio.h>
+
 #include <fstream>
 #include <cassert>
+#include <stdexcept>
 
+#include "sha256.hh"
+#include "stats.hh"
+#include "thread_pool.hh"
 #include "types.hh"
 
 using std::array;
@@ -19,25 +25,35 @@ using std::vector;
  * @return     The signature
  */
 signature_t load_signature(string path) {
-    std::ifstream is(path);
-    cereal::BinaryInputArchive iarchive(is);
+    SignatureFile file(path);
+    if (!file.view())
+        throw std::runtime_error("Malformed signature.");
     signature_t signature;
-    iarchive(signature);
+    copy_signature(*file.view(), &signature);
     return signature;
 }
 
 /**
  * Loads a public key.
  *
- * @param[in]  path  The path to the public key
+ * @param[in]  path         The path to the public key
+ * @param      wots_params  Optional; the key's WOTS parameter set, which
+ *                          is WOTS_W4 for keys from before it was recorded.
  *
  * @return     The public key.
  */
-array<byte, HASH_SIZE> load_public_key(string path) {
+array<byte, HASH_SIZE> load_public_key(string path, wots_params_t *wots_params) {
     std::ifstream is(path);
     cereal::BinaryInputArchive iarchive(is);
     array<byte, HASH_SIZE> pk;
     iarchive(pk);
+    int params = is.get();
+    if (params == std::char_traits<char>::eof())
+        params = WOTS_W4;
+    if (params > WOTS_W256)
+        throw std::runtime_error(path + " has an unknown WOTS parameter set.");
+    if (wots_params)
+        *wots_params = static_cast<wots_params_t>(params);
     return pk;
 }
 
@@ -48,33 +64,247 @@ array<byte, HASH_SIZE> load_public_key(string path) {
  * should match the public key.
  *
  * @param[in]  signature  The signature, including the authentication path.
+ * @param[in]  leaf       The leaf, the one-time public key.
  * @param[in]  pk         The public key.
  *
  * @return     True if the public key is the correct leaf node in the merkle tree, false otherwise.
  */
-bool verify_leaf(const signature_t &signature, const array<byte, HASH_SIZE> &pk) {
-    merkle_node leaf = signature.leaf;
+bool verify_leaf(const signature_view_t &signature, const array<byte, HASH_SIZE> &leaf,
+                 const array<byte, HASH_SIZE> &pk) {
+    if (signature.auth_path_length >= 64 || signature.tree_index >> signature.auth_path_length)
+        return false;
+    array<byte, HASH_SIZE> node = leaf;
     byte sha_input[2 * HASH_SIZE];
-    for (merkle_node mn : signature.auth_path) {
-        bool auth_is_right_node = mn.index % 2;
-        std::copy(leaf.hash.begin(), leaf.hash.begin() + HASH_SIZE, sha_input + HASH_SIZE * (1 - auth_is_right_node));
-        std::copy(mn.hash.begin(), mn.hash.begin() + HASH_SIZE, sha_input + HASH_SIZE * auth_is_right_node);
-        sha256(sha_input, 2 * HASH_SIZE, leaf.hash.data());
+    for (size_t height = 0; height < signature.auth_path_length; height++) {
+        bool auth_is_right_node = !((signature.tree_index >> height) & 1);
+        const byte *auth = signature.auth_path + height * HASH_SIZE;
+        std::copy(node.begin(), node.end(), sha_input + HASH_SIZE * (1 - auth_is_right_node));
+        std::copy(auth, auth + HASH_SIZE, sha_input + HASH_SIZE * auth_is_right_node);
+        sha256_64(sha_input, node.data());
     }
-    return leaf.hash == pk;
+    return node == pk;
+}
+
+/**
+ * Constructs an empty cache for one public key.
+ *
+ * @param[in]  public_key  The public key the cached nodes are proven against
+ * @param[in]  capacity    The maximum number of nodes to keep.
+ */
+VerifierCache::VerifierCache(const array<byte, HASH_SIZE> &public_key, size_t capacity) {
+    this->public_key = public_key;
+    this->capacity = capacity;
 }
 
 /**
- * Verify the one-time signature.
+ * The public key this cache is bound to.
+ *
+ * @return     The public key.
+ */
+const array<byte, HASH_SIZE> &VerifierCache::get_public_key() const {
+    return public_key;
+}
+
+/**
+ * The number of cached nodes.
+ *
+ * @return     The number of nodes.
+ */
+size_t VerifierCache::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return nodes.size();
+}
+
+/**
+ * Whether a node is cached with this hash. The caller holds the lock.
+ *
+ * @param[in]  height  The node's height
+ * @param[in]  index   The node's index
+ * @param[in]  hash    The node's hash
+ *
+ * @return     True if the node is cached and its hash matches.
+ */
+bool VerifierCache::has(size_t height, uint64_t index, const byte *hash) const {
+    auto it = nodes.find(std::make_pair(height, index));
+    return it != nodes.end() && std::equal(it->second.begin(), it->second.end(), hash);
+}
+
+/**
+ * Check whether the rest of a signature's path is already verified.
+ *
+ * This holds if the node computed at some height, and every node of the
+ * authentication path from there up, are cached. Then hashing on would
+ * give the public key, as verify_leaf would.
  *
  * @param[in]  signature  The signature
- * @param[in]  message    The message
+ * @param[in]  height     The height of the computed node, below the root
+ * @param[in]  node       The computed node
  *
- * @return     True if the OTS verifies, false otherwise.
+ * @return     True if the signature's path from node upwards is verified.
  */
-bool verify_ots(const signature_t &signature, const vector<byte> &message) {
-    WOTS_CLASS w;
-    return w.verify(signature.leaf.hash, message, signature.ots);
+bool VerifierCache::covers(const signature_view_t &signature, size_t height, const array<byte, HASH_SIZE> &node) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (signature.auth_path_length != path_length || !has(height, signature.tree_index >> height, node.data()))
+        return false;
+    for (size_t h = height; h < signature.auth_path_length; h++) {
+        if (!has(h, (signature.tree_index >> h) ^ 1, signature.auth_path + h * HASH_SIZE))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Record the nodes of a path that has been verified against the public key.
+ *
+ * Once the cache is full, the lowest nodes are dropped first, since they
+ * are shared by the fewest signatures.
+ *
+ * @param[in]  signature  The signature
+ * @param[in]  path       The nodes computed from the leaf, from height 1 up.
+ */
+void VerifierCache::insert(const signature_view_t &signature, const vector<array<byte, HASH_SIZE>> &path) {
+    std::lock_guard<std::mutex> guard(lock);
+    path_length = signature.auth_path_length;
+    for (size_t h = 0; h < signature.auth_path_length; h++) {
+        array<byte, HASH_SIZE> &node = nodes[std::make_pair(h, (signature.tree_index >> h) ^ 1)];
+        std::copy(signature.auth_path + h * HASH_SIZE, signature.auth_path + (h + 1) * HASH_SIZE, node.begin());
+    }
+    for (size_t i = 0; i < path.size() && i + 1 < signature.auth_path_length; i++)
+        nodes[std::make_pair(i + 1, signature.tree_index >> (i + 1))] = path[i];
+    while (nodes.size() > capacity)
+        nodes.erase(nodes.begin());
+}
+
+// A node in a cache file. Unlike merkle_node, its index holds a position
+// anywhere in a tree of up to 63 levels.
+struct cached_node {
+    array<byte, HASH_SIZE> hash;
+    uint8_t height;
+    uint64_t index;
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(hash, height, index);
+    }
+};
+
+/**
+ * Load cached nodes from a file written by save.
+ *
+ * @param[in]  path  The path to the cache file
+ *
+ * @return     False if there is no such file, true otherwise.
+ */
+bool VerifierCache::load(string path) {
+    std::ifstream is(path, std::ifstream::binary);
+    if (!is)
+        return false;
+    cereal::BinaryInputArchive iarchive(is);
+    array<byte, HASH_SIZE> file_public_key;
+    size_t file_path_length;
+    vector<cached_node> file_nodes;
+    iarchive(file_public_key, file_path_length, file_nodes);
+    if (file_public_key != public_key)
+        throw std::runtime_error(path + " caches nodes for a different public key.");
+
+    std::lock_guard<std::mutex> guard(lock);
+    path_length = file_path_length;
+    for (const cached_node &cn : file_nodes) {
+        if (nodes.size() >= capacity)
+            break;
+        nodes[std::make_pair((size_t) cn.height, cn.index)] = cn.hash;
+    }
+    return true;
+}
+
+/**
+ * Write the cached nodes to a file, replacing it atomically.
+ *
+ * @param[in]  path  The path to the cache file
+ */
+void VerifierCache::save(string path) {
+    vector<cached_node> file_nodes;
+    size_t file_path_length;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        file_path_length = path_length;
+        file_nodes.reserve(nodes.size());
+        // highest first, so a smaller cache loading this keeps the most useful nodes
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+            cached_node cn;
+            cn.height = it->first.first;
+            cn.index = it->first.second;
+            cn.hash = it->second;
+            file_nodes.push_back(cn);
+        }
+    }
+    string tmp_path = path + ".tmp";
+    {
+        std::ofstream os(tmp_path, std::ofstream::binary);
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive(public_key, file_path_length, file_nodes);
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Could not write " + path);
+}
+
+/**
+ * Verify a leaf, stopping early where the rest of its path is already verified.
+ *
+ * Signatures from the same signer share the top of their paths, and
+ * consecutive leaves share more, so in a batch most paths end early.
+ *
+ * @param[in]  signature  The signature, including the authentication path.
+ * @param[in]  leaf       The leaf, the one-time public key.
+ * @param[in]  pk         The public key.
+ * @param      cache      Nodes already verified against pk, updated on success.
+ *                        A cache for another public key is not used.
+ *
+ * @return     True if the public key is the correct leaf node in the merkle tree, false otherwise.
+ */
+bool verify_leaf(const signature_view_t &signature, const array<byte, HASH_SIZE> &leaf,
+                 const array<byte, HASH_SIZE> &pk, VerifierCache *cache) {
+    if (cache->get_public_key() != pk)
+        return verify_leaf(signature, leaf, pk);
+    if (signature.auth_path_length >= 64 || signature.tree_index >> signature.auth_path_length)
+        return false;
+    vector<array<byte, HASH_SIZE>> path;
+    path.reserve(signature.auth_path_length);
+    array<byte, HASH_SIZE> node = leaf;
+    byte sha_input[2 * HASH_SIZE];
+    for (size_t height = 0; height < signature.auth_path_length; height++) {
+        bool auth_is_right_node = !((signature.tree_index >> height) & 1);
+        const byte *auth = signature.auth_path + height * HASH_SIZE;
+        std::copy(node.begin(), node.end(), sha_input + HASH_SIZE * (1 - auth_is_right_node));
+        std::copy(auth, auth + HASH_SIZE, sha_input + HASH_SIZE * auth_is_right_node);
+        sha256_64(sha_input, node.data());
+        path.push_back(node);
+        if (height + 1 < signature.auth_path_length && cache->covers(signature, height + 1, node)) {
+            cache->insert(signature, path);
+            return true;
+        }
+    }
+    if (node != pk)
+        return false;
+    cache->insert(signature, path);
+    return true;
+}
+
+/**
+ * Compute the one-time public key that a signature's chain values commit
+ * to. The one-time signature is valid iff this is the leaf of the tree.
+ *
+ * @param[in]  signature  The signature
+ * @param[in]  digest     The digest of the message
+ *
+ * @return     The one-time public key.
+ */
+static array<byte, HASH_SIZE> recover_leaf(const signature_view_t &signature, const message_digest_t &digest) {
+    array<byte, HASH_SIZE> leaf;
+    with_wots_params(signature.wots_params, [&](auto set) {
+        FixedWeightWOTS<decltype(set)>::recover_pk_digest(digest, signature.ots, &leaf);
+    });
+    return leaf;
 }
 
 /**
@@ -83,9 +313,125 @@ bool verify_ots(const signature_t &signature, const vector<byte> &message) {
  * @param[in]  pk         The public key
  * @param[in]  message    The message
  * @param[in]  signature  The signature
+ * @param      cache      Optional cache of nodes already verified against pk.
+ *
+ * @return     True if the pk, message, signature triple verifies, false otherwise.
+ */
+bool verify(const array<byte, HASH_SIZE> &pk, const vector<byte> &message, const signature_t &signature,
+            VerifierCache *cache) {
+    return verify(pk, digest_message(message), view_signature(signature), cache);
+}
+
+/**
+ * Verify both the OTS and the key for the OTS, given the digest of the
+ * message, e.g. from digest_file.
+ *
+ * @param[in]  pk         The public key
+ * @param[in]  digest     The digest of the message
+ * @param[in]  signature  The signature
+ * @param      cache      Optional cache of nodes already verified against pk.
+ *
+ * @return     True if the pk, message, signature triple verifies, false otherwise.
+ */
+bool verify(const array<byte, HASH_SIZE> &pk, const message_digest_t &digest, const signature_t &signature,
+            VerifierCache *cache) {
+    return verify(pk, digest, view_signature(signature), cache);
+}
+
+/**
+ * Verify a signature where it lies, e.g. in a mapped signature file or a
+ * received buffer, without copying it out.
+ *
+ * The one-time public key is recomputed from the chain values and hashed
+ * up the authentication path; the signature verifies iff that gives pk.
+ *
+ * @param[in]  pk         The public key
+ * @param[in]  digest     The digest of the message
+ * @param[in]  signature  The signature
+ * @param      cache      Optional cache of nodes already verified against pk.
  *
  * @return     True if the pk, message, signature triple verifies, false otherwise.
  */
-bool verify(const array<byte, HASH_SIZE> &pk, const vector<byte> &message, const signature_t &signature) {
-    return verify_ots(signature, message) && verify_leaf(signature, pk);
+bool verify(const array<byte, HASH_SIZE> &pk, const message_digest_t &digest, const signature_view_t &signature,
+            VerifierCache *cache) {
+    array<byte, HASH_SIZE> leaf = recover_leaf(signature, digest);
+    if (cache)
+        return verify_leaf(signature, leaf, pk, cache);
+    return verify_leaf(signature, leaf, pk);
+}
+
+/**
+ * Verify many (message, signature) pairs under one public key.
+ *
+ * The pairs are spread over a thread pool, and authentication path nodes
+ * verified for one signature are reused by the others.
+ *
+ * @param[in]  pk          The public key
+ * @param[in]  messages    The messages
+ * @param[in]  signatures  The signatures, one per message
+ * @param[in]  n_threads   The number of threads, or 0 for one per hardware thread.
+ * @param      cache       Optional cache to use and update; without one, a
+ *                         cache lives for this batch only.
+ *
+ * @return     For each pair, true if it verifies, false otherwise.
+ */
+vector<bool> verify_batch(const array<byte, HASH_SIZE> &pk, const vector<vector<byte>> &messages,
+                          const vector<signature_t> &signatures, size_t n_threads, VerifierCache *cache) {
+    vector<message_digest_t> digests(messages.size());
+    {
+        ThreadPool pool(n_threads);
+        for (size_t i = 0; i < messages.size(); i++)
+            pool.submit([&, i]() { digests[i] = digest_message(messages[i]); });
+        pool.wait();
+    }
+    return verify_batch(pk, digests, signatures, n_threads, cache);
+}
+
+/**
+ * Verify many (message digest, signature) pairs under one public key.
+ *
+ * @param[in]  pk          The public key
+ * @param[in]  messages    The digests of the messages
+ * @param[in]  signatures  The signatures, one per message
+ * @param[in]  n_threads   The number of threads, or 0 for one per hardware thread.
+ * @param      cache       Optional cache to use and update; without one, a
+ *                         cache lives for this batch only.
+ *
+ * @return     For each pair, true if it verifies, false otherwise.
+ */
+vector<bool> verify_batch(const array<byte, HASH_SIZE> &pk, const vector<message_digest_t> &messages,
+                          const vector<signature_t> &signatures, size_t n_threads, VerifierCache *cache) {
+    vector<signature_view_t> views;
+    views.reserve(signatures.size());
+    for (const signature_t &signature : signatures)
+        views.push_back(view_signature(signature));
+    return verify_batch(pk, messages, views, n_threads, cache);
+}
+
+/**
+ * Verify many (message digest, signature) pairs under one public key,
+ * reading each signature where it lies.
+ *
+ * @param[in]  pk          The public key
+ * @param[in]  messages    The digests of the messages
+ * @param[in]  signatures  The signatures, one per message
+ * @param[in]  n_threads   The number of threads, or 0 for one per hardware thread.
+ * @param      cache       Optional cache to use and update; without one, a
+ *                         cache lives for this batch only.
+ *
+ * @return     For each pair, true if it verifies, false otherwise.
+ */
+vector<bool> verify_batch(const array<byte, HASH_SIZE> &pk, const vector<message_digest_t> &messages,
+                          const vector<signature_view_t> &signatures, size_t n_threads, VerifierCache *cache) {
+    assert(messages.size() == signatures.size());
+    VerifierCache batch_cache(pk);
+    if (!cache)
+        cache = &batch_cache;
+    // vector<bool> packs bits, so collect results in bytes
+    vector<char> results(messages.size(), 0);
+    ThreadPool pool(n_threads);
+    for (size_t i = 0; i < messages.size(); i++)
+        pool.submit([&, i]() { results[i] = verify(pk, messages[i], signatures[i], cache); });
+    pool.wait();
+    return vector<bool>(results.begin(), results.end());
 }
@@ -1,77 +1,175 @@
-#include <openssl/bn.h>
-
 #include <iostream>
 #include <vector>
-#include <map>
 #include <algorithm>
-#include <functional>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include <openssl/crypto.h>
 
 #include "wots.hh"
 #include "crypto_utils.hh"
+#include "sha256.hh"
+#include "stats.hh"
 
 using std::array;
 using std::cerr;
 using std::endl;
-using std::make_pair;
-using std::map;
-using std::pair;
+using std::string;
 using std::vector;
 
 /**
- * Constructs the WOTS object.
+ * The name of a parameter set, as given to initialize --wots.
+ *
+ * @param[in]  params  The parameter set
+ *
+ * @return     "w4", "w16" or "w256".
+ */
+const char *wots_params_name(wots_params_t params) {
+    switch (params) {
+        case WOTS_W4: return "w4";
+        case WOTS_W16: return "w16";
+        case WOTS_W256: return "w256";
+    }
+    return "unknown";
+}
+
+/**
+ * Look up a parameter set by name.
+ *
+ * @param[in]  name    "w4", "w16" or "w256"
+ * @param      params  The parameter set, if the name is known
+ *
+ * @return     True if the name is known.
+ */
+bool parse_wots_params(string name, wots_params_t *params) {
+    for (wots_params_t p : {WOTS_W4, WOTS_W16, WOTS_W256}) {
+        if (name == wots_params_name(p)) {
+            *params = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * The number of chains, and so of hashes in a one-time signature, of a
+ * parameter set.
+ *
+ * @param[in]  params  The parameter set
+ *
+ * @return     The width.
+ */
+size_t wots_width(wots_params_t params) {
+    size_t width = 0;
+    with_wots_params(params, [&](auto set) { width = decltype(set)::width; });
+    return width;
+}
+
+/**
+ * Find the parameter set of a one-time signature from its number of
+ * hashes, which differs between every parameter set.
+ *
+ * @param[in]  width   The width
+ * @param      params  The parameter set, if there is one of that width
+ *
+ * @return     True if a parameter set has that width.
+ */
+bool wots_params_for_width(size_t width, wots_params_t *params) {
+    for (wots_params_t p : {WOTS_W4, WOTS_W16, WOTS_W256}) {
+        if (wots_width(p) == width) {
+            *params = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Constructs the WOTS object and derives its public key.
  *
  * This object should not be used directly; use one of its child classes instead.
  *
  * @param[in]  key_material  Bytes from which the secret key should be generated.
- * @param[in]  width         The width of the WOTS
- * @param[in]  depth         The depth of the WOTS.
+ * @param[in]  keep_levels   Keep every level of every chain, so that sign
+ *                           reads the signature off them instead of
+ *                           walking the chains again. Only worth it for a
+ *                           key that will sign.
  */
-WOTS::WOTS(array<byte, HASH_SIZE> key_material, size_t width, size_t depth) {
-    sha256(key_material.data(), key_material.size(), this->sk_seed.data());
-    this->width = width;
-    this->depth = depth;
+template <class Params>
+WOTS<Params>::WOTS(array<byte, HASH_SIZE> key_material, bool keep_levels) {
+    sha256_32(key_material.data(), this->sk_seed.data());
     this->used = false;
+    if (keep_levels)
+        this->chain_values.reset(new std::array<byte, (Params::depth + 1) * Params::width * HASH_SIZE>);
+    this->derive_pk();
 }
 
 /**
- * Constructs the object without a key.
- *
- * @param[in]  width  The width
- * @param[in]  depth  The depth
+ * Wipes the kept chain levels, which hold the secret key.
  */
-WOTS::WOTS(size_t width, size_t depth) {
-    this->width = width;
-    this->depth = depth;
+template <class Params>
+WOTS<Params>::~WOTS() {
+    if (this->chain_values)
+        OPENSSL_cleanse(this->chain_values->data(), this->chain_values->size());
 }
 
 /**
  * Derive the secret key for this WOTS.
  *
- * @return     The whole secret key.
+ * @param      sk    Output buffer of width * HASH_SIZE bytes for the whole secret key.
  */
-vector<byte> WOTS::derive_sk() {
-    vector<byte> sk(this->width * HASH_SIZE);
-    PRG(this->sk_seed.data(), this->sk_seed.size(), sk.data(), sk.size(), 0);
-    return sk;
+template <class Params>
+void WOTS<Params>::derive_sk(byte *sk) {
+    PRG(this->sk_seed.data(), this->sk_seed.size(), sk, Params::width * HASH_SIZE, 0);
 }
 
 /**
- * Apply a function f to an input n_iters times.
+ * Apply a function f to a value n_iters times, in place.
  *
- * @param[in]  base     The initial hash
+ * @param      value    The initial hash, replaced by f^(n_iters)(value)
  * @param[in]  n_iters  The number of times to apply the hash.
+ */
+template <class Params>
+void WOTS<Params>::iter_f(array<byte, HASH_SIZE> &value, size_t n_iters) {
+    for (size_t i=0; i < n_iters; i++)
+        Params::hash::f(value.data(), value.data());
+}
+
+/**
+ * Advance every chain in lockstep.
  *
- * @return     f^(n_iters)(base)
+ * At every step, all chains that still need another application of f
+ * are gathered and hashed together by the multi-lane kernel.
+ *
+ * @param      chains    width consecutive 32-byte chain values, updated in place.
+ * @param[in]  n_iters   The number of times to apply f to each chain.
  */
-array<byte, HASH_SIZE> WOTS::iter_f(array<byte, HASH_SIZE> base, size_t n_iters) {
-    // TODO make f a part of the class, instead of defaulting to sha256
-    for (size_t i=0; i < n_iters; i++) {
-        array<byte, HASH_SIZE> next;
-        sha256(base.data(), base.size(), next.data());
-        base = next;
+template <class Params>
+void WOTS<Params>::iter_f_multi(byte *chains, const size_t *n_iters) {
+    const size_t n_chains = Params::width;
+    size_t max_iters = 0;
+    for (size_t i = 0; i < n_chains; i++)
+        max_iters = std::max(max_iters, n_iters[i]);
+
+    byte active[n_chains * HASH_SIZE];
+    size_t active_ix[n_chains];
+    for (size_t step = 0; step < max_iters; step++) {
+        size_t n_active = 0;
+        for (size_t i = 0; i < n_chains; i++) {
+            if (n_iters[i] > step)
+                active_ix[n_active++] = i;
+        }
+        if (n_active == n_chains) {
+            Params::hash::f_multi(chains, chains, n_chains);
+            continue;
+        }
+        for (size_t j = 0; j < n_active; j++)
+            memcpy(active + j * HASH_SIZE, chains + active_ix[j] * HASH_SIZE, HASH_SIZE);
+        Params::hash::f_multi(active, active, n_active);
+        for (size_t j = 0; j < n_active; j++)
+            memcpy(chains + active_ix[j] * HASH_SIZE, active + j * HASH_SIZE, HASH_SIZE);
     }
-    return base;
 }
 
 /**
@@ -79,55 +177,138 @@ array<byte, HASH_SIZE> WOTS::iter_f(array<byte, HASH_SIZE> base, size_t n_iters)
  *
  * @return     The public key.
  */
-array<byte, HASH_SIZE> WOTS::get_pk() {
+template <class Params>
+array<byte, HASH_SIZE> WOTS<Params>::get_pk() {
     return this->pk;
 }
 
 /**
  * Derive the public key from the secret key.
+ *
+ * A key made to sign keeps every level of every chain; any other key
+ * walks the chains in place.
  */
-void BasicWOTS::derive_pk() {
-    vector<byte> pk_uncompressed(this->width * HASH_SIZE);
-    vector<byte> sk = this->derive_sk();
-    for (size_t i=0; i < this->width; i++) {
-        array<byte, HASH_SIZE> sk_part;
-        copy(sk.begin() + i * HASH_SIZE, sk.begin() + (i + 1) * HASH_SIZE, sk_part.begin());
-        array<byte, HASH_SIZE> pk_part = this->iter_f(sk_part, this->depth);
-        copy(pk_part.begin(), pk_part.end(), pk_uncompressed.begin() + i * HASH_SIZE);
+template <class Params>
+void WOTS<Params>::derive_pk() {
+    PhaseTimer timer(PHASE_DERIVE_PK);
+    const size_t level_size = Params::width * HASH_SIZE;
+    if (this->chain_values) {
+        byte *levels = this->chain_values->data();
+        this->derive_sk(levels);
+        for (size_t i = 0; i < Params::depth; i++)
+            Params::hash::f_multi(levels + i * level_size, levels + (i + 1) * level_size, Params::width);
+        Params::hash::compress(levels + Params::depth * level_size, level_size, this->pk.data());
+        return;
     }
-    sha256(pk_uncompressed.data(), pk_uncompressed.size(), this->pk.data());
+    byte chains[level_size];
+    this->derive_sk(chains);
+    for (size_t i = 0; i < Params::depth; i++)
+        Params::hash::f_multi(chains, chains, Params::width);
+    Params::hash::compress(chains, level_size, this->pk.data());
 }
 
 /**
- * Transform a message into a vector of length this->width.
+ * Sign a transformed message.
  *
- * @param[in]  message  The message
+ * Invalidates the object so it can't be used to sign any more messages.
+ *
+ * @param[in]  P          The transformed message, one chain position per chain
+ * @param      signature  Receives the one-time signature; hashes past the width are zeroed.
+ */
+template <class Params>
+void WOTS<Params>::sign_composition(const composition_t &P, ots_signature_t *signature) {
+    if (this->used) {
+        cerr << "Already signed using this keypair." << endl;
+        exit(2);
+    }
+    this->used = true;  // render this object useless
+    if (this->chain_values) {
+        for (size_t i = 0; i < Params::width; i++) {
+            // chain i at level P[i], as kept by derive_pk
+            auto value = this->chain_values->begin() + (P[i] * Params::width + i) * HASH_SIZE;
+            std::copy(value, value + HASH_SIZE, (*signature)[i].begin());
+        }
+        // the other levels must never be revealed
+        OPENSSL_cleanse(this->chain_values->data(), this->chain_values->size());
+    } else {
+        this->derive_sk((*signature)[0].data());
+        iter_f_multi((*signature)[0].data(), P.data());
+    }
+    for (size_t i = Params::width; i < signature->size(); i++)
+        (*signature)[i].fill(0);
+}
+
+/**
+ * Verify a one-time signature on a transformed message.
+ *
+ * @param[in]  pk         The OTS public key.
+ * @param[in]  P          The transformed message
+ * @param[in]  signature  The signature
+ *
+ * @return     True if it verifies correctly, false otherwise.
+ */
+template <class Params>
+bool WOTS<Params>::verify_composition(const array<byte, HASH_SIZE> &pk, const composition_t &P,
+                                      const ots_signature_t &signature) {
+    array<byte, HASH_SIZE> pk_test;
+    recover_pk(P, signature[0].data(), &pk_test);
+    return pk_test == pk;
+}
+
+/**
+ * Compute the public key that a one-time signature on a transformed
+ * message commits to, by finishing each chain.
+ *
+ * @param[in]  P          The transformed message
+ * @param[in]  signature  The signature's Params::width chain values, back to back
+ * @param      pk         Receives the public key.
+ */
+template <class Params>
+void WOTS<Params>::recover_pk(const composition_t &P, const byte *signature, array<byte, HASH_SIZE> *pk) {
+    array<byte, Params::width * HASH_SIZE> pk_uncompressed;
+    composition_t remaining;
+    std::copy(signature, signature + Params::width * HASH_SIZE, pk_uncompressed.begin());
+    for (size_t i = 0; i < Params::width; i++)
+        remaining[i] = Params::depth - P[i];
+    iter_f_multi(pk_uncompressed.data(), remaining.data());
+    Params::hash::compress(pk_uncompressed.data(), pk_uncompressed.size(), pk->data());
+}
+
+/**
+ * The number of bits that name a position on a chain of the given depth.
+ *
+ * @param[in]  depth  The depth, one less than a power of two
  *
- * @return     A vector where every element is in the range [0, depth]
+ * @return     lg(depth + 1), or 0 if depth + 1 is not a power of two.
  */
-vector<size_t> BasicWOTS::transform_message(vector<byte> message) {
-    // assumes depth 3
+static constexpr size_t chain_position_bits(size_t depth) {
+    size_t bits = 0;
+    while ((size_t(1) << bits) <= depth)
+        bits++;
+    return (size_t(1) << bits) == depth + 1 ? bits : 0;
+}
+
+/**
+ * Transform a message into one chain position per chain, by reading
+ * lg(depth + 1) bits of its sha512 hash for each chain.
+ *
+ * @param[in]  message  The message
+ * @param      P        Every element is set to a position in the range [0, depth]
+ */
+template <class Params>
+void BasicWOTS<Params>::transform_message(const vector<byte> &message, typename WOTS<Params>::composition_t *P) {
+    constexpr size_t bits = chain_position_bits(Params::depth);
+    static_assert(bits > 0, "BasicWOTS needs depth + 1 to be a power of two");
+    static_assert(Params::width * bits <= 512, "BasicWOTS reads every chain position from one sha512 hash");
     array<byte, 64> sha_output;
 
     // TODO concat random string to the end of message
-    sha512(message.data(), message.size(), sha_output.data());
-
-    vector<size_t> P(this->width);
-    for (size_t i = 0; i < P.size(); i++) {
-        byte curr = sha_output[i / 4];
-        // read 2 bits at a time
-        switch (i % 4) {
-            case 0: P[i] = curr & (3);
-                    break;
-            case 1: P[i] = (curr & (3 << 2)) >> 2;
-                    break;
-            case 2: P[i] = (curr & (3 << 4)) >> 4;
-                    break;
-            case 3: P[i] = (curr & (3 << 6)) >> 6;
-                    break;
-        }
+    sha512(const_cast<byte *>(message.data()), message.size(), sha_output.data());
+
+    for (size_t i = 0; i < Params::width; i++) {
+        size_t bit = i * bits;
+        (*P)[i] = (sha_output[bit / 8] >> (bit % 8)) & Params::depth;
     }
-    return P;
 }
 
 /**
@@ -135,26 +316,17 @@ vector<size_t> BasicWOTS::transform_message(vector<byte> message) {
  *
  * Invalidates the object so it can't be used to sign any more messages.
  *
- * @param[in]  message  The message to sign
- *
- * @return     The one-time signature.
+ * @param[in]  message    The message to sign
+ * @param      signature  Receives the one-time signature.
  */
-ots_signature_t BasicWOTS::sign(vector<byte> message) {
-    if (this->used) {
-        cerr << "Already signed using this keypair." << endl;
-        exit(2);
+template <class Params>
+void BasicWOTS<Params>::sign(const vector<byte> &message, ots_signature_t *signature) {
+    typename WOTS<Params>::composition_t P;
+    {
+        PhaseTimer timer(PHASE_TRANSFORM_MESSAGE);
+        transform_message(message, &P);
     }
-    this->used = true;  // render this object useless
-    vector<size_t> P = this->transform_message(message);
-    ots_signature_t sig(P.size());
-    vector<byte> sk = this->derive_sk();
-    for (size_t i = 0; i < P.size(); i++) {
-        array<byte, HASH_SIZE> sk_part;
-        copy(sk.begin() + i * HASH_SIZE, sk.begin() + (i + 1) * HASH_SIZE, sk_part.begin());
-        array<byte, HASH_SIZE> signature_part = iter_f(sk_part, P[i]);
-        sig[i] = signature_part;
-    }
-    return sig;
+    this->sign_composition(P, signature);
 }
 
 /**
@@ -166,25 +338,84 @@ ots_signature_t BasicWOTS::sign(vector<byte> message) {
  *
  * @return     True if it verifies correctly, false otherwise.
  */
-bool BasicWOTS::verify(array<byte, HASH_SIZE> pk, vector<byte> message, ots_signature_t signature) {
-    vector<size_t> P = this->transform_message(message);
-    vector<byte> pk_uncompressed(this->width * HASH_SIZE);
+template <class Params>
+bool BasicWOTS<Params>::verify(const array<byte, HASH_SIZE> &pk, const vector<byte> &message,
+                               const ots_signature_t &signature) {
+    typename WOTS<Params>::composition_t P;
+    {
+        PhaseTimer timer(PHASE_TRANSFORM_MESSAGE);
+        transform_message(message, &P);
+    }
+    return WOTS<Params>::verify_composition(pk, P, signature);
+}
+
+/// FIXED WEIGHT UTILS (TODO move to a different file)
+
+/**
+ * The number of restricted integer compositions of every weight
+ * up to w into every width up to n, with every part in [0, d].
+ */
+struct counts_table {
+    int max_weight;
+    int max_width;
+    vector<count_t> counts;  // indexed by n * (max_weight + 1) + w
 
-    for (size_t i=0; i < P.size(); i++) {
-        array<byte, HASH_SIZE> pk_part = this->iter_f(signature[i], this->depth - P[i]);
-        copy(pk_part.begin(), pk_part.end(), pk_uncompressed.begin() + i * HASH_SIZE);
+    /**
+     * The number of compositions of w into n parts.
+     *
+     * @param[in]  w     The weight
+     * @param[in]  n     The width
+     *
+     * @return     The count, zero if w or n is out of range.
+     */
+    const count_t &get(int w, int n) const {
+        static const count_t zero = {};
+        if (w < 0 || n < 0 || w > this->max_weight || n > this->max_width)
+            return zero;
+        return this->counts[n * (this->max_weight + 1) + w];
+    }
+};
+
+/**
+ * a += b
+ */
+static inline void count_add(count_t &a, const count_t &b) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < COUNT_LIMBS; i++) {
+        uint64_t sum = a[i] + carry;
+        carry = sum < carry;
+        sum += b[i];
+        carry += sum < b[i];
+        a[i] = sum;
     }
-    array<byte, HASH_SIZE> pk_test;
-    sha256(pk_uncompressed.data(), pk_uncompressed.size(), pk_test.data());
-    return pk_test == pk;
 }
 
+/**
+ * a -= b, assuming a >= b
+ */
+static inline void count_sub(count_t &a, const count_t &b) {
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < COUNT_LIMBS; i++) {
+        uint64_t bi = b[i] + borrow;
+        borrow = (bi < borrow) || (a[i] < bi);
+        a[i] -= bi;
+    }
+}
 
-/// FIXED WEIGHT UTILS (TODO move to a different file)
+/**
+ * a < b
+ */
+static inline bool count_less(const count_t &a, const count_t &b) {
+    for (size_t i = COUNT_LIMBS; i-- > 0;) {
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    }
+    return false;
+}
 
 /**
- * Builds a cache of the number of fixed-weight integer
- * compositions. The cache maps (w, n) to the number of integer
+ * Builds a table of the number of fixed-weight integer
+ * compositions. The table maps (w, n) to the number of integer
  * compositions of w into n parts given that every part is in the range
  * [0, d].
  *
@@ -192,66 +423,45 @@ bool BasicWOTS::verify(array<byte, HASH_SIZE> pk, vector<byte> message, ots_sign
  * @param[in]  n     The width of the signature
  * @param[in]  d     The depth of the signature.
  *
- * @return     The counts cache.
+ * @return     The counts table.
  */
-map<pair<int, int>, BIGNUM*> build_counts_cache(int w, int n, int d) {
-    map<pair<int, int>, BIGNUM*> cache;
-    BIGNUM *zero = BN_new();
-    BIGNUM *one = BN_new();
-    BN_one(one);
-    cache[make_pair(0, 0)] = one;
-    std::function<BIGNUM*(int, int)> build_cache_rec = [&] (int w, int n) {
-        if (w < 0 || n < 0) {
-            return zero;
-        }
-        pair<int, int> params = make_pair(w, n);
-        auto it = cache.find(params);
-        if (it != cache.end()) {
-            return it->second;
+static counts_table build_counts_table(int w, int n, int d) {
+    counts_table table;
+    table.max_weight = w;
+    table.max_width = n;
+    table.counts.resize((n + 1) * (w + 1));
+    table.counts[0][0] = 1;
+    for (int width = 1; width <= n; width++) {
+        for (int weight = 0; weight <= w; weight++) {
+            // the sum of get(weight - i, width - 1) over i in [0, d], slid
+            // along from the total of weight - 1
+            count_t &total = table.counts[width * (w + 1) + weight];
+            total = table.get(weight - 1, width);
+            count_add(total, table.get(weight, width - 1));
+            count_sub(total, table.get(weight - d - 1, width - 1));
         }
-        BIGNUM *total = BN_new();
-        for (int i = 0; i <= d; i++) {
-            BN_add(total, total, build_cache_rec(w - i, n - 1));
-        }
-        cache[params] = total;
-        return total;
-    };
-    build_cache_rec(w, n);
-    BN_free(zero);
-    return cache;
-}
-
-/**
- * Free the counts cache generated by build_counts_cache.
- *
- * @param      counts  The counts cache.
- */
-void free_cache(map<pair<int, int>, BIGNUM*> &counts) {
-    for (auto &entry : counts) {
-        BN_free(entry.second);
-        entry.second = NULL;
     }
+    return table;
 }
 
-
 /**
  * Map a restricted integer composition to its index in a lexicographic
- * ordering of all valid compositions defined by the counts cache.
+ * ordering of all valid compositions defined by the counts table.
  *
  * @param[in]  composition  The composition
- * @param      counts       The counts cache
+ * @param[in]  n            The number of parts
+ * @param[in]  counts       The counts table
  *
  * @return     The lexicographic index of the composition.
  */
-BIGNUM *composition_to_index(vector<size_t> composition, map<pair<int, int>, BIGNUM*> &counts) {
-    BIGNUM *num_below = BN_new();
-    size_t weight = 0;
-    for (size_t &elem : composition) weight += elem;
-    assert(weight == 241);
-    size_t n = composition.size();
-    for (auto &d : composition) {
+static count_t composition_to_index(const size_t *composition, int n, const counts_table &counts) {
+    count_t num_below = {};
+    int weight = 0;
+    for (int i = 0; i < n; i++) weight += composition[i];
+    for (int part = 0, parts = n; part < parts; part++) {
+        size_t d = composition[part];
         for (size_t i = 0; i < d; i++) {
-            BN_add(num_below, num_below, counts[{weight - i, n - 1}]);
+            count_add(num_below, counts.get(weight - i, n - 1));
         }
         weight -= d;
         n -= 1;
@@ -264,15 +474,16 @@ BIGNUM *composition_to_index(vector<size_t> composition, map<pair<int, int>, BIG
  *
  * Note that the integer must be less than the number of possible compositions.
  *
- * @param[in]  w       The weight of the compositions
- * @param[in]  n       The width of the compositions
- * @param[in]  d       The max depth of each part of the compositions
- * @param      index   The integer to map to a composition
- * @param      counts  The counts cache.
- *
- * @return     A restricted integer composition of weight w, width n and depth max d.
+ * @param[in]  w            The weight of the compositions
+ * @param[in]  n            The width of the compositions
+ * @param[in]  d            The max depth of each part of the compositions
+ * @param[in]  index        The integer to map to a composition
+ * @param[in]  counts       The counts table.
+ * @param      composition  Receives n parts: a restricted integer composition
+ *                          of weight w, width n and depth max d.
  */
-vector<size_t> index_to_composition(int w, int n, int d, BIGNUM *index, map<pair<int, int>, BIGNUM*> &counts) {
+static void index_to_composition(int w, int n, int d, count_t index, const counts_table &counts,
+                                 size_t *composition) {
     /*
     // index 0
     vector<size_t> minimum = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3};
@@ -289,51 +500,200 @@ vector<size_t> index_to_composition(int w, int n, int d, BIGNUM *index, map<pair
         assert(index_to_composition(241, 134, 3, composition_to_index(test, counts), counts) == test);s
     }
     */
-    vector<size_t> composition(n);
-    for (size_t i = 0; i < composition.size(); i++) {
-        for (int depth = 0; depth <= d; depth++) {
-            BN_sub(index, index, counts[{w - depth, n - 1}]);
-            if (BN_is_negative(index)) {
-                BN_add(index, index, counts[{w - depth, n - 1}]);
-                composition[i] = depth;
+    for (size_t i = 0, parts = n; i < parts; i++) {
+        // counts for the remaining n - 1 parts, starting at weight w
+        const count_t *row = &counts.get(0, n - 1) + w;
+        int depth = 0;
+        for (; depth < d && depth <= w; depth++) {
+            if (count_less(index, row[-depth]))
                 break;
-            }
+            count_sub(index, row[-depth]);
         }
+        composition[i] = depth;
         n--;
-        w -= composition[i];
+        w -= depth;
     }
-    return composition;
 }
 
 
+/**
+ * The counts table of a parameter set, built on first use and shared by
+ * every later sign and verify.
+ *
+ * @return     The counts table.
+ */
+template <class Params>
+static const counts_table &fixed_weight_counts() {
+    static const counts_table counts = build_counts_table(Params::weight, Params::width, Params::depth);
+    return counts;
+}
+
+/**
+ * The number of compositions of the parameter set's weight into its
+ * width parts.
+ *
+ * @return     The count; every index is below it.
+ */
+template <class Params>
+count_t FixedWeightWOTS<Params>::composition_count() {
+    return fixed_weight_counts<Params>().get(Params::weight, Params::width);
+}
+
+/**
+ * Map a composition to its index among all compositions of the parameter set.
+ *
+ * @param[in]  P     The composition
+ *
+ * @return     Its lexicographic index.
+ */
+template <class Params>
+count_t FixedWeightWOTS<Params>::composition_to_index(const typename WOTS<Params>::composition_t &P) {
+    return ::composition_to_index(P.data(), Params::width, fixed_weight_counts<Params>());
+}
+
+/**
+ * Map an index to its composition; the inverse of composition_to_index.
+ *
+ * @param[in]  index  The index, which must be below composition_count()
+ * @param      P      Receives the composition.
+ */
+template <class Params>
+void FixedWeightWOTS<Params>::index_to_composition(const count_t &index, typename WOTS<Params>::composition_t *P) {
+    ::index_to_composition(Params::weight, Params::width, Params::depth, index, fixed_weight_counts<Params>(),
+                           P->data());
+}
+
 /**
  * Transform a message into a restricted integer composition.
  *
  * @param[in]  message  The message
+ * @param      P        Receives a restricted integer composition of the
+ *                      weight, with width parts and each part in [0, depth].
+ */
+template <class Params>
+void FixedWeightWOTS<Params>::transform_message(const vector<byte> &message,
+                                                typename WOTS<Params>::composition_t *P) {
+    // TODO concat random string to the end of message
+    transform_digest(digest_message(message), P);
+}
+
+/**
+ * Transform a message digest into a restricted integer composition.
  *
- * @return     A restricted integer composition of the WeightConstant,
- *             with width parts and each part in [0, depth].
+ * @param[in]  sha_output  The sha256 digest of the message
+ * @param      P           Receives a restricted integer composition of the
+ *                         weight, with width parts and each part in [0, depth].
  */
-vector<size_t> FixedWeightWOTS::transform_message(vector<byte> message) {
+template <class Params>
+void FixedWeightWOTS<Params>::transform_digest(const message_digest_t &sha_output,
+                                               typename WOTS<Params>::composition_t *P) {
     // implements an injection from integers in [0, 2^256-1]
-    // to restricted integer compositions of this->WeightConstant,
-    // where each part is in [0, this->depth] and there are exactly
-    // this->width parts.
-    array<byte, HASH_SIZE> sha_output;
-
-    // TODO concat random string to the end of message
-    sha256(message.data(), message.size(), sha_output.data());
-    BIGNUM *hash_as_int = NULL;
-    BN_hex2bn(&hash_as_int, print_bytes(sha_output.data(), sha_output.size()).c_str());
+    // to restricted integer compositions of Params::weight,
+    // where each part is in [0, Params::depth] and there are exactly
+    // Params::width parts.
 
-    // todo maybe calculate once and read in file. It doesn't take that long,
-    // though, so not such a big deal.
-    map<pair<int, int>, BIGNUM*> counts = build_counts_cache(this->WeightConstant, this->width, this->depth);
+    // the hash, read as a big-endian integer
+    count_t hash_as_int = {};
+    for (size_t i = 0; i < HASH_SIZE; i++) {
+        size_t limb = (HASH_SIZE - 1 - i) / 8;
+        hash_as_int[limb] = (hash_as_int[limb] << 8) | sha_output[i];
+    }
 
     // TODO prove that just the first 2^256 compositions are still misuse resistant
-    vector<size_t> composition = index_to_composition(this->WeightConstant, this->width,
-                                                      this->depth, hash_as_int, counts);
-    BN_free(hash_as_int);
-    free_cache(counts);
-    return composition;
+    index_to_composition(hash_as_int, P);
+}
+
+/**
+ * Sign a message with the one-time signature.
+ *
+ * Invalidates the object so it can't be used to sign any more messages.
+ *
+ * @param[in]  message    The message to sign
+ * @param      signature  Receives the one-time signature.
+ */
+template <class Params>
+void FixedWeightWOTS<Params>::sign(const vector<byte> &message, ots_signature_t *signature) {
+    this->sign_digest(digest_message(message), signature);
+}
+
+/**
+ * Sign a message given only its sha256 digest, e.g. from digest_file.
+ *
+ * Invalidates the object so it can't be used to sign any more messages.
+ *
+ * @param[in]  digest     The message digest
+ * @param      signature  Receives the one-time signature.
+ */
+template <class Params>
+void FixedWeightWOTS<Params>::sign_digest(const message_digest_t &digest, ots_signature_t *signature) {
+    typename WOTS<Params>::composition_t P;
+    {
+        PhaseTimer timer(PHASE_TRANSFORM_MESSAGE);
+        transform_digest(digest, &P);
+    }
+    this->sign_composition(P, signature);
+}
+
+/**
+ * Verify a pk, message, signature triplet.
+ *
+ * @param[in]  pk         The OTS public key.
+ * @param[in]  message    The message
+ * @param[in]  signature  The signature
+ *
+ * @return     True if it verifies correctly, false otherwise.
+ */
+template <class Params>
+bool FixedWeightWOTS<Params>::verify(const array<byte, HASH_SIZE> &pk, const vector<byte> &message,
+                                     const ots_signature_t &signature) {
+    return verify_digest(pk, digest_message(message), signature);
+}
+
+/**
+ * Verify a pk, message digest, signature triplet.
+ *
+ * @param[in]  pk         The OTS public key.
+ * @param[in]  digest     The message digest
+ * @param[in]  signature  The signature
+ *
+ * @return     True if it verifies correctly, false otherwise.
+ */
+template <class Params>
+bool FixedWeightWOTS<Params>::verify_digest(const array<byte, HASH_SIZE> &pk, const message_digest_t &digest,
+                                           const ots_signature_t &signature) {
+    typename WOTS<Params>::composition_t P;
+    {
+        PhaseTimer timer(PHASE_TRANSFORM_MESSAGE);
+        transform_digest(digest, &P);
+    }
+    return WOTS<Params>::verify_composition(pk, P, signature);
+}
+
+/**
+ * Compute the public key that a one-time signature on a message digest
+ * commits to. The signature is valid iff this is the signer's public key.
+ *
+ * @param[in]  digest     The message digest
+ * @param[in]  signature  The signature's Params::width chain values, back to back
+ * @param      pk         Receives the public key.
+ */
+template <class Params>
+void FixedWeightWOTS<Params>::recover_pk_digest(const message_digest_t &digest, const byte *signature,
+                                               array<byte, HASH_SIZE> *pk) {
+    typename WOTS<Params>::composition_t P;
+    {
+        PhaseTimer timer(PHASE_TRANSFORM_MESSAGE);
+        transform_digest(digest, &P);
+    }
+    WOTS<Params>::recover_pk(P, signature, pk);
 }
+
+template class WOTS<wots_w4>;
+template class WOTS<wots_w16>;
+template class WOTS<wots_w256>;
+template class BasicWOTS<wots_w4>;
+template class BasicWOTS<wots_w16>;
+template class BasicWOTS<wots_w256>;
+template class FixedWeightWOTS<wots_w4>;
+template class FixedWeightWOTS<wots_w16>;
+template class FixedWeightWOTS<wots_w256>;